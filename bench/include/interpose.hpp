@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+
+// Counters maintained by the wrappers in interpose.cpp. The bench exports
+// ioctl/read/close/syscall and the global operator new, so every call made
+// by libKProf goes through them.
+namespace KProfBench {
+uint64_t SyscallCount();
+uint64_t AllocationCount();
+};  // namespace KProfBench
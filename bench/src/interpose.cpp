@@ -0,0 +1,83 @@
+// Deliberately does not include the libc headers declaring the wrapped
+// functions, their exception specifications differ between versions.
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <cstdarg>
+#include <cstdlib>
+#include <new>
+
+#include "interpose.hpp"
+
+namespace {
+uint64_t syscalls = 0;
+uint64_t allocations = 0;
+
+template <typename Fn>
+Fn Next(const char* symbol) {
+  return reinterpret_cast<Fn>(dlsym(RTLD_NEXT, symbol));
+}
+};  // namespace
+
+namespace KProfBench {
+uint64_t SyscallCount() { return syscalls; }
+uint64_t AllocationCount() { return allocations; }
+};  // namespace KProfBench
+
+extern "C" {
+int ioctl(int fd, unsigned long request, ...) {
+  static auto next = Next<int (*)(int, unsigned long, ...)>("ioctl");
+  va_list args;
+  va_start(args, request);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+  syscalls++;
+  return next(fd, request, arg);
+}
+
+ssize_t read(int fd, void* buf, size_t count) {
+  static auto next = Next<ssize_t (*)(int, void*, size_t)>("read");
+  syscalls++;
+  return next(fd, buf, count);
+}
+
+int close(int fd) {
+  static auto next = Next<int (*)(int)>("close");
+  syscalls++;
+  return next(fd);
+}
+
+// used for perf_event_open, which has no libc wrapper, and the other calls
+// KProf makes directly (mbind takes six arguments, like any call not listed)
+long syscall(long number, ...) {
+  static auto next = Next<long (*)(long, ...)>("syscall");
+  // only the arguments the call takes may be read
+  int arity = 6;
+  switch (number) {
+    case SYS_gettid:
+      arity = 0;
+      break;
+    case SYS_perf_event_open:
+      arity = 5;
+      break;
+  }
+  va_list args;
+  va_start(args, number);
+  long a[6] = {};
+  for (int i = 0; i < arity; ++i) a[i] = va_arg(args, long);
+  va_end(args);
+  syscalls++;
+  return next(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+}
+
+void* operator new(size_t size) {
+  allocations++;
+  if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
@@ -0,0 +1,266 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "interpose.hpp"
+#include "kprof.hpp"
+
+using namespace KProf;
+
+// Microbenchmarks of KProf's own overhead: construction, config parsing,
+// start/stop of an empty region and report generation, for different
+// numbers of counters and group layouts.
+
+struct CounterDef {
+  const char* name;
+  const char* type;  // as written in a config file
+  const char* spec;
+  uint32_t typeID;  // as passed to RegisterCounter
+  uint64_t eventID;
+};
+
+// clang-format off
+// software events are available everywhere, including in VMs
+const CounterDef softwareCounters[] = {
+    {"Task-clock"       , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_TASK_CLOCK"       , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"Pagefaults-total" , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_PAGE_FAULTS"      , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"Context-switches" , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_CONTEXT_SWITCHES" , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"CPU-migrations"   , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_CPU_MIGRATIONS"   , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    {"Pagefaults-min"   , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_PAGE_FAULTS_MIN"  , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN},
+    {"Pagefaults-maj"   , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_PAGE_FAULTS_MAJ"  , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ},
+    {"Alignment-faults" , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_ALIGNMENT_FAULTS" , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_ALIGNMENT_FAULTS},
+    {"Emulation-faults" , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_EMULATION_FAULTS" , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_EMULATION_FAULTS},
+};
+
+const CounterDef hardwareCounters[] = {
+    {"HW-instructions"     , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_INSTRUCTIONS"        , PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"CPU-cycles"          , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_CPU_CYCLES"          , PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"Branch-instructions" , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_BRANCH_INSTRUCTIONS" , PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"Branch-misses"       , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_BRANCH_MISSES"       , PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"Cache-references"    , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_CACHE_REFERENCES"    , PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"Cache-misses"        , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_CACHE_MISSES"        , PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"Ref-cycles"          , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_REF_CPU_CYCLES"      , PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {"Bus-cycles"          , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_BUS_CYCLES"          , PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES},
+};
+// clang-format on
+
+enum Layout { GROUPED, SPLIT };
+
+struct BenchConfig {
+  const CounterDef* counters = softwareCounters;
+  size_t iterations = 2000;
+  size_t slowIterations = 100;  // for construction
+  bool csv = false;
+};
+
+struct Result {
+  std::string name;
+  std::string layout;
+  size_t numCounters;
+  double cycles;  // median per call
+  double syscalls;
+  double allocations;
+};
+
+inline uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+std::string WriteConfig(const CounterDef* counters, size_t n) {
+  char path[] = "/tmp/kprof_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) throw std::runtime_error("Could not create a config file");
+  close(fd);
+
+  std::ofstream file(path);
+  for (size_t i = 0; i < n; ++i)
+    file << counters[i].name << "," << counters[i].type << ","
+         << counters[i].spec << "\n";
+  return path;
+}
+
+// Opens n counters, either all in one group (as a config file does) or
+// each in a group of its own (as the default constructor does). `paths`
+// holds config files with all n counters and with the first one only.
+KProfEvent* OpenMonitor(const BenchConfig& config, size_t n, Layout layout,
+                        const std::pair<std::string, std::string>& paths) {
+  if (layout == GROUPED) return new KProfEvent(paths.first);
+
+  auto monitor = new KProfEvent(paths.second);
+
+  for (size_t i = 1; i < n; ++i) {
+    int leader = -1;
+    monitor->RegisterCounter(config.counters[i].name, leader,
+                             config.counters[i].typeID,
+                             config.counters[i].eventID, KProfEvent::USER);
+  }
+  return monitor;
+}
+
+Result Measure(const std::string& name, const std::string& layout,
+               size_t numCounters, size_t iterations,
+               const std::function<void()>& body) {
+  std::vector<uint64_t> samples(iterations);
+
+  auto syscalls = KProfBench::SyscallCount();
+  auto allocations = KProfBench::AllocationCount();
+  for (size_t i = 0; i < iterations; ++i) {
+    auto start = Now();
+    body();
+    samples[i] = Now() - start;
+  }
+  // the sample vector is allocated before counting starts
+  auto numSyscalls = KProfBench::SyscallCount() - syscalls;
+  auto numAllocations = KProfBench::AllocationCount() - allocations;
+
+  std::nth_element(samples.begin(), samples.begin() + iterations / 2,
+                   samples.end());
+  return {name,
+          layout,
+          numCounters,
+          (double)samples[iterations / 2],
+          (double)numSyscalls / iterations,
+          (double)numAllocations / iterations};
+}
+
+void PrintResults(const std::vector<Result>& results, double baseline,
+                  bool csv) {
+  if (csv) {
+    std::cout << "case,layout,counters,cycles,net_cycles,syscalls,allocations"
+              << std::endl;
+    for (auto& r : results)
+      std::cout << r.name << "," << r.layout << "," << r.numCounters << ","
+                << r.cycles << "," << r.cycles - baseline << "," << r.syscalls
+                << "," << r.allocations << std::endl;
+    return;
+  }
+
+  std::cout << std::left << std::setw(22) << "case" << std::setw(9)
+            << "layout" << std::right << std::setw(9) << "counters"
+            << std::setw(14) << "cycles" << std::setw(14) << "net cycles"
+            << std::setw(11) << "syscalls" << std::setw(9) << "allocs"
+            << std::endl;
+  for (auto& r : results)
+    std::cout << std::left << std::setw(22) << r.name << std::setw(9)
+              << r.layout << std::right << std::setw(9) << r.numCounters
+              << std::setw(14) << std::fixed << std::setprecision(0)
+              << r.cycles << std::setw(14) << r.cycles - baseline
+              << std::setw(11) << std::setprecision(2) << r.syscalls
+              << std::setw(9) << r.allocations << std::endl;
+}
+
+// a positive decimal number and nothing else, so "-1" cannot wrap around
+bool ParseCount(const char* text, size_t& value) {
+  auto end = text + strlen(text);
+  auto [last, error] = std::from_chars(text, end, value);
+  return error == std::errc() && last == end && value > 0;
+}
+
+int main(int argc, char* argv[]) {
+  BenchConfig config;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--hardware")
+      config.counters = hardwareCounters;
+    else if (arg == "--csv")
+      config.csv = true;
+    else if (arg == "--iterations" && i + 1 < argc &&
+             ParseCount(argv[i + 1], config.iterations))
+      ++i;
+    else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--hardware] [--csv] [--iterations N]" << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<Result> results;
+
+  // null baseline: the cost of taking the timestamps themselves
+  auto baseline = Measure("null", "-", 0, config.iterations, [] {});
+  results.push_back(baseline);
+
+  // parsing and evaluating a derived metric
+  results.push_back(Measure("metric-compile", "-", 2, config.iterations, [] {
+    KProfMetric metric("IPC", "HW-instructions / CPU-cycles");
+  }));
+  KProfMetric metric("Ratio", "(a + b) / (c - 1) * 100");
+  metric.Bind({"a", "b", "c"});
+  double values[] = {1.0, 2.0, 3.0};
+  volatile double sink;
+  results.push_back(Measure("metric-evaluate", "-", 3, config.iterations,
+                            [&] { sink = metric.Evaluate(values); }));
+
+  for (size_t n : {1, 2, 4, 8}) {
+    auto paths = std::make_pair(WriteConfig(config.counters, n),
+                                WriteConfig(config.counters, 1));
+
+    for (auto layout : {GROUPED, SPLIT}) {
+      if (n == 1 && layout == SPLIT) continue;
+      std::string layoutName = (layout == GROUPED) ? "grouped" : "split";
+
+      results.push_back(
+          Measure("construct", layoutName, n, config.slowIterations,
+                  [&] { delete OpenMonitor(config, n, layout, paths); }));
+
+      auto monitor = OpenMonitor(config, n, layout, paths);
+      auto names = monitor->GetCounterNames();
+      if (names.size() != n)
+        std::cerr << "Only " << names.size() << " of " << n
+                  << " counters could be opened." << std::endl;
+
+      results.push_back(
+          Measure("empty-region", layoutName, names.size(),
+                  config.iterations, [&] {
+                    monitor->StartCounters();
+                    monitor->StopCounters();
+                  }));
+      results.push_back(Measure("start", layoutName, names.size(),
+                                config.iterations, [&] {
+                                  monitor->StartCounters();
+                                }));
+      results.push_back(Measure("stop", layoutName, names.size(),
+                                config.iterations, [&] {
+                                  monitor->StopCounters();
+                                }));
+
+      // read modes: one counter, the raw report, the corrected report
+      results.push_back(Measure("get-counter", layoutName, names.size(),
+                                config.iterations, [&] {
+                                  sink = monitor->GetCounter(names[0]);
+                                }));
+      results.push_back(Measure("get-report-raw", layoutName, names.size(),
+                                config.iterations,
+                                [&] { monitor->GetReport(false); }));
+      results.push_back(Measure("get-report-corrected", layoutName,
+                                names.size(), config.iterations,
+                                [&] { monitor->GetReport(true); }));
+      delete monitor;
+    }
+    unlink(paths.first.c_str());
+    unlink(paths.second.c_str());
+  }
+
+  PrintResults(results, baseline.cycles, config.csv);
+  return 0;
+}
@@ -1,13 +1,15 @@
 #include <complex>  // to handle fftw output
 #include <cstdlib>
+#include <mutex>
 
+#include "Arena.hpp"
 #include "blis.h"
 #include "fftw3.h"
 #include "kprof.hpp"
 
 using namespace KProf;
 
-void dgemm_kernel(KProfEvent& monitor, size_t& timer) {
+void dgemm_kernel(KProfEvent& monitor, KProfArena& arena, size_t& timer) {
   // "borrowed" with minimal mods from BLIS typed API examples
 
   volatile dim_t m, n, k;
@@ -35,9 +37,9 @@ void dgemm_kernel(KProfEvent& monitor, size_t& timer) {
   csa = m;
   rsb = 1;
   csb = k;
-  c = (double*)std::malloc(m * n * sizeof(double));
-  a = (double*)std::malloc(m * k * sizeof(double));
-  b = (double*)std::malloc(k * n * sizeof(double));
+  c = arena.Get<double>("c", m * n);
+  a = arena.Get<double>("a", m * k);
+  b = arena.Get<double>("b", k * n);
 
   // Set the scalars to use.
   alpha = 0.707;
@@ -79,15 +81,10 @@ void dgemm_kernel(KProfEvent& monitor, size_t& timer) {
 
   // bli_dprintm("c: after gemm", m, n, c, rsc, csc, "% 4.3f", "");
 
-  // Free the memory obtained via malloc().
-  std::free(a);
-  std::free(b);
-  std::free(c);
-
   return;
 }
 
-void ddot_kernel(KProfEvent& monitor, size_t& timer) {
+void ddot_kernel(KProfEvent& monitor, KProfArena& arena, size_t& timer) {
   // borrowed pretty much exactly from BLIS docs
   double* x;
   double* y;
@@ -96,8 +93,8 @@ void ddot_kernel(KProfEvent& monitor, size_t& timer) {
 
   // create row vectors
   dim_t n = 256;
-  x = (double*)std::malloc(n * sizeof(double));
-  y = (double*)std::malloc(n * sizeof(double));
+  x = arena.Get<double>("x", n);
+  y = arena.Get<double>("y", n);
 
   // set them to random values
   bli_drandv(n, x, 1);
@@ -120,23 +117,28 @@ void ddot_kernel(KProfEvent& monitor, size_t& timer) {
     bli_ddotv(BLIS_NO_CONJUGATE, BLIS_NO_CONJUGATE, n, x, 1, y, 1, &z);
     monitor.StopCounters();
   }
-  free(x);
-  free(y);
 
   return;
 }
 
-void fftw_kernel(KProfEvent& monitor, size_t& timer) {
+void fftw_kernel(KProfEvent& monitor, KProfArena& arena, size_t& timer) {
   // first get a random vector
 
   dim_t n = 512;
 
-  dcomplex* x = (dcomplex*)fftw_malloc(sizeof(dcomplex) * n);
-  dcomplex* y = (dcomplex*)fftw_malloc(sizeof(dcomplex) * n);
+  dcomplex* x = arena.Get<dcomplex>("x", n);
+  dcomplex* y = arena.Get<dcomplex>("y", n);
 
-  fftw_plan plan = fftw_plan_dft_1d(n, reinterpret_cast<fftw_complex*>(x),
-                                    reinterpret_cast<fftw_complex*>(y),
-                                    FFTW_FORWARD, FFTW_ESTIMATE);
+  // only fftw_execute is thread-safe, and the scheduler runs jobs side by
+  // side
+  static std::mutex planner;
+  fftw_plan plan;
+  {
+    std::lock_guard<std::mutex> lock(planner);
+    plan = fftw_plan_dft_1d(n, reinterpret_cast<fftw_complex*>(x),
+                            reinterpret_cast<fftw_complex*>(y), FFTW_FORWARD,
+                            FFTW_ESTIMATE);
+  }
 
   bli_zrandv(n, x, 1);
 
@@ -155,14 +157,15 @@ void fftw_kernel(KProfEvent& monitor, size_t& timer) {
     fftw_execute(plan);
     monitor.StopCounters();
   }
-  fftw_destroy_plan(plan);
-  free(x);
-  free(y);
+  {
+    std::lock_guard<std::mutex> lock(planner);
+    fftw_destroy_plan(plan);
+  }
   return;
 }
 
 // change this to kProfEvent
-void sum_kernel(KProfEvent& monitor, size_t& timer) {
+void sum_kernel(KProfEvent& monitor, KProfArena& arena, size_t& timer) {
   volatile int sum = 0;
   {
     monitor.StartCounters();
@@ -183,7 +186,8 @@ void sum_kernel(KProfEvent& monitor, size_t& timer) {
   return;
 }
 
-void dynamic_sum_kernel(KProfEvent& monitor, size_t& timer, size_t j) {
+void dynamic_sum_kernel(KProfEvent& monitor, KProfArena& arena, size_t& timer,
+                        size_t j) {
   volatile int sum = 0;
   {
     monitor.StartCounters();
@@ -204,7 +208,8 @@ void dynamic_sum_kernel(KProfEvent& monitor, size_t& timer, size_t j) {
   return;
 }
 
-void dynamic_dgemm_kernel(KProfEvent& monitor, size_t& timer, size_t ndim) {
+void dynamic_dgemm_kernel(KProfEvent& monitor, KProfArena& arena,
+                          size_t& timer, size_t ndim) {
   // "borrowed" with minimal mods from BLIS typed API examples
 
   volatile dim_t m, n, k;
@@ -232,9 +237,9 @@ void dynamic_dgemm_kernel(KProfEvent& monitor, size_t& timer, size_t ndim) {
   csa = m;
   rsb = 1;
   csb = k;
-  c = (double*)std::malloc(m * n * sizeof(double));
-  a = (double*)std::malloc(m * k * sizeof(double));
-  b = (double*)std::malloc(k * n * sizeof(double));
+  c = arena.Get<double>("c", m * n);
+  a = arena.Get<double>("a", m * k);
+  b = arena.Get<double>("b", k * n);
 
   // Set the scalars to use.
   alpha = 0.707;
@@ -276,10 +281,5 @@ void dynamic_dgemm_kernel(KProfEvent& monitor, size_t& timer, size_t ndim) {
 
   // bli_dprintm("c: after gemm", m, n, c, rsc, csc, "% 4.3f", "");
 
-  // Free the memory obtained via malloc().
-  std::free(a);
-  std::free(b);
-  std::free(c);
-
   return;
 }
\ No newline at end of file
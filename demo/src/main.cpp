@@ -3,63 +3,87 @@
 #include <iostream>
 #include <string>
 
-#include "csvhelper.hpp"
+#include "Harness.hpp"
+#include "Scheduler.hpp"
+#include "Sink.hpp"
 #include "kernel.hpp"
 #include "kprof.hpp"
 
 using namespace KProf;
 
-typedef void (*driven)(KProfEvent&, size_t&);
+typedef void (*driven)(KProfEvent&, KProfArena&, size_t&);
 
-typedef void (*driven_dynamic)(KProfEvent&, size_t&, size_t);
+typedef void (*driven_dynamic)(KProfEvent&, KProfArena&, size_t&, size_t);
 
-void driver(driven drivee, std::string label = "", int runs = 100,
-            bool progress = true) {
-  {
-    // discard the first run as warmup
-    KProfEvent monitor;
-    size_t time;
-    drivee(monitor, time);
-  }
+// one kernel measured with one counter group
+struct DemoRun {
+  std::string label;
+  std::vector<size_t> times;  // one per kernel call, warmup included
+};
 
-  for (auto i = 0; i < runs; i++) {
-    {
-      KProfEvent monitor("hwgroup.csv");
-      size_t time;
-      drivee(monitor, time);
-      auto report = monitor.GetReport(true);
-      // monitor.PrintReport(report);
-      DumpCSV(label + std::string("_hwdata.csv"), report);
-      DumpTimeToCSV(label + std::string("_hwtime.csv"), i, time);
-    }
+void driver(std::vector<BenchmarkJob>& jobs, std::vector<DemoRun>& runs,
+            driven drivee, std::string label = "", int iterations = 100) {
+  HarnessOptions options;
+  options.warmup = 1;  // discard the first run as warmup
+  options.repetitions = iterations;
+  options.contamination = Contamination::RERUN;
 
-    {
-      KProfEvent monitor("cachegroup.csv");
-      size_t time;
-      drivee(monitor, time);
-      auto report = monitor.GetReport(true);
-      // monitor.PrintReport(report);
-      DumpCSV(label + std::string("_cachedata.csv"), report);
-      DumpTimeToCSV(label + std::string("_cachetime.csv"), i, time);
-    }
+  const std::pair<std::string, std::string> groups[] = {
+      {"hwgroup.csv", "_hw"}, {"cachegroup.csv", "_cache"}};
+  for (auto& [config, prefix] : groups) {
+    auto run = runs.size();
+    runs.push_back({label + prefix, {}});
+    jobs.push_back({label + prefix, config, options,
+                    [&runs, run, drivee](KProfEvent& m, KProfArena& arena) {
+                      size_t time;
+                      drivee(m, arena, time);
+                      runs[run].times.push_back(time);
+                    }});
+  }
+}
 
-    if (progress)
-      std::cout << "Completed " << i + 1 << "/" << runs << "iterations. \r";
+void write_results(const ScheduleResult& schedule,
+                   std::vector<BenchmarkJob>& jobs,
+                   std::vector<DemoRun>& runs) {
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    auto result = schedule.results[i];
+    auto& label = runs[i].label;
+    SinkOptions sinkOptions;
+    sinkOptions.metadata = {{"config", jobs[i].counterConfig}};
+    KProfSink data(label + "data.kpc", SinkFormat::COLUMNAR, sinkOptions);
+    KProfSink times(label + "time.kpc", SinkFormat::COLUMNAR, sinkOptions);
+    for (auto& sample : result.samples) {
+      sample.report.push_back(
+          KProfCounter("Contaminated", sample.contaminated));
+      data.Write(sample.report);
+      auto time = runs[i].times[jobs[i].options.warmup + sample.run];
+      std::vector<KProfCounter> row = {KProfCounter("runID", sample.run),
+                                       KProfCounter("time", time)};
+      times.Write(row);
+    }
+    KProfHarness::PrintSummary(result);
   }
 }
 
 void driver_dyn(driven_dynamic drivee, std::string label = "",
                 int init_runs = 100, bool progress = true) {
+  KProfArena arena;  // operands are reused while the size does not grow
+  KProfSink data(label + "_hwdata.csv", SinkFormat::CSV);
+  KProfSink times(label + "_hwtime.csv", SinkFormat::CSV);
   for (size_t j = 512; j <= init_runs; j += 512) {
     for (auto i = 0; i < 100; i++) {
       KProfEvent monitor("hwgroup.csv");
       size_t time;
-      drivee(monitor, time, j);
+      drivee(monitor, arena, time, j);
       auto report = monitor.GetReport(true);
       // monitor.PrintReport(report);
-      DumpCSV(label + std::string("_hwdata.csv"), report);
-      DumpTimeToCSV(label + std::string("_hwtime.csv"), j, time);
+      data.Write(report);
+      std::vector<KProfCounter> row = {KProfCounter("runID", j),
+                                       KProfCounter("time", time)};
+      times.Write(row);
     }
+    data.Flush();  // between sizes, outside the measured kernels
+    times.Flush();
 
     if (progress)
       std::cout << "Completed " << j << "/" << init_runs << " iterations."
@@ -69,10 +93,23 @@ void driver_dyn(driven_dynamic drivee, std::string label = "",
 
 int main(int argc, char* argv[]) {
   int runs = 4096;
-  driver(dgemm_kernel, "datafiles/del_dgemm", 10000, true);
-  driver(ddot_kernel, "datafiles/del_ddot", 10000, true);
-  driver(fftw_kernel, "datafiles/del_fftw", 10000, true);
-  driver(sum_kernel, "datafiles/del_sum", 10000, true);
+
+  // the kernels are independent, so they run side by side on separate cores
+  std::vector<BenchmarkJob> jobs;
+  std::vector<DemoRun> demoRuns;
+  driver(jobs, demoRuns, dgemm_kernel, "datafiles/del_dgemm", 10000);
+  driver(jobs, demoRuns, ddot_kernel, "datafiles/del_ddot", 10000);
+  driver(jobs, demoRuns, fftw_kernel, "datafiles/del_fftw", 10000);
+  driver(jobs, demoRuns, sum_kernel, "datafiles/del_sum", 10000);
+
+  SchedulerOptions options;
+  options.isolation = Isolation::CORE;
+  options.progress = true;
+  KProfScheduler scheduler(options);
+  auto schedule = scheduler.Run(jobs);
+  write_results(schedule, jobs, demoRuns);
+  std::cout << jobs.size() << " jobs on " << schedule.slots.size()
+            << " core(s) in " << schedule.wallTime << " s" << std::endl;
 
   // driver_dyn(dynamic_sum_kernel, "datafiles/dyn_sum", runs, true);
   // driver_dyn(dynamic_dgemm_kernel, "datafiles/dyn_dgemm", runs, true);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace KProf {
+enum class PageSize : uint8_t {
+  BASE,              // the system page size
+  TRANSPARENT_HUGE,  // madvise(MADV_HUGEPAGE), the kernel may decline
+  HUGE_2M,           // MAP_HUGETLB, needs pages reserved in vm.nr_hugepages
+  HUGE_1G
+};
+
+struct BufferOptions {
+  size_t alignment = 64;  // power of two, a cache line by default
+  PageSize pages = PageSize::BASE;
+  int numaNode = -1;      // bind with mbind(MPOL_BIND), -1 for first touch
+  bool prefault = true;   // fault the pages in at allocation
+};
+
+struct ArenaBuffer {
+  std::string name;
+  void* data = nullptr;
+  size_t size = 0;  // bytes last requested
+  BufferOptions options;
+  PageSize pages = PageSize::BASE;  // what the mapping actually got
+
+  // the whole mapping, data lies inside it
+  void* base = nullptr;
+  size_t mapped = 0;
+};
+
+// Named buffers which outlive the kernel calls requesting them. The first
+// Get() of a name maps the memory, later calls return the same buffer as
+// long as it is large enough, so the kernel's allocations and the page
+// faults they cause drop out of the measurements.
+class KProfArena {
+ public:
+  KProfArena() = default;
+  KProfArena(const BufferOptions& _defaults) : defaults(_defaults) {}
+  ~KProfArena() { Clear(); }
+
+  KProfArena(const KProfArena&) = delete;
+  KProfArena& operator=(const KProfArena&) = delete;
+
+  void* Get(const std::string& name, size_t size) {
+    return Get(name, size, defaults);
+  }
+  void* Get(const std::string&, size_t, const BufferOptions&);
+
+  template <typename T>
+  T* Get(const std::string& name, size_t count) {
+    return static_cast<T*>(Get(name, count * sizeof(T), defaults));
+  }
+  template <typename T>
+  T* Get(const std::string& name, size_t count, const BufferOptions& options) {
+    return static_cast<T*>(Get(name, count * sizeof(T), options));
+  }
+
+  void Release(const std::string&);
+  void Clear();
+
+  const std::vector<ArenaBuffer>& GetBuffers() const { return buffers; }
+  BufferOptions& GetDefaults() { return defaults; }
+
+  // number of mappings made so far; stays put while buffers are reused
+  size_t GetMappings() const { return mappings; }
+
+ private:
+  void Map(ArenaBuffer&);
+  void Unmap(ArenaBuffer&);
+
+ private:
+  BufferOptions defaults;
+  std::vector<ArenaBuffer> buffers;
+  size_t mappings = 0;
+};
+
+};  // namespace KProf
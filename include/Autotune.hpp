@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Harness.hpp"
+
+namespace KProf {
+enum class SearchStrategy : uint8_t {
+  EXHAUSTIVE,         // every candidate with the full harness repetitions
+  RANDOM,             // `randomTrials` candidates drawn without replacement
+  SUCCESSIVE_HALVING  // all candidates, the better half kept each round
+};
+
+struct TuningOptions {
+  SearchStrategy strategy = SearchStrategy::EXHAUSTIVE;
+  // report entry minimized: a counter, Wall-time or a derived metric
+  std::string objective = "Wall-time";
+  bool maximize = false;  // e.g. for IPC or FLOPs per second
+  std::string counterConfig;  // KProfEvent config file, empty for the default
+  HarnessOptions harness;     // repetitions per candidate, except halving
+  size_t randomTrials = 16;   // RANDOM
+  size_t firstRound = 5;      // SUCCESSIVE_HALVING: repetitions, doubled
+                              // every round up to harness.repetitions
+  uint64_t seed = 0;          // RANDOM, 0 for a random seed
+  // $KPROF_TUNING_CACHE, else ~/.cache/kprof/tuning.tsv
+  std::string cacheFile;
+  bool retune = false;  // ignore cached results
+};
+
+using TuningParameters = std::map<std::string, int64_t>;
+
+struct TuningCandidate {
+  std::string label;
+  TuningParameters parameters;
+  double score = 0.0;  // median of the objective over the clean samples
+  size_t repetitions = 0;
+};
+
+struct TuningResult {
+  std::string tuner;
+  std::string problem;
+  std::string objective;
+  std::string best;  // label of the best candidate
+  TuningParameters parameters;
+  double score = 0.0;
+  bool cached = false;  // taken from the cache, nothing was run
+  std::vector<TuningCandidate> evaluated;  // in order of evaluation
+};
+
+// Picks the best of a set of kernel variants, or the best point of a
+// parameter space, by a report entry measured with KProfHarness. Results
+// are cached on disk per tuner, CPU model, problem and objective, so that
+// later runs select the best variant without measuring. Kernels call
+// StartCounters()/StopCounters() around the part to tune, like the demo
+// kernels and BenchmarkJob kernels.
+class KProfAutotuner {
+ public:
+  using Kernel = std::function<void(KProfEvent&, KProfArena&)>;
+  using ParametricKernel =
+      std::function<void(KProfEvent&, KProfArena&, const TuningParameters&)>;
+
+  KProfAutotuner(const std::string& name,
+                 const TuningOptions& = TuningOptions());
+
+  TuningOptions& GetOptions() { return options; }
+
+  // a named variant, e.g. one FFTW planner flag
+  void AddVariant(const std::string& label, const Kernel& kernel);
+
+  // A parameter space: every combination of the values of the parameters
+  // is a candidate, labelled like "mb=32 nb=64".
+  void AddParameter(const std::string& name,
+                    const std::vector<int64_t>& values);
+  void SetKernel(const ParametricKernel& kernel);
+
+  // `problem` identifies the input, e.g. "m=n=k=1024"
+  TuningResult Tune(const std::string& problem);
+
+  // the kernel of a candidate, e.g. of TuningResult::best; throws if there
+  // is no such candidate
+  Kernel GetKernel(const std::string& label);
+
+  static void PrintResult(const TuningResult&);
+
+ private:
+  struct Candidate {
+    std::string label;
+    TuningParameters parameters;
+    Kernel kernel;
+  };
+
+  std::vector<Candidate> Candidates();
+  double Evaluate(KProfEvent&, const Candidate&, size_t repetitions);
+  bool Better(double a, double b) const;
+  std::string CacheFile();
+  bool LoadCached(const std::string& problem, TuningResult&);
+  void SaveCached(const TuningResult&);
+
+ private:
+  std::string name;
+  TuningOptions options;
+  std::vector<Candidate> variants;
+  std::vector<std::pair<std::string, std::vector<int64_t>>> parameters;
+  ParametricKernel parametric;
+};
+
+};  // namespace KProf
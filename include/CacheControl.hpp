@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace KProf {
+// Cache state the harness establishes before every repetition
+enum class CacheState : uint8_t {
+  ASIS,    // leave it to whatever the previous repetition left behind
+  COLD,    // nothing of the registered buffers is cached
+  WARM,    // registered buffers are touched right before the kernel
+  PARTIAL  // cold, then the leading residentFraction of each buffer touched
+};
+
+enum class FlushMethod : uint8_t {
+  CLFLUSH,  // flush the lines of the registered buffers
+  SWEEP     // stream through a buffer larger than the last level cache
+};
+
+const char* CacheStateName(CacheState);
+
+// Writes back and invalidates every line of the buffer in all cache levels.
+// Returns false if the architecture has no user-space flush instruction.
+bool FlushBuffer(const void*, size_t);
+
+// reads one word per cache line
+void TouchBuffer(const void*, size_t);
+
+// Evicts everything by streaming through twice the size of the last level
+// cache (or the given size). The sweep buffer is allocated once.
+class CacheSweeper {
+ public:
+  CacheSweeper(size_t size = 0);
+  ~CacheSweeper();
+
+  CacheSweeper(const CacheSweeper&) = delete;
+  CacheSweeper& operator=(const CacheSweeper&) = delete;
+
+  void Sweep();
+  size_t GetSize() { return size; }
+
+ private:
+  char* buffer = nullptr;
+  size_t size;
+};
+
+};  // namespace KProf
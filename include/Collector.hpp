@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "kprof.hpp"
+
+namespace KProf {
+// Region reports of several processes on one host are combined through a
+// ring buffer in a POSIX shared-memory segment. The aggregator creates the
+// segment, every worker publishes into it with a KProfPublisher, and the
+// aggregator drains it into a job-level report.
+
+constexpr size_t kCollectorNameLength = 48;
+constexpr size_t kCollectorCounters = 32;  // per record, the rest is dropped
+
+struct CollectorRecord {
+  std::atomic<uint64_t> sequence;  // ring protocol, see Collector.cpp
+  uint32_t rank;
+  uint32_t numCounters;
+  char region[kCollectorNameLength];
+  struct {
+    char name[kCollectorNameLength];
+    double value;
+    bool derived;
+  } counters[kCollectorCounters];
+};
+
+struct CollectorSegment {
+  uint64_t magic;
+  uint64_t capacity;  // records, a power of two
+  alignas(64) std::atomic<uint64_t> enqueuePos;
+  alignas(64) std::atomic<uint64_t> dequeuePos;
+  std::atomic<uint64_t> dropped;  // records lost to a full ring
+
+  // the records follow the header
+  CollectorRecord* Records() {
+    return reinterpret_cast<CollectorRecord*>(this + 1);
+  }
+};
+
+// Worker side. Publish() never blocks: if the aggregator falls behind and
+// the ring is full, the record is dropped and counted.
+class KProfPublisher {
+ public:
+  KProfPublisher(const std::string& segment = "/kprof", int rank = -1);
+  ~KProfPublisher();
+
+  KProfPublisher(const KProfPublisher&) = delete;
+  KProfPublisher& operator=(const KProfPublisher&) = delete;
+
+  bool Publish(const std::string& region, std::vector<KProfCounter>& report);
+
+  int GetRank() { return rank; }
+
+ private:
+  CollectorSegment* segment = nullptr;
+  size_t mapped = 0;
+  int rank;
+};
+
+// statistics of one counter of one region over the ranks
+struct RankStatistics {
+  std::string counter;
+  bool derived = false;  // metrics are averaged over a rank's records
+  double total = 0.0;    // summed over all ranks, NaN for metrics
+  double mean = 0.0;     // per rank
+  double min = 0.0;
+  double max = 0.0;
+  uint32_t minRank = 0;
+  uint32_t maxRank = 0;
+  double imbalance = 0.0;  // max / mean - 1, 0 when perfectly balanced
+};
+
+struct RegionSummary {
+  std::string region;
+  size_t ranks = 0;
+  size_t records = 0;
+  std::vector<RankStatistics> counters;
+};
+
+class KProfAggregator {
+ public:
+  KProfAggregator(const std::string& segment = "/kprof",
+                  size_t capacity = 1024);
+  ~KProfAggregator();  // removes the segment
+
+  KProfAggregator(const KProfAggregator&) = delete;
+  KProfAggregator& operator=(const KProfAggregator&) = delete;
+
+  // consumes everything published so far, returns the number of records
+  size_t Drain();
+
+  std::vector<RegionSummary> GetReport();
+  void PrintReport();
+
+  uint64_t GetDropped() { return segment->dropped.load(); }
+
+ private:
+  std::string name;
+  CollectorSegment* segment = nullptr;
+  size_t mapped = 0;
+
+  // region -> rank -> counter -> sum over the records
+  std::map<std::string,
+           std::map<uint32_t, std::map<std::string, double>>>
+      totals;
+  std::map<std::string, std::map<uint32_t, size_t>> recordCounts;
+  std::map<std::string, std::set<std::string>> derivedCounters;
+  std::map<std::string, std::vector<std::string>> counterOrder;
+};
+
+};  // namespace KProf
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace KProf {
+// KProf columnar files (.kpc), written by KProfSink with
+// SinkFormat::COLUMNAR. All integers are little endian.
+//
+//   header: "KPROFCOL" | u32 version | u32 columns | u32 metadata entries |
+//           per entry: u16 key length, key, u32 value length, value |
+//           per column: u8 derived, u16 length, name |
+//           zero padding to a multiple of 8 bytes
+//   chunk:  u32 rows | u32 columns |
+//           per column: u32 encoding, u32 0, u64 bytes, data padded to 8
+//
+// Counts are u64 and derived metrics doubles. PLAIN data is one 8-byte
+// value per row, so it can be used in place. DELTA data (counts only) is a
+// LEB128 varint per row of the zigzag encoded difference to the previous
+// row of the chunk, the first row taken against 0.
+enum class ColumnEncoding : uint32_t { PLAIN = 0, DELTA = 1 };
+
+constexpr char kColumnarMagic[8] = {'K', 'P', 'R', 'O', 'F', 'C', 'O', 'L'};
+constexpr uint32_t kColumnarVersion = 1;
+
+using Metadata = std::vector<std::pair<std::string, std::string>>;
+
+// True if `filename` starts with the columnar magic
+bool IsColumnarFile(const std::string& filename);
+
+std::string ColumnarHeader(const std::vector<std::string>& columns,
+                           const std::vector<bool>& derived,
+                           const Metadata& metadata);
+
+// Appends a chunk of `rows` rows, values[column][row] holding the bits of
+// counts and doubles alike. Count columns are delta encoded if `delta` is
+// set and that is smaller.
+void EncodeChunk(std::string& out,
+                 const std::vector<std::vector<uint64_t>>& values,
+                 const std::vector<bool>& derived, size_t rows, bool delta);
+
+// Maps a columnar file and exposes its chunks without copying them. The
+// file must not be truncated while the reader exists; rows appended later
+// are not seen. A partial trailing chunk, e.g. of a crashed run, is left
+// out with a warning.
+class KProfColumnReader {
+ public:
+  KProfColumnReader(const std::string& filename);
+  ~KProfColumnReader();
+
+  KProfColumnReader(const KProfColumnReader&) = delete;
+  KProfColumnReader& operator=(const KProfColumnReader&) = delete;
+
+  const Metadata& GetMetadata() const { return metadata; }
+  // empty if the key is missing
+  std::string GetMetadata(const std::string& key) const;
+
+  const std::vector<std::string>& GetColumns() const { return columns; }
+  bool IsDerived(size_t column) const { return derived[column]; }
+  // -1 if there is no such column
+  int FindColumn(const std::string& name) const;
+
+  size_t GetRows() const { return rows; }
+  size_t GetNumChunks() const { return chunks.size(); }
+  size_t GetChunkRows(size_t chunk) const { return chunks[chunk].rows; }
+
+  // Counts of a chunk. PLAIN chunks point into the mapping, DELTA chunks
+  // are decoded into `scratch`.
+  std::span<const uint64_t> GetCounts(size_t chunk, size_t column,
+                                      std::vector<uint64_t>& scratch) const;
+  // values of a derived column, always in place
+  std::span<const double> GetMetrics(size_t chunk, size_t column) const;
+
+  // all rows of a column, counts converted to double
+  std::vector<double> GetValues(size_t column) const;
+
+  // header of column names, then one line per row
+  void WriteCSV(std::ostream&) const;
+
+ private:
+  struct ColumnData {
+    ColumnEncoding encoding;
+    const uint8_t* data;
+    size_t bytes;
+  };
+  struct Chunk {
+    size_t rows;
+    std::vector<ColumnData> columns;
+  };
+
+  void Parse();
+
+ private:
+  std::string filename;
+  const uint8_t* base = nullptr;
+  size_t size = 0;
+
+  Metadata metadata;
+  std::vector<std::string> columns;
+  std::vector<bool> derived;
+  std::vector<Chunk> chunks;
+  size_t rows = 0;
+};
+
+};  // namespace KProf
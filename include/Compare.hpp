@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "DerivedMetrics.hpp"
+
+namespace KProf {
+// Samples of one kernel, one column per report entry, as written by a
+// KProfSink: CSV (a header line followed by one row per run) or columnar.
+struct SampleTable {
+  std::vector<std::string> columns;
+  std::vector<std::vector<double>> values;  // values[column][run]
+  // per column; in CSV files, columns with a non-integral value
+  std::vector<bool> derived;
+};
+
+SampleTable LoadSamples(const std::string& csvFile);
+
+struct CompareOptions {
+  double alpha = 0.01;      // significance level of the two-sided test
+  double threshold = 0.02;  // smallest relative change of the median reported
+  // Raw counts and Wall-time are lower-is-better, derived metrics go by
+  // GetMetricDirection(). These override both; a change of a column whose
+  // direction stays unknown is reported, but neither as a regression nor as
+  // an improvement.
+  std::unordered_set<std::string> higherIsBetter;
+  std::unordered_set<std::string> lowerIsBetter;
+  // columns that only index the rows
+  std::unordered_set<std::string> ignored = {"runID"};
+};
+
+struct ComparisonResult {
+  std::string counter;
+  size_t baselineRuns;
+  size_t currentRuns;
+  double baselineMedian;
+  double currentMedian;
+  double relativeChange;  // of the median, (current - baseline) / baseline
+  double pValue;          // Mann-Whitney U, normal approximation
+  double effectSize;      // rank-biserial correlation, > 0 if current is larger
+  bool significant;       // p < alpha and |relative change| >= threshold
+  MetricDirection direction;
+  bool regression;        // significant and in the bad direction
+};
+
+// Compares every column present in both tables with a Mann-Whitney U test
+std::vector<ComparisonResult> CompareSamples(const SampleTable& baseline,
+                                             const SampleTable& current,
+                                             const CompareOptions&);
+
+void PrintComparison(const std::string& title,
+                     const std::vector<ComparisonResult>&);
+
+};  // namespace KProf
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <csignal>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kprof.hpp"
+
+namespace KProf {
+struct WatchOptions {
+  bool inotify = true;  // reload when the file is written or replaced
+  int signal = SIGHUP;  // reload on this signal, 0 for none
+};
+
+// Reloads the counter set of running monitors from a config file, in the
+// format of KPROF_COUNTER_FILE. A thread of the watcher parses the file and
+// opens the new counters for the thread each monitor belongs to; a file
+// from which no counter can be opened is rejected and the monitors keep
+// their counters. The new set is published with an atomic pointer which
+// StartCounters() checks, so monitors switch between regions and measuring
+// threads never take a lock. The counters replaced are closed by the
+// watcher afterwards. Only counters, energy domains and metrics are
+// reloaded; counters added with TrackFrequency() or TrackFlops() are not
+// carried over.
+class KProfConfigWatcher {
+ public:
+  KProfConfigWatcher(const std::string& configFile,
+                     const WatchOptions& = WatchOptions());
+  ~KProfConfigWatcher();
+
+  KProfConfigWatcher(const KProfConfigWatcher&) = delete;
+  KProfConfigWatcher& operator=(const KProfConfigWatcher&) = delete;
+
+  // Reloaded counters are opened for the thread which constructed the
+  // monitor. Detach a monitor before destroying it.
+  void Attach(KProfEvent& monitor);
+  void Detach(KProfEvent& monitor);
+
+  // reads the file now and publishes it, false if it was rejected
+  bool Reload();
+
+  uint64_t GetReloads() const { return reloads; }
+  uint64_t GetRejected() const { return rejected; }
+
+ private:
+  void WatchLoop();
+  bool ConfigChanged();  // drains the inotify events
+  void Reclaim();
+
+ private:
+  std::string configFile;
+  std::string directory;
+  std::string basename;
+  WatchOptions options;
+
+  std::mutex lock;
+  std::vector<KProfEvent*> monitors;
+
+  int inotifyFD = -1;
+  int wakeFD = -1;  // eventfd for signals, Reload() requests and shutdown
+  struct sigaction previousAction;
+  std::atomic<bool> stopping = false;
+  std::atomic<uint64_t> reloads = 0;
+  std::atomic<uint64_t> rejected = 0;
+  std::thread watcher;
+};
+
+};  // namespace KProf
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace KProf {
+// Which way a metric should move, e.g. for the regression checks of Compare
+enum class MetricDirection : uint8_t {
+  UNKNOWN,
+  HIGHER_IS_BETTER,
+  LOWER_IS_BETTER
+};
+
+// By name: rates of work such as IPC, FLOPs and GBps, and Retiring, are
+// higher-is-better; CPI, miss, stall and *-Bound fractions, times and energy
+// are lower-is-better. Others, e.g. Frequency-ratio, are UNKNOWN.
+MetricDirection GetMetricDirection(const std::string& name);
+
+// A derived metric is an arithmetic expression over report labels, e.g.
+//   IPC = HW-instructions / CPU-cycles
+// The expression is compiled once into a small postfix program whose operands
+// are indices into the raw report, so evaluating it per report needs neither
+// parsing nor allocation.
+//
+// Labels may contain '-', so a subtraction must be surrounded by spaces:
+//   L1d-hits = L1d-read-access - L1d-read-miss
+// A metric may also refer to metrics defined before it.
+class KProfMetric {
+ public:
+  // evaluation stack depth, checked at compile time of the expression
+  static constexpr size_t maxStackDepth = 16;
+
+  KProfMetric(const std::string& name, const std::string& expression);
+
+  const std::string& GetName() const { return name; }
+  const std::string& GetExpression() const { return expression; }
+  MetricDirection GetDirection() const { return GetMetricDirection(name); }
+
+  // unique labels referenced by the expression, in order of appearance
+  const std::vector<std::string>& GetOperands() const { return operands; }
+
+  // resolve operands against the report labels, false if any is missing
+  bool Bind(const std::vector<std::string>& labels);
+
+  // values are laid out in the same order as the labels passed to Bind()
+  double Evaluate(const double* values) const;
+
+ private:
+  enum OpCode : uint8_t { PUSH_COUNTER, PUSH_CONST, ADD, SUB, MUL, DIV, NEG };
+
+  struct Instruction {
+    OpCode op;
+    uint32_t index;  // operand index before Bind(), report index after
+    double constant;
+  };
+
+  void ParseExpression();
+  void ParseTerm();
+  void ParseUnary();
+  void ParsePrimary();
+  void Emit(OpCode, uint32_t = 0, double = 0.0);
+  void SkipSpaces();
+  [[noreturn]] void Fail(const std::string&);
+
+ private:
+  std::string name;
+  std::string expression;
+  std::vector<std::string> operands;
+  std::vector<Instruction> program;
+  std::vector<Instruction> boundProgram;
+
+  // parser state, only used while compiling
+  size_t pos = 0;
+  size_t depth = 0;
+};
+
+// Splits the operands of all metrics into sets of counters which must be
+// scheduled in the same perf group, so that their ratios stay meaningful when
+// the kernel multiplexes groups. Labels not in `available` are left out.
+std::vector<std::vector<std::string>> PlanCoScheduling(
+    const std::vector<KProfMetric>&, const std::vector<std::string>& available);
+
+};  // namespace KProf
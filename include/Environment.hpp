@@ -0,0 +1,66 @@
+#pragma once
+
+#include <sched.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace KProf {
+struct EnvironmentOptions {
+  bool pin = true;  // bind the measuring thread to one CPU
+  int cpu = -1;     // CPU to pin to, -1 keeps the one the thread runs on
+  bool lockMemory = false;        // mlockall(MCL_CURRENT | MCL_FUTURE)
+  bool trackFrequency = true;     // see KProfEvent::TrackFrequency
+  double frequencyDrift = 0.02;   // tolerated deviation from the median ratio
+  double siblingLoadLimit = 0.05; // busy fraction of SMT siblings to warn at
+};
+
+// State of the machine around a measurement, as read from sysfs and
+// /proc/stat. Empty strings and -1 mean the kernel does not expose it.
+struct EnvironmentReport {
+  int cpu = -1;
+  bool pinned = false;
+  bool memoryLocked = false;
+  size_t prefaultedBytes = 0;
+  std::string governor;
+  int turbo = -1;  // 1 if turbo/boost is enabled
+  std::vector<int> siblings;  // SMT siblings of cpu, cpu excluded
+  double siblingLoad = -1.0;  // busy fraction of the siblings meanwhile
+  std::vector<std::string> warnings;
+
+  bool IsReproducible() const { return warnings.empty(); }
+};
+
+// Scoped guard: pins the calling thread and optionally locks its memory on
+// construction, and undoes both on destruction. Report() collects what
+// happened in between.
+class KProfEnvironmentGuard {
+ public:
+  KProfEnvironmentGuard() : KProfEnvironmentGuard(EnvironmentOptions()) {}
+  KProfEnvironmentGuard(const EnvironmentOptions&);
+  ~KProfEnvironmentGuard();
+
+  KProfEnvironmentGuard(const KProfEnvironmentGuard&) = delete;
+  KProfEnvironmentGuard& operator=(const KProfEnvironmentGuard&) = delete;
+
+  // writes one byte per page so the first repetition does not pay for the
+  // page faults
+  void Prefault(void*, size_t);
+
+  EnvironmentReport Report();
+
+  static void PrintReport(const EnvironmentReport&);
+
+ private:
+  void ReadCpuTimes(std::vector<uint64_t>&, std::vector<uint64_t>&);
+
+ private:
+  EnvironmentOptions options;
+  EnvironmentReport report;
+  cpu_set_t previousMask;
+  bool restoreMask = false;
+  std::vector<uint64_t> busyStart, totalStart;  // per sibling
+};
+
+};  // namespace KProf
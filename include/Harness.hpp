@@ -0,0 +1,112 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Arena.hpp"
+#include "CacheControl.hpp"
+#include "Environment.hpp"
+#include "kprof.hpp"
+
+namespace KProf {
+// What to do with a repetition during which the thread was descheduled,
+// migrated or hit a major page fault (see KProfEvent::IsContaminated)
+enum class Contamination : uint8_t {
+  KEEP,     // record it like any other
+  FLAG,     // record it, marked as contaminated
+  DISCARD,  // drop it
+  RERUN     // repeat it, up to maxReruns times, then flag it
+};
+
+struct HarnessOptions {
+  size_t warmup = 1;  // discarded runs before measuring
+  size_t repetitions = 100;
+  bool overheadCorrection = true;
+  Contamination contamination = Contamination::FLAG;
+  size_t maxReruns = 3;  // per repetition
+  bool progress = false;
+  bool guardEnvironment = false;  // apply a KProfEnvironmentGuard per Run()
+  EnvironmentOptions environment;
+  CacheState cacheState = CacheState::ASIS;  // before every kernel call
+  FlushMethod flushMethod = FlushMethod::CLFLUSH;
+  double residentFraction = 0.5;  // of each registered buffer, for PARTIAL
+  size_t sweepSize = 0;           // 0 sweeps twice the last level cache
+};
+
+struct Sample {
+  std::vector<KProfCounter> report;
+  KProfEvent::Disturbances disturbances;
+  bool contaminated = false;
+  bool frequencyDrift = false;  // clock ratio away from the run's median
+  uint64_t preparationTime = 0;  // ns spent establishing the cache state
+  size_t run = 0;  // index of the kernel call (warmup excluded)
+};
+
+struct HarnessResult {
+  std::string label;
+  std::vector<Sample> samples;
+  size_t runs = 0;          // measured kernel calls, re-runs included
+  size_t contaminated = 0;  // runs which were contaminated
+  size_t reruns = 0;
+  size_t discarded = 0;
+  size_t drifted = 0;  // samples with frequencyDrift set
+  bool guarded = false;           // ran under guardEnvironment
+  EnvironmentReport environment;  // only filled with guardEnvironment
+  CacheState cacheState = CacheState::ASIS;
+  FlushMethod flushMethod = FlushMethod::CLFLUSH;  // the one actually used
+  uint64_t preparationTime = 0;  // ns, all kernel calls including warmup
+  size_t preparations = 0;
+
+  double ContaminationRate() const {
+    return runs ? static_cast<double>(contaminated) / runs : 0.0;
+  }
+
+  // Median of a report entry over the clean samples, or over all samples
+  // if no clean one has it. NaN if no sample has it.
+  double CleanMedian(const std::string& entry) const;
+};
+
+// Runs a kernel repeatedly and collects one report per repetition. The
+// kernel calls StartCounters()/StopCounters() itself around the part it
+// wants measured, as the demo kernels do. With guardEnvironment set, the
+// thread is pinned for the duration of Run(), registered buffers are
+// prefaulted and the clock frequency of each sample is checked.
+class KProfHarness {
+ public:
+  using Kernel = std::function<void(KProfEvent&)>;
+
+  KProfHarness() = default;
+  KProfHarness(const HarnessOptions& _options) : options(_options) {}
+
+  HarnessOptions& GetOptions() { return options; }
+
+  // memory the kernel works on, prefaulted by the environment guard and
+  // flushed or touched according to cacheState
+  void RegisterBuffer(void* buffer, size_t size) {
+    buffers.push_back({buffer, size});
+  }
+
+  // Buffers a kernel can request instead of allocating on every call.
+  // They are treated like registered buffers.
+  KProfArena& GetArena() { return arena; }
+
+  HarnessResult Run(const std::string& label, KProfEvent& monitor,
+                    const Kernel& kernel);
+
+  static void PrintSummary(const HarnessResult&);
+
+ private:
+  void CheckFrequency(HarnessResult&);
+  uint64_t PrepareCache(HarnessResult&);
+  std::vector<std::pair<void*, size_t>> AllBuffers();
+
+ private:
+  HarnessOptions options;
+  std::vector<std::pair<void*, size_t>> buffers;
+  std::unique_ptr<CacheSweeper> sweeper;
+  KProfArena arena;
+};
+
+};  // namespace KProf
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "kprof.hpp"
+
+namespace KProf {
+// Histogram of u64 values with a fixed log-linear bucket layout: values
+// below 64 have a bucket each, larger ones 32 buckets per power of two, so
+// a bucket is at most 1/32 (3.1 %) of its lower bound wide. 1920 buckets
+// cover the whole range.
+class LogLinearHistogram {
+ public:
+  static constexpr unsigned kSubBits = 5;
+  static constexpr size_t kSubBuckets = size_t(1) << kSubBits;
+  static constexpr size_t kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+  static size_t BucketOf(uint64_t value) {
+    if (value < kSubBuckets) return value;
+    unsigned exponent = 63 - __builtin_clzll(value);
+    return ((exponent - kSubBits + 1) << kSubBits) |
+           ((value >> (exponent - kSubBits)) & (kSubBuckets - 1));
+  }
+  static uint64_t LowerBound(size_t bucket);
+  static uint64_t Width(size_t bucket);
+
+  LogLinearHistogram() : buckets(kBuckets, 0) {}
+
+  void Add(uint64_t value, uint64_t times = 1) {
+    buckets[BucketOf(value)] += times;
+    count += times;
+  }
+  void Merge(const LogLinearHistogram&);
+
+  uint64_t GetCount() const { return count; }
+  uint64_t GetBucket(size_t bucket) const { return buckets[bucket]; }
+
+  // percentile in [0, 100], the middle of the bucket it falls into; NaN if
+  // the histogram is empty
+  double Percentile(double percentile) const;
+  // mean of the bucket midpoints
+  double Mean() const;
+
+ private:
+  std::vector<uint64_t> buckets;
+  uint64_t count = 0;
+};
+
+// counters kept per region, further ones are left out
+constexpr size_t kDistributionValues = 16;
+
+struct DistributionSummary {
+  std::string name;
+  uint64_t count = 0;
+  double mean = 0.0;
+  double p50 = 0.0;
+  double p90 = 0.0;
+  double p99 = 0.0;
+  double p999 = 0.0;
+  double max = 0.0;
+};
+
+// Distributions of the counts of a region over its calls, at constant
+// memory: every thread adds each call to histograms of its own (one per
+// counter and one for the wall time), which GetReport() merges. Recording a
+// call takes a few integer operations per counter and no atomic read-modify
+// write. The first Record() of a thread allocates. The columns are fixed by
+// the first monitor recorded; counts are not overhead corrected.
+class KProfDistribution {
+ public:
+  KProfDistribution(const std::string& name = "");
+  ~KProfDistribution();
+
+  KProfDistribution(const KProfDistribution&) = delete;
+  KProfDistribution& operator=(const KProfDistribution&) = delete;
+
+  // adds the last region of `monitor`, i.e. call it after StopCounters()
+  void Record(KProfEvent& monitor);
+
+  const std::string& GetName() const { return name; }
+  // counter names, then Wall-time (ns); empty before the first Record()
+  std::vector<std::string> GetColumns();
+
+  // all threads merged; threads may keep recording
+  LogLinearHistogram GetHistogram(size_t column);
+  std::vector<DistributionSummary> GetReport();
+  void PrintReport();
+
+ private:
+  struct ThreadHistograms {
+    size_t columns;
+    // [column * kBuckets + bucket], written by the owning thread only
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+  };
+
+  ThreadHistograms& GetThreadHistograms(KProfEvent&);
+
+ private:
+  std::string name;
+  uint64_t id;  // slot in the thread-local lookup table
+
+  std::mutex lock;
+  std::vector<std::string> columns;
+  std::vector<std::unique_ptr<ThreadHistograms>> threads;
+};
+
+// Counts a region and records it for the lifetime of the object
+class DistributionScope {
+ public:
+  DistributionScope(KProfDistribution& _distribution, KProfEvent& _monitor)
+      : distribution(_distribution), monitor(_monitor) {
+    monitor.StartCounters();
+  }
+  ~DistributionScope() {
+    monitor.StopCounters();
+    distribution.Record(monitor);
+  }
+
+  DistributionScope(const DistributionScope&) = delete;
+  DistributionScope& operator=(const DistributionScope&) = delete;
+
+ private:
+  KProfDistribution& distribution;
+  KProfEvent& monitor;
+};
+
+};  // namespace KProf
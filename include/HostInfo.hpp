@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace KProf {
+// Identification of the machine the counters are read on. x86 parts are
+// identified with CPUID, everything else through /proc/cpuinfo.
+struct HostInfo {
+  std::string hostname;
+  std::string vendor;     // e.g. GenuineIntel, AuthenticAMD
+  std::string modelName;  // brand string
+  uint32_t family = 0;    // display family, extended family folded in
+  uint32_t model = 0;     // display model, extended model folded in
+  uint32_t stepping = 0;
+  bool hybrid = false;  // Intel hybrid part (P- and E-cores)
+
+  bool IsIntel() const { return vendor == "GenuineIntel"; }
+  bool IsAMD() const { return vendor == "AuthenticAMD"; }
+  bool IsZen4OrLater() const {
+    if (!IsAMD() || family < 0x19) return false;
+    return family > 0x19 || (model >= 0x10 && model <= 0x1F) ||
+           (model >= 0x60 && model <= 0x7F) || (model >= 0xA0 && model <= 0xAF);
+  }
+};
+
+// detected once, then cached for the lifetime of the process
+const HostInfo& GetHostInfo();
+
+// Placement of one logical CPU, from /sys/devices/system/cpu/cpuN/
+struct CpuTopology {
+  int cpu = -1;
+  int core = -1;     // core_id, unique within a package
+  int package = -1;  // physical_package_id
+  int llc = -1;      // lowest CPU sharing the last level cache
+  std::vector<int> siblings;  // SMT siblings, this CPU included
+};
+
+// online CPUs only
+std::vector<CpuTopology> GetTopology();
+
+// One cache of a CPU, from /sys/devices/system/cpu/cpuN/cache/indexM/
+struct CacheInfo {
+  int level = 0;
+  std::string type;  // Data, Instruction or Unified
+  size_t size = 0;   // bytes
+  size_t lineSize = 64;
+  std::vector<int> sharedWith;  // CPUs sharing this cache
+};
+
+// caches of one CPU, innermost first
+std::vector<CacheInfo> GetCaches(int cpu = 0);
+
+// size of the last level cache of a CPU, 0 if unknown
+size_t LastLevelCacheSize(int cpu = 0);
+
+// parses kernel CPU lists such as "0-3,8,10-11"
+std::vector<int> ParseCpuList(const std::string&);
+
+// first line of a sysfs/procfs file, empty if it cannot be read
+std::string ReadSysfs(const std::string&);
+// same, as an integer, -1 if it cannot be read
+int ReadSysfsInt(const std::string&);
+
+// where results measured on this host are cached: $XDG_CACHE_HOME/kprof,
+// else ~/.cache/kprof, else /tmp/kprof
+std::string CacheDirectory();
+
+};  // namespace KProf
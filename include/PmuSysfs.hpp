@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace KProf {
+// Helpers for the PMUs the kernel exports under
+// /sys/bus/event_source/devices/<pmu>/
+
+// perf_event_attr.type of a PMU, -1 if the PMU does not exist
+int PmuType(const std::string& pmu);
+
+bool PmuHasEvent(const std::string& pmu, const std::string& event);
+
+// Encodes a named event (e.g. "topdown-fe-bound") into perf_event_attr.config
+// using the PMU's format/ description. Returns false if the event is not
+// exported or needs fields outside of `config`.
+bool PmuEventConfig(const std::string& pmu, const std::string& event,
+                    uint64_t& config);
+
+// Encodes a term list such as "event=0xa3,umask=0x14,cmask=20" the same way
+bool PmuEncodeTerms(const std::string& pmu, const std::string& terms,
+                    uint64_t& config);
+
+// PMUs whose name starts with `prefix`, e.g. "uncore_imc" finds
+// uncore_imc_0 ... uncore_imc_N, sorted by name
+std::vector<std::string> FindPmus(const std::string& prefix);
+
+// CPUs on which events of an uncore PMU are to be opened, typically one per
+// socket or die. Empty for core PMUs, which have no cpumask.
+std::vector<int> PmuCpumask(const std::string& pmu);
+
+// Scale and unit the kernel exports for an event (e.g. 6.103515625e-5 and
+// "MiB" for a memory controller CAS count). False if there is no .scale.
+bool PmuEventScale(const std::string& pmu, const std::string& event,
+                   double& scale, std::string& unit);
+
+// x86 raw encodings: event select, unit mask and counter mask
+constexpr uint64_t IntelRaw(uint64_t event, uint64_t umask,
+                            uint64_t cmask = 0) {
+  return event | (umask << 8) | (cmask << 24);
+}
+
+// AMD keeps bits 8-11 of the event select in config bits 32-35
+constexpr uint64_t AMDRaw(uint64_t event, uint64_t umask) {
+  return (event & 0xFF) | (umask << 8) | ((event & 0xF00) << 24);
+}
+
+};  // namespace KProf
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "Harness.hpp"
+#include "kprof.hpp"
+
+namespace KProf {
+// A directory of results appended over many runs:
+//
+//   strings.kpd    interned labels, hosts, revisions and column names, one
+//                  per line, the id being the line number
+//   index.kpi      "KPROFIDX" | u32 version | u32 0 | one StoreIndexEntry
+//                  per record
+//   segment-N.kps  "KPROFSEG" | u32 version | u32 0 | records, a record
+//                  being u32 values | u32 0 | u32 column ids, padded to 8 |
+//                  f64 values
+//
+// Files are only ever appended to. A record is written to its segment
+// before its index entry, and strings before either, so a reader mapping
+// the files sees a consistent prefix; a torn entry at the end of the index,
+// e.g. of a crashed run, is ignored. Writers serialize on a lock file.
+constexpr char kStoreIndexMagic[8] = {'K', 'P', 'R', 'O', 'F', 'I', 'D', 'X'};
+constexpr char kStoreSegmentMagic[8] = {'K', 'P', 'R', 'O', 'F',
+                                        'S', 'E', 'G'};
+constexpr uint32_t kStoreVersion = 1;
+
+struct StoreIndexEntry {
+  uint32_t label;  // string ids
+  uint32_t host;
+  uint32_t revision;
+  uint32_t segment;
+  uint64_t configHash;
+  int64_t timestamp;  // ns since the epoch
+  uint64_t offset;    // of the record in its segment
+};
+
+struct StoreOptions {
+  // $KPROF_STORE, else $XDG_DATA_HOME/kprof/results or
+  // ~/.local/share/kprof/results
+  std::string directory;
+  // $KPROF_REVISION, else the HEAD of the git checkout around the working
+  // directory, else "unknown"
+  std::string revision;
+  std::string host;  // the CPU model by default
+  size_t segmentSize = 64 << 20;  // a new segment is started beyond this
+};
+
+struct StoredRecord {
+  std::string label;
+  std::string host;
+  std::string revision;
+  uint64_t configHash = 0;
+  int64_t timestamp = 0;
+  std::vector<std::pair<std::string, double>> values;
+
+  // NaN if there is no such column
+  double Get(const std::string& column) const;
+};
+
+// Empty strings and a zero hash match anything. Times are ns since the
+// epoch, both ends included.
+struct StoreQuery {
+  std::string label;
+  std::string host;
+  std::string revision;
+  uint64_t configHash = 0;
+  int64_t from = std::numeric_limits<int64_t>::min();
+  int64_t to = std::numeric_limits<int64_t>::max();
+};
+
+enum class StoreGrouping : uint8_t { NONE, REVISION, DAY, WEEK, MONTH };
+
+struct StoreSummary {
+  std::string label;
+  std::string host;
+  uint64_t configHash = 0;
+  std::string group;  // revision or first day of the period, else empty
+  size_t count = 0;
+  double mean = 0.0;
+  double stddev = 0.0;
+  double min = 0.0;
+  double median = 0.0;
+  double max = 0.0;
+  int64_t first = 0;  // timestamps of the oldest and newest record
+  int64_t last = 0;
+};
+
+// all records with one label, host and counter configuration
+struct StoreSeries {
+  std::string label;
+  std::string host;
+  uint64_t configHash = 0;
+  size_t records = 0;
+  size_t revisions = 0;
+  int64_t first = 0;
+  int64_t last = 0;
+};
+
+// "90d", "12h", "30m" or "2w" before now, or a UTC date "2024-05-01",
+// optionally with a time "2024-05-01T12:00:00"; throws if it is neither
+int64_t ParseStoreTime(const std::string&);
+// UTC, e.g. 2024-05-01T12:00:00Z
+std::string FormatStoreTime(int64_t timestamp);
+
+// Results kept across runs for trend queries, e.g. the IPC of one kernel on
+// one host over the last 90 days. A record is one report, keyed by kernel
+// label, counter configuration, host, revision and time; the configuration
+// is identified by a hash of the report's entry names. Opening a store maps
+// its index and groups the entries per (label, configuration, host) series,
+// ordered by time, so a query only touches the records in its range.
+class KProfResultStore {
+ public:
+  KProfResultStore(const StoreOptions& = StoreOptions());
+  ~KProfResultStore();
+
+  KProfResultStore(const KProfResultStore&) = delete;
+  KProfResultStore& operator=(const KProfResultStore&) = delete;
+
+  const std::string& GetDirectory() const { return directory; }
+
+  // timestamp 0 for now
+  void Append(const std::string& label,
+              const std::vector<KProfCounter>& report, int64_t timestamp = 0);
+  // every sample of a harness run, under its label
+  void Append(const HarnessResult&, int64_t timestamp = 0);
+  // columns by name, e.g. of a file loaded with LoadSamples()
+  void Append(const std::string& label,
+              const std::vector<std::pair<std::string, double>>& values,
+              int64_t timestamp = 0);
+
+  // picks up records appended by other processes since
+  void Refresh();
+
+  // ordered by series, then time
+  std::vector<StoredRecord> Query(const StoreQuery&);
+  std::vector<StoreSummary> Summarize(const StoreQuery&,
+                                      const std::string& column,
+                                      StoreGrouping = StoreGrouping::NONE);
+  std::vector<StoreSeries> GetSeries();
+
+  static uint64_t ConfigHash(const std::vector<std::string>& columns);
+  static void PrintSummary(const std::vector<StoreSummary>&,
+                           const std::string& column);
+
+ private:
+  struct Mapping {
+    const uint8_t* base = nullptr;
+    size_t size = 0;
+  };
+
+  static void Unmap(Mapping&);
+  void LoadStrings();
+  uint32_t Intern(const std::string&);
+  void MapIndex();
+  const StoreIndexEntry& Entry(size_t i) const;
+  // the segment mapped at least up to `end`
+  const Mapping& MapSegment(uint32_t segment, size_t end);
+  // the column ids and values of a record, checked against the mapping
+  size_t RecordAt(const StoreIndexEntry&, const uint32_t*& columns,
+                  const uint8_t*& values);
+  StoredRecord ReadRecord(const StoreIndexEntry&);
+  template <typename Fn>
+  void ForEachEntry(const StoreQuery&, Fn&&);
+
+ private:
+  std::string directory;
+  StoreOptions options;
+
+  std::vector<std::string> strings;
+  std::map<std::string, uint32_t> stringIds;
+  size_t stringsRead = 0;  // bytes of strings.kpd parsed so far
+
+  Mapping index;
+  size_t entries = 0;
+  // (label, configHash, host) -> index entries ordered by time
+  std::map<std::tuple<uint32_t, uint64_t, uint32_t>, std::vector<uint32_t>>
+      series;
+  std::map<uint32_t, Mapping> segments;
+};
+
+};  // namespace KProf
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Harness.hpp"
+#include "kprof.hpp"
+
+namespace KProf {
+// Sustained bandwidth of one level of the memory hierarchy, measured with a
+// STREAM triad (a = b + s * c) over a working set that fits in it
+struct BandwidthRoof {
+  std::string level;  // L1, L2, L3 or DRAM
+  size_t workingSet = 0;  // bytes, all three arrays
+  double bandwidth = 0.0;  // GB/s, STREAM byte counting
+};
+
+// Ceilings of one core of the host. Both roofs are single-thread figures
+// and depend on the clock, so measure with the frequency fixed if you can.
+struct MachineModel {
+  std::string cpu;  // brand string of the host the model was measured on
+  std::string isa;  // widest vector extension measured
+  double peak = 0.0;  // GFLOP/s of double precision FMAs at `isa`
+  std::vector<std::pair<std::string, double>> peaks;  // GFLOP/s per ISA
+  std::vector<BandwidthRoof> bandwidths;               // innermost first
+
+  // nullptr if the level was not measured
+  const BandwidthRoof* Roof(const std::string& level) const;
+
+  // arithmetic intensity above which `level` no longer limits a kernel
+  double Ridge(const std::string& level) const;
+};
+
+// One region placed on the roofline
+struct RooflinePoint {
+  std::string label;
+  std::string level;  // memory level whose roof was used
+  double flops = 0.0;
+  double bytes = 0.0;
+  double seconds = 0.0;
+  double intensity = 0.0;  // FLOP/byte
+  double attained = 0.0;   // GFLOP/s
+  double ceiling = 0.0;    // GFLOP/s, the roof at this intensity
+  bool computeBound = false;
+
+  // share of the ceiling the region reaches
+  double Efficiency() const { return ceiling > 0.0 ? attained / ceiling : 0.0; }
+};
+
+struct RooflineOptions {
+  // machine model cache; empty for $KPROF_MACHINE_MODEL, or else
+  // $XDG_CACHE_HOME/kprof/machine-model.csv
+  std::string cacheFile;
+  bool remeasure = false;  // ignore a cached model
+  double minTime = 0.05;   // seconds per timed kernel call
+  size_t trials = 5;       // best of
+  size_t dramSize = 0;     // DRAM working set, 0 for 4x the last level cache
+};
+
+// Measures the peak floating point throughput and the bandwidth of each
+// memory level of the calling core, and places regions against them. The
+// model is measured once per host and then read back from its cache file.
+class KProfRoofline {
+ public:
+  KProfRoofline() = default;
+  KProfRoofline(const RooflineOptions& _options) : options(_options) {}
+
+  RooflineOptions& GetOptions() { return options; }
+
+  // the cached model, measured (and cached) if there is none for this host
+  const MachineModel& GetModel();
+
+  // measures the model without touching the cache
+  MachineModel Measure();
+
+  // FLOP and byte counts of one region and its duration. `level` picks the
+  // bandwidth roof, the point is compute bound if it lies past that ridge.
+  RooflinePoint Place(const std::string& label, double flops, double bytes,
+                      double seconds, const std::string& level = "DRAM");
+
+  // Takes the work from the FLOPs and Bytes entries of a report (see
+  // KProfEvent::TrackFlops and derived metrics) unless declared, and the
+  // time from Wall-time.
+  RooflinePoint Place(const std::string& label,
+                      std::vector<KProfCounter>& report, double flops = 0.0,
+                      double bytes = 0.0, const std::string& level = "DRAM");
+
+  // same, with the median of each quantity over the samples of a run
+  RooflinePoint Place(const HarnessResult&, double flops = 0.0,
+                      double bytes = 0.0, const std::string& level = "DRAM");
+
+  static void PrintModel(const MachineModel&);
+  static void PrintPoint(const RooflinePoint&);
+
+ private:
+  std::string CacheFile();
+  bool LoadModel(const std::string&, MachineModel&);
+  void SaveModel(const std::string&, const MachineModel&);
+
+ private:
+  RooflineOptions options;
+  MachineModel model;
+  bool loaded = false;
+};
+
+};  // namespace KProf
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kprof.hpp"
+
+namespace KProf {
+enum class SamplingPolicy : uint8_t {
+  ALWAYS,      // every call, i.e. no sampling
+  EVERY_NTH,   // one call in `period`
+  RANDOM,      // gaps drawn uniformly from [1, 2 * period - 1]
+  TIME_BUDGET  // gaps adapted to keep the overhead under `overheadBudget`
+};
+
+struct SamplingOptions {
+  SamplingPolicy policy = SamplingPolicy::EVERY_NTH;
+  uint64_t period = 1000;        // EVERY_NTH and RANDOM, first gap otherwise
+  double overheadBudget = 0.01;  // TIME_BUDGET, of the time in the region
+  uint64_t maxPeriod = uint64_t(1) << 24;  // TIME_BUDGET
+  bool overheadCorrection = true;  // subtract an empty region from the means
+};
+
+// One report entry, extrapolated from the sampled calls. The errors are
+// standard errors of the sample mean, with the finite population
+// correction; about 95 % of the time the true value is within two of them.
+struct SampledValue {
+  std::string name;
+  double perCall = 0.0;
+  double perCallError = 0.0;
+  double total = 0.0;  // perCall * calls
+  double totalError = 0.0;
+};
+
+struct SamplingReport {
+  uint64_t calls = 0;
+  uint64_t samples = 0;
+  // time spent starting, stopping and reading the counters, relative to the
+  // estimated time spent in the region
+  double overhead = 0.0;
+  std::vector<SampledValue> counters;  // the counters, then Wall-time (ns)
+  // derived metrics of the monitor, evaluated on the per-call means
+  std::vector<std::pair<std::string, double>> metrics;
+};
+
+// A region instrumented on a fraction of its calls. Calls that are not
+// sampled cost a decrement and a branch; sampled calls start and stop the
+// monitor and fold its counts into running means. Like KProfEvent, a region
+// belongs to one thread, e.g. a thread_local object per handler:
+//
+//   if (region.Begin()) { handle(); region.End(); } else { handle(); }
+//
+// or with SampledScope.
+class KProfSampledRegion {
+ public:
+  // runs a few empty regions on the monitor to calibrate its overhead
+  KProfSampledRegion(KProfEvent& monitor,
+                     const SamplingOptions& = SamplingOptions());
+
+  // true if this call is sampled, in which case End() must follow it
+  bool Begin() {
+    if (--countdown != 0) return false;
+    StartSample();
+    return true;
+  }
+  void End() { StopSample(); }
+
+  uint64_t GetCalls() const { return scheduled - countdown; }
+  uint64_t GetSamples() const { return samples; }
+  uint64_t GetPeriod() const { return period; }  // the current gap
+
+  SamplingReport GetReport();
+  static void PrintReport(const SamplingReport&);
+
+  // forgets all calls and samples
+  void Reset();
+
+ private:
+  void StartSample();
+  void StopSample();
+  void Schedule();  // draws the gap to the next sample
+
+ private:
+  KProfEvent& monitor;
+  SamplingOptions options;
+
+  uint64_t countdown = 1;  // calls until the next sample
+  uint64_t scheduled = 0;  // calls covered by the gaps drawn so far
+  uint64_t period = 1;
+  uint64_t samples = 0;
+
+  // running means and squared deviations, counters then wall time
+  std::vector<uint64_t> counts;
+  std::vector<double> means;
+  std::vector<double> deviations;
+  std::vector<double> empty;  // counts and wall time of an empty region
+  double instrumentationTime = 0.0;  // ns, all but the region itself
+  std::chrono::high_resolution_clock::time_point sampleStart;
+};
+
+// Begins a sampled call of the region and ends it with the scope
+class SampledScope {
+ public:
+  SampledScope(KProfSampledRegion& _region)
+      : region(_region), sampled(_region.Begin()) {}
+  ~SampledScope() {
+    if (sampled) region.End();
+  }
+
+  SampledScope(const SampledScope&) = delete;
+  SampledScope& operator=(const SampledScope&) = delete;
+
+ private:
+  KProfSampledRegion& region;
+  bool sampled;
+};
+
+};  // namespace KProf
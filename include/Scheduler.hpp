@@ -0,0 +1,67 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Harness.hpp"
+
+namespace KProf {
+// how much hardware concurrently running jobs may share
+enum class Isolation : uint8_t {
+  SHARED,  // any CPU, SMT siblings included
+  CORE,    // one job per physical core
+  LLC      // one job per last level cache
+};
+
+struct SchedulerOptions {
+  // candidate CPUs; empty means the CPUs in isolcpus, or if there are none,
+  // every CPU the process may run on
+  std::vector<int> cpus;
+  Isolation isolation = Isolation::CORE;
+  size_t maxWorkers = 0;  // 0 for as many as the placement allows
+  bool progress = false;
+};
+
+// One independent benchmark: a kernel run through a KProfHarness with its own
+// counter session. The kernel gets the harness' arena for its operands.
+struct BenchmarkJob {
+  using Kernel = std::function<void(KProfEvent&, KProfArena&)>;
+
+  std::string label;
+  std::string counterConfig;  // KProfEvent config file, empty for the default
+  HarnessOptions options;
+  Kernel kernel;
+  bool exclusive = false;  // run alone, e.g. memory bandwidth bound kernels
+};
+
+struct ScheduleResult {
+  std::vector<HarnessResult> results;  // in job order, as a serial run
+  std::vector<int> cpus;               // CPU each job ran on
+  std::vector<int> slots;              // CPUs used by the workers
+  double wallTime = 0.0;               // seconds for the whole sweep
+};
+
+// Runs jobs concurrently on worker threads pinned to CPUs picked from the
+// sysfs topology, so that no two workers share what `isolation` forbids.
+// Exclusive jobs run afterwards, one at a time.
+class KProfScheduler {
+ public:
+  KProfScheduler() = default;
+  KProfScheduler(const SchedulerOptions& _options) : options(_options) {}
+
+  SchedulerOptions& GetOptions() { return options; }
+
+  // CPUs workers would be pinned to
+  std::vector<int> PlanSlots();
+
+  ScheduleResult Run(std::vector<BenchmarkJob>&);
+
+ private:
+  HarnessResult RunJob(BenchmarkJob&, int cpu);
+
+ private:
+  SchedulerOptions options;
+};
+
+};  // namespace KProf
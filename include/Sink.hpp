@@ -0,0 +1,98 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Columnar.hpp"
+#include "kprof.hpp"
+
+namespace KProf {
+enum class SinkFormat : uint8_t {
+  CSV,    // header line, then one line per report
+  JSONL,  // one JSON object per report
+  BINARY,   // header with the column names, then 8 bytes per value
+  COLUMNAR  // chunks of columns, see Columnar.hpp
+};
+
+struct SinkOptions {
+  size_t bufferSize = size_t(1) << 20;  // bytes formatted before a flush
+  bool background = true;  // write full buffers on a thread of the sink
+  bool append = true;      // keep what the file already holds
+  // COLUMNAR only
+  bool deltaEncode = true;  // delta encode count columns where smaller
+  Metadata metadata;        // stored after the host and CPU model
+};
+
+// JSON string literal of `text`, quotes included
+std::string JsonString(const std::string& text);
+
+// An output file which stays open for the lifetime of the sink. Reports are
+// formatted with std::to_chars into a large buffer. Full buffers go to a
+// writer thread (or, without `background`, are written by the next Write()
+// call that fills one), so that measuring threads only pay for formatting.
+// Call Flush() between runs to push out a partial buffer. A sink must only
+// be written by one thread at a time.
+//
+// Columns are fixed by the first report written: counts are stored as
+// integers and derived metrics as doubles. Reports of a different length
+// are rejected. COLUMNAR files collect `bufferSize` bytes of values per
+// chunk and are read back with KProfColumnReader. The binary layout is
+//   "KPROFROW" | u32 version | u32 columns |
+//   per column: u8 derived, u16 length, name |
+//   per report: one u64 or double per column, little endian
+class KProfSink {
+ public:
+  KProfSink(const std::string& filename, SinkFormat format,
+            const SinkOptions& = SinkOptions());
+  ~KProfSink();
+
+  KProfSink(const KProfSink&) = delete;
+  KProfSink& operator=(const KProfSink&) = delete;
+
+  // false if the report does not match the columns of the sink
+  bool Write(std::vector<KProfCounter>& report);
+
+  // hands the partial buffer to the writer and waits until all is written
+  void Flush();
+
+  const std::string& GetFilename() const { return filename; }
+  size_t GetRows() const { return rows; }
+
+ private:
+  void WriteHeader(std::vector<KProfCounter>&);
+  void FormatRow(std::vector<KProfCounter>&);
+  void EncodeStaged();  // COLUMNAR: staged rows become a chunk
+  void Submit();        // queue the current buffer
+  void WriteOut(const std::string&);
+  void WriterLoop();
+
+ private:
+  std::string filename;
+  SinkFormat format;
+  SinkOptions options;
+  int fd = -1;
+  bool existing = false;  // the file held data when it was opened
+
+  std::vector<std::string> columns;
+  std::vector<bool> derived;
+  std::vector<std::string> jsonKeys;  // "name": per column
+  size_t rows = 0;
+  std::vector<std::vector<uint64_t>> staged;  // COLUMNAR, [column][row]
+  size_t stagedRows = 0;
+
+  std::string buffer;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable drained;
+  std::deque<std::string> pending;
+  std::vector<std::string> spare;  // written buffers, kept for reuse
+  bool writing = false;
+  bool stopping = false;
+  std::thread writer;
+};
+
+};  // namespace KProf
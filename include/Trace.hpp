@@ -0,0 +1,142 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kprof.hpp"
+
+namespace KProf {
+enum class TraceFormat : uint8_t {
+  CHROME_JSON,  // chrome://tracing, ui.perfetto.dev
+  PERFETTO      // Perfetto protobuf trace
+};
+
+struct TraceOptions {
+  size_t eventsPerThread = 16384;  // regions past this are dropped
+  std::string file;                // exported on destruction if set
+  TraceFormat format = TraceFormat::CHROME_JSON;
+};
+
+// counters kept per region, further ones are left out
+constexpr size_t kTraceValues = 16;
+
+// One region as recorded on the hot path: no strings, no allocation
+struct TraceRecord {
+  const char* name;  // must outlive the tracer, e.g. a string literal
+  uint64_t begin;    // ns since the tracer was created
+  uint64_t end;
+  uint32_t schema;  // counter names and metrics of the monitor
+  uint32_t numValues;
+  uint64_t values[kTraceValues];
+};
+
+// Records the timeline of measured regions of every thread into per-thread
+// buffers allocated up front, and exports it as a Chrome trace or a Perfetto
+// trace. Every region becomes a slice carrying its counter values; the
+// derived metrics of the monitor (IPC, miss rates, ...) become counter
+// tracks. The first Record() of a thread, or with a monitor whose counter
+// set the tracer has not seen, allocates; later ones only copy the counts.
+// Each thread caches the sets of its last eight monitors.
+class KProfTracer {
+ public:
+  KProfTracer() : KProfTracer(TraceOptions()) {}
+  KProfTracer(const TraceOptions&);
+  ~KProfTracer();
+
+  KProfTracer(const KProfTracer&) = delete;
+  KProfTracer& operator=(const KProfTracer&) = delete;
+
+  TraceOptions& GetOptions() { return options; }
+
+  // allocates the calling thread's buffer ahead of its first region
+  void PrepareThread() { GetThreadBuffer(); }
+
+  // Records the last region of `monitor`, i.e. call it after
+  // StopCounters(). False if the thread's buffer is full.
+  bool Record(const char* name, KProfEvent& monitor);
+
+  // regions dropped because a buffer was full
+  uint64_t GetDropped();
+
+  // Writes everything recorded so far. Threads may keep recording.
+  void Export(const std::string& filename, TraceFormat format);
+  void Export() { Export(options.file, options.format); }
+
+ private:
+  // schema ids of the counter sets a thread recorded with lately
+  struct CachedSchema {
+    const KProfEvent* monitor = nullptr;
+    uint64_t generation = 0;
+    uint32_t schema = 0;
+  };
+  static constexpr size_t kSchemaCacheSize = 8;
+
+  struct ThreadBuffer {
+    pid_t tid = 0;
+    std::unique_ptr<TraceRecord[]> records;
+    std::atomic<size_t> count = 0;
+    std::atomic<uint64_t> dropped = 0;
+    CachedSchema schemaCache[kSchemaCacheSize];
+    size_t nextCacheSlot = 0;  // replaced round robin
+  };
+
+  struct Schema {
+    std::vector<std::string> counters;
+    std::vector<std::pair<std::string, std::string>> metrics;
+  };
+
+  // a consistent copy of the buffers for the exporters
+  struct ThreadTrace {
+    pid_t tid;
+    std::vector<TraceRecord> records;
+  };
+
+  ThreadBuffer& GetThreadBuffer();
+  uint32_t GetSchema(ThreadBuffer&, KProfEvent&);
+  std::vector<ThreadTrace> Snapshot();
+  // metric values of a record, NaN where a metric cannot be evaluated
+  std::vector<std::vector<double>> EvaluateMetrics(const ThreadTrace&);
+
+  void WriteChrome(std::ostream&, const std::vector<ThreadTrace>&);
+  void WritePerfetto(std::ostream&, const std::vector<ThreadTrace>&);
+
+ private:
+  TraceOptions options;
+  uint64_t id;  // tells tracers apart in the thread-local cache
+  std::chrono::high_resolution_clock::time_point epoch;
+
+  std::mutex lock;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+  std::vector<Schema> schemas;
+};
+
+// Counts and records a region for the lifetime of the object
+class TraceScope {
+ public:
+  TraceScope(KProfTracer& _tracer, const char* _name, KProfEvent& _monitor)
+      : tracer(_tracer), name(_name), monitor(_monitor) {
+    monitor.StartCounters();
+  }
+  ~TraceScope() {
+    monitor.StopCounters();
+    tracer.Record(name, monitor);
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  KProfTracer& tracer;
+  const char* name;
+  KProfEvent& monitor;
+};
+
+};  // namespace KProf
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace KProf {
+// DRAM traffic of one socket during a region, as counted by its memory
+// controllers. Unlike core events these include prefetches, writebacks and
+// the traffic of every other process on the socket.
+struct SocketTraffic {
+  int package = -1;
+  uint64_t bytesRead = 0;
+  uint64_t bytesWritten = 0;
+  bool split = true;  // false if only the sum is counted (amd_df)
+
+  uint64_t Bytes() const { return bytesRead + bytesWritten; }
+};
+
+// Opens an event of an uncore-like PMU system-wide on `cpu`, enabled and
+// without a group. Returns the file descriptor, or -1 with errno set.
+int OpenSystemWide(int type, uint64_t config, int cpu,
+                   uint64_t readFormat = 0);
+
+// Memory controller counters, discovered through sysfs:
+//  - Intel: the CAS read/write events of uncore_imc_*, or of the free
+//    running uncore_imc_free_running_* counters where there are no others
+//  - AMD Zen 4 and later: UMC CAS commands of amd_umc_*
+//  - AMD Zen 2/3: DRAM channel beats of amd_df, reads and writes combined
+// Each PMU is opened system-wide on the CPUs listed in its cpumask, one per
+// socket or die, which needs perf_event_paranoid <= 0 or CAP_PERFMON. The
+// counters run freely, regions take the difference of two reads, scaled up
+// when the kernel multiplexes them (amd_df has four counters for eight
+// channels).
+class KProfMemoryCounters {
+ public:
+  KProfMemoryCounters();
+  ~KProfMemoryCounters();
+
+  KProfMemoryCounters(const KProfMemoryCounters&) = delete;
+  KProfMemoryCounters& operator=(const KProfMemoryCounters&) = delete;
+
+  // false if no memory controller counter could be opened
+  bool Available() const { return !counters.empty(); }
+
+  // PMUs counters were opened on
+  std::vector<std::string> GetPmus() const;
+
+  void Start();
+  void Stop();
+
+  // traffic between the last Start() and Stop(), by package
+  std::vector<SocketTraffic> GetTraffic() const;
+
+ private:
+  enum Direction : uint8_t { READ, WRITE, BOTH };
+
+  // PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING
+  struct Reading {
+    uint64_t value = 0;
+    uint64_t enabled = 0;
+    uint64_t running = 0;
+  };
+
+  struct Counter {
+    std::string pmu;
+    int fd = -1;
+    int package = -1;
+    Direction direction = BOTH;
+    double bytesPerCount = 64.0;  // a CAS moves a cache line
+    Reading start;
+    uint64_t delta = 0;
+  };
+
+  void Open(const std::string& pmu, uint64_t config, Direction,
+            double bytesPerCount);
+  bool OpenNamed(const std::string& pmu, const std::string& read,
+                 const std::string& write);
+  static Reading ReadCounter(int fd);
+
+ private:
+  std::vector<Counter> counters;
+};
+
+// Energy of one RAPL domain during a region, summed over packages
+struct EnergyReading {
+  std::string label;  // report entry, e.g. Energy-pkg
+  std::string event;  // power PMU event, e.g. energy-pkg
+  double joules = 0.0;
+};
+
+// RAPL energy counters of the power PMU (energy-pkg, energy-cores,
+// energy-ram, energy-gpu, energy-psys), opened system-wide on the CPUs in
+// its cpumask and converted to joules with the scale and unit sysfs exports.
+// Where the PMU is missing or refuses to open, the zones of
+// /sys/class/powercap/intel-rapl are read instead.
+class KProfEnergyCounters {
+ public:
+  // {label, event} pairs; empty for every domain the host has
+  KProfEnergyCounters(
+      const std::vector<std::pair<std::string, std::string>>& domains = {});
+  ~KProfEnergyCounters();
+
+  KProfEnergyCounters(const KProfEnergyCounters&) = delete;
+  KProfEnergyCounters& operator=(const KProfEnergyCounters&) = delete;
+
+  bool Available() const { return !counters.empty(); }
+
+  void Start();
+  void Stop();
+
+  // energy between the last Start() and Stop(), one entry per domain that
+  // could be opened, in the order they were asked for
+  std::vector<EnergyReading> GetEnergy() const;
+
+ private:
+  struct Counter {
+    size_t domain = 0;  // index into readings
+    int fd = -1;        // power PMU, or -1 for a powercap zone
+    std::string path;   // energy_uj of the powercap zone
+    double scale = 1.0;  // joules per count
+    uint64_t range = 0;  // powercap wraps around after this many counts
+    uint64_t start = 0;
+    uint64_t delta = 0;
+  };
+
+  bool OpenPerf(size_t domain, const std::string& event);
+  bool OpenPowercap(size_t domain, const std::string& event);
+  uint64_t ReadCounter(const Counter&) const;
+
+ private:
+  std::vector<EnergyReading> readings;
+  std::vector<Counter> counters;
+};
+
+};  // namespace KProf
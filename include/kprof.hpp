@@ -3,23 +3,32 @@
 #include <asm/unistd.h>
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "DerivedMetrics.hpp"
+#include "Uncore.hpp"
+
 namespace KProf {
 class KProfCounter {
  private:
   std::pair<std::string, uint64_t> item;
+  double value = 0.0;    // only meaningful for derived metrics
+  bool derived = false;  // true if this entry is computed, not counted
 
  public:
   /// we need to copy the name!
@@ -37,10 +46,21 @@ class KProfCounter {
 
   long long GetCount() { return item.second; }
 
+  // counts are returned as-is, derived metrics keep their fractional part
+  double GetValue() { return derived ? value : (double)item.second; }
+
+  bool IsDerived() { return derived; }
+
   void SetName(std::string _name) { item.first = _name; }
 
   void SetCount(uint64_t _count) { item.second = _count; }
 
+  void SetValue(double _value) {
+    value = _value;
+    derived = true;
+    item.second = (_value == _value) ? (uint64_t)(long long)_value : 0;
+  }
+
   size_t GetSize() { return sizeof(item); }
 };
 
@@ -85,17 +105,102 @@ class KProfEvent {
     ALL = 0b111
   };
 
+  // depth of the top-down microarchitecture analysis, see Topdown.cpp
+  enum TopdownLevel : uint8_t { TOPDOWN_L1 = 1, TOPDOWN_L2 = 2 };
+
+  // scheduler and pager activity during the last region. It is counted by a
+  // separate group of software events which every KProfEvent keeps open.
+  struct Disturbances {
+    uint64_t contextSwitches = 0;
+    uint64_t migrations = 0;
+    uint64_t majorFaults = 0;
+  };
+
   void RegisterCounter(const std::string&, int&, uint64_t, uint64_t,
                        EventDomain);
 
-  void StartCounters();
+  // Also switches to a counter set published by a KProfConfigWatcher, so
+  // the set only ever changes between regions.
+  void StartCounters() {
+    if (pendingConfig.load(std::memory_order_acquire)) AdoptConfig();
+    EnableCounters();
+  }
 
   void StopCounters();
 
+  // incremented whenever a reloaded counter set is adopted
+  uint64_t GetGeneration() const { return generation; }
+
   std::vector<std::string> GetCounterNames() { return names; }
 
+  size_t GetNumCounters() const { return events.size(); }
+
+  std::vector<std::string> GetMetricNames() {
+    std::vector<std::string> res;
+    for (auto& metric : metrics) res.push_back(metric.GetName());
+    return res;
+  }
+
   uint64_t GetCounter(const std::string&);
 
+  // Copies up to `max` raw counts of the last region, in the order of
+  // GetCounterNames(), and returns how many it copied. Does not allocate.
+  size_t ReadCounts(uint64_t* values, size_t max) const {
+    auto count = std::min(max, events.size());
+    for (size_t i = 0; i < count; ++i) values[i] = events[i].data.value;
+    return count;
+  }
+
+  // name and expression of each derived metric, in evaluation order
+  std::vector<std::pair<std::string, std::string>> GetMetricDefinitions() {
+    std::vector<std::pair<std::string, std::string>> res;
+    for (auto& metric : metrics)
+      res.push_back({metric.GetName(), metric.GetExpression()});
+    return res;
+  }
+
+  // Opens CPU-cycles and REF_CPU_CYCLES in a group of their own and adds
+  // the metric Frequency-ratio, their quotient. A ratio that moves between
+  // regions means the core clock changed underneath the measurement.
+  void TrackFrequency();
+
+  // Opens the floating point operation counters of the host in a group of
+  // their own and adds the metric FLOPs, with FMAs counted as two
+  // operations. Implemented with the roofline model, see Roofline.cpp.
+  void TrackFlops();
+
+  // Counts DRAM traffic at the memory controllers of every socket over each
+  // region. GetReport() then contains IMC-read-bytes-S<n>,
+  // IMC-write-bytes-S<n> and the matching -GBps entries per package (or
+  // IMC-bytes-S<n> and IMC-GBps-S<n> where reads and writes are counted
+  // together), before the derived metrics. Does nothing if no memory
+  // controller PMU can be opened.
+  void TrackMemoryTraffic();
+
+  // Reads RAPL energy over each region: {label, event} pairs such as
+  // {"Energy-pkg", "energy-pkg"}, or every domain of the host if empty.
+  // Each domain adds its joules under its label and the average power in
+  // watts under <label>-W. Config files request domains with lines like
+  // Energy-pkg,POWER,energy-pkg, which metrics may then refer to.
+  void TrackEnergy(
+      const std::vector<std::pair<std::string, std::string>>& domains = {});
+
+  Disturbances GetDisturbances() { return disturbances; }
+
+  // true if the last region was descheduled, migrated or hit a major fault
+  bool IsContaminated() {
+    return disturbances.contextSwitches || disturbances.migrations ||
+           disturbances.majorFaults;
+  }
+
+  // bounds of the last region
+  std::chrono::high_resolution_clock::time_point GetStartTime() const {
+    return startTime;
+  }
+  std::chrono::high_resolution_clock::time_point GetStopTime() const {
+    return stopTime;
+  }
+
   uint64_t GetDuration() {
     // returns nanoseconds by default
     return std::chrono::duration_cast<std::chrono::nanoseconds>(stopTime -
@@ -110,21 +215,78 @@ class KProfEvent {
 
   KProfEvent();
   KProfEvent(const std::string&);
+  KProfEvent(TopdownLevel);
   ~KProfEvent();
 
+  KProfEvent(const KProfEvent&) = delete;
+  KProfEvent& operator=(const KProfEvent&) = delete;
+
  private:
+  friend class KProfConfigWatcher;
+
+  // a set read from `configFile` for the thread `target`, to be published
+  KProfEvent(const std::string& configFile, pid_t target);
+  // hands over a prepared set, which StartCounters() adopts
+  void PublishConfig(KProfEvent* next);
+  void AdoptConfig();
+  void ReclaimConfig();  // frees the set replaced by the last adoption
+  pid_t GetOwner() const { return owner; }
+
+  void EnableCounters();
   void ConstructTypeMap();
   int TypeLookup(const std::string&);
   std::vector<KProfCounter> GetOverhead();
+  std::vector<KProfCounter> ReadSystemWide();
+  void OpenEnergy(const std::vector<std::pair<std::string, std::string>>&);
   void ReadCounterList(const std::string&);
   void ReadEnvConfig(bool, bool&, std::string&);
   void ParseEnvConfig(std::string&);
 
+  // a counter as read from a config, before it is opened
+  struct CounterSpec {
+    std::string name;
+    int type;
+    uint64_t config;
+    EventDomain domain;
+  };
+  // a counter spec of a config may end in a domain, ":u" (the default),
+  // ":k", ":h" or a combination like ":uk". ":u/k" adds two counters,
+  // <name>:u and <name>:k, and the metric <name>-kernel-share.
+  void AddCounterSpec(std::vector<CounterSpec>&, const std::string& name,
+                      int type, uint64_t config, const std::string& domain);
+  void AddMetric(const std::string&, const std::string&);
+  void RegisterCounterSet(std::vector<CounterSpec>&);
+  void BindMetrics();
+  void ConfigureTopdown(TopdownLevel);
+  void OpenSentinels();
+  void ReadSentinels(uint64_t*);
+
  private:
   std::vector<Event> events;
   std::vector<std::string> names;
   std::vector<int> leaderFDs;
   std::unordered_map<std::string, int> typeMap;
+  std::vector<KProfMetric> metrics;
+  std::vector<double> metricInputs;  // raw counts, wall time, metrics
+
+  // sentinel group, or getrusage() if the kernel refuses to count it
+  enum SentinelMode : uint8_t { SENTINELS_OFF, SENTINELS_PERF, SENTINELS_RUSAGE };
+  SentinelMode sentinelMode = SENTINELS_OFF;
+  int sentinelFDs[3] = {-1, -1, -1};
+  uint64_t sentinelIDs[3] = {0, 0, 0};
+  uint64_t sentinelStart[3] = {0, 0, 0};
+  Disturbances disturbances;
+  std::unique_ptr<KProfMemoryCounters> memory;  // see TrackMemoryTraffic
+  std::unique_ptr<KProfEnergyCounters> energy;   // see TrackEnergy
+  bool trackingFrequency = false;                // see TrackFrequency
+
+  // counters are opened for `target`, 0 being the calling thread; `owner`
+  // is the thread which constructed the object
+  pid_t target = 0;
+  pid_t owner = 0;
+  uint64_t generation = 0;
+  std::atomic<KProfEvent*> pendingConfig = nullptr;  // published, not adopted
+  std::atomic<KProfEvent*> retiredConfig = nullptr;  // adopted, to be freed
   std::chrono::time_point<std::chrono::high_resolution_clock> startTime;
   std::chrono::time_point<std::chrono::high_resolution_clock> stopTime;
 };
@@ -0,0 +1,393 @@
+// Flat profile of every function of a program compiled with
+// -finstrument-functions. Each thread keeps a small group of free-running
+// counters open; the hooks snapshot them on entry and exit and attribute the
+// difference to the function in a per-thread open-addressing table. Names
+// are only resolved when the process exits.
+//
+// KPROF_INSTRUMENT_EVENTS  comma separated, names from kEvents below
+//                          (default cycles,instructions,cache-misses)
+// KPROF_INSTRUMENT_TABLE   functions per thread (default 16384)
+// KPROF_INSTRUMENT_TOP     rows printed at exit (default 30)
+// KPROF_INSTRUMENT_CSV     file receiving the full table
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "HostInfo.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define NO_INSTRUMENT __attribute__((no_instrument_function))
+
+namespace {
+
+constexpr size_t kMaxCounters = 4;
+constexpr size_t kMaxDepth = 1024;
+
+struct FunctionEntry {
+  void* fn;  // nullptr marks a free slot
+  uint64_t calls;
+  uint64_t self[kMaxCounters];       // excluding callees
+  uint64_t inclusive[kMaxCounters];  // recursion counts more than once
+};
+
+struct Frame {
+  void* fn;
+  uint64_t start[kMaxCounters];
+  uint64_t children[kMaxCounters];
+};
+
+struct ThreadProfile {
+  size_t numCounters = 0;
+  int fds[kMaxCounters] = {-1, -1, -1, -1};
+  perf_event_mmap_page* pages[kMaxCounters] = {};
+
+  FunctionEntry* table = nullptr;  // preallocated, never grows
+  size_t capacity = 0;             // power of two
+  size_t used = 0;
+  uint64_t dropped = 0;  // calls of functions which found the table full
+
+  Frame stack[kMaxDepth];
+  size_t depth = 0;
+  bool busy = false;  // set while a hook runs
+};
+
+struct EventDef {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+};
+
+// clang-format off
+const EventDef kEvents[] = {
+    {"cycles"          , PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions"    , PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses"    , PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"branches"        , PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses"   , PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"ref-cycles"      , PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {"task-clock"      , PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+// clang-format on
+
+// the configuration is shared by all threads and read once
+std::vector<const EventDef*> events;
+std::vector<std::string> labels;  // of the counters that could be opened
+size_t tableCapacity = 16384;
+
+std::mutex& registryLock = *new std::mutex;
+std::vector<ThreadProfile*>& registry = *new std::vector<ThreadProfile*>;
+std::atomic<bool> finished = false;
+
+thread_local ThreadProfile* profile = nullptr;
+thread_local bool initializing = false;
+
+// A malformed value must not throw out of a hook or the exit handler, which
+// would terminate the profiled program
+NO_INSTRUMENT size_t EnvSize(const char* var, size_t fallback) {
+  const char* value = getenv(var);
+  if (!value) return fallback;
+  char* end = nullptr;
+  errno = 0;
+  auto parsed = strtoul(value, &end, 10);
+  if (*value == '-' || end == value || *end != '\0' || errno == ERANGE) {
+    std::cerr << "kprof_instrument: invalid " << var << "=" << value
+              << ". Using " << fallback << "." << std::endl;
+    return fallback;
+  }
+  return parsed;
+}
+
+NO_INSTRUMENT void Configure() {
+  const char* list = getenv("KPROF_INSTRUMENT_EVENTS");
+  std::stringstream ss(list ? list : "cycles,instructions,cache-misses");
+  std::string name;
+  while (std::getline(ss, name, ',') && events.size() < kMaxCounters) {
+    auto it = std::find_if(std::begin(kEvents), std::end(kEvents),
+                           [&](auto& def) { return name == def.name; });
+    if (it == std::end(kEvents))
+      std::cerr << "kprof_instrument: unknown event " << name << ". Ignoring."
+                << std::endl;
+    else
+      events.push_back(it);
+  }
+
+  tableCapacity =
+      std::max<size_t>(16, EnvSize("KPROF_INSTRUMENT_TABLE", tableCapacity));
+  size_t rounded = 1;
+  while (rounded < tableCapacity) rounded <<= 1;
+  tableCapacity = rounded;
+}
+
+NO_INSTRUMENT void OpenCounters(ThreadProfile& p) {
+  static std::once_flag warned;
+  std::vector<std::string> opened;
+  int leader = -1;
+
+  for (auto def : events) {
+    perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = def->type;
+    pe.size = sizeof(pe);
+    pe.config = def->config;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    pe.read_format = PERF_FORMAT_GROUP;
+
+    int fd = static_cast<int>(
+        syscall(SYS_perf_event_open, &pe, 0, -1, leader, 0));
+    if (fd < 0) {
+      std::call_once(warned, [&] {
+        std::cerr << "kprof_instrument: cannot open " << def->name
+                  << " (errno " << errno << "). Ignoring it." << std::endl;
+      });
+      continue;
+    }
+    if (leader == -1) leader = fd;
+
+    // the user page allows reading the counter with rdpmc, no syscall
+    auto page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                     fd, 0);
+    p.pages[p.numCounters] =
+        (page == MAP_FAILED) ? nullptr : static_cast<perf_event_mmap_page*>(page);
+    p.fds[p.numCounters++] = fd;
+    opened.push_back(def->name);
+  }
+
+  std::lock_guard<std::mutex> guard(registryLock);
+  if (labels.empty()) labels = opened;
+}
+
+NO_INSTRUMENT ThreadProfile* GetProfile() {
+  if (profile || initializing || finished) return profile;
+  initializing = true;
+
+  static std::once_flag configured;
+  std::call_once(configured, Configure);
+
+  auto p = new ThreadProfile;
+  p->capacity = tableCapacity;
+  p->table = static_cast<FunctionEntry*>(
+      calloc(p->capacity, sizeof(FunctionEntry)));
+  OpenCounters(*p);
+  {
+    std::lock_guard<std::mutex> guard(registryLock);
+    registry.push_back(p);
+  }
+
+  profile = p;
+  initializing = false;
+  return profile;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the seqlock protocol documented in perf_event.h; false if the counter is
+// not on a PMC right now or user-space reads are not allowed
+NO_INSTRUMENT inline bool ReadUserPage(perf_event_mmap_page* page,
+                                       uint64_t& value) {
+  uint32_t seq;
+  do {
+    seq = page->lock;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    auto index = page->index;
+    if (!page->cap_user_rdpmc || index == 0) return false;
+    int64_t pmc = __rdpmc(index - 1);
+    auto width = page->pmc_width;
+    pmc <<= 64 - width;
+    pmc >>= 64 - width;  // sign extension
+    value = page->offset + pmc;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  } while (page->lock != seq);
+  return true;
+}
+#endif
+
+NO_INSTRUMENT inline void Snapshot(ThreadProfile& p, uint64_t* values) {
+#if defined(__x86_64__) || defined(__i386__)
+  bool complete = true;
+  for (size_t i = 0; i < p.numCounters && complete; ++i)
+    complete = p.pages[i] && ReadUserPage(p.pages[i], values[i]);
+  if (complete) return;
+#endif
+  // one read() of the group leader returns every counter
+  uint64_t buffer[1 + kMaxCounters] = {0};
+  if (p.numCounters && read(p.fds[0], buffer, sizeof(buffer)) > 0)
+    for (size_t i = 0; i < p.numCounters; ++i) values[i] = buffer[1 + i];
+}
+
+NO_INSTRUMENT inline FunctionEntry* Lookup(ThreadProfile& p, void* fn) {
+  auto mask = p.capacity - 1;
+  auto hash = (reinterpret_cast<uintptr_t>(fn) >> 4) * 0x9E3779B97F4A7C15ULL;
+  for (auto slot = hash >> 32;; ++slot) {
+    auto& entry = p.table[slot & mask];
+    if (entry.fn == fn) return &entry;
+    if (entry.fn == nullptr) {
+      // keep a quarter free so probe sequences stay short
+      if (4 * (p.used + 1) > 3 * p.capacity) return nullptr;
+      p.used++;
+      entry.fn = fn;
+      return &entry;
+    }
+  }
+}
+
+std::string Symbolize(void* fn) {
+  Dl_info info{};
+  bool found = dladdr(fn, &info) != 0;
+  if (found && info.dli_sname) {
+    int status;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr,
+                                          &status);
+    std::string name = (status == 0) ? demangled : info.dli_sname;
+    free(demangled);
+    return name;
+  }
+  std::stringstream name;
+  name << fn;
+  if (found && info.dli_fname) name << " (" << info.dli_fname << ")";
+  return name.str();
+}
+
+__attribute__((destructor)) NO_INSTRUMENT void Report() {
+  finished = true;
+
+  std::unordered_map<void*, FunctionEntry> merged;
+  uint64_t dropped = 0;
+  {
+    std::lock_guard<std::mutex> guard(registryLock);
+    for (auto p : registry) {
+      dropped += p->dropped;
+      for (size_t i = 0; i < p->capacity; ++i) {
+        auto& entry = p->table[i];
+        if (!entry.fn) continue;
+        auto& total = merged[entry.fn];
+        total.fn = entry.fn;
+        total.calls += entry.calls;
+        for (size_t c = 0; c < kMaxCounters; ++c) {
+          total.self[c] += entry.self[c];
+          total.inclusive[c] += entry.inclusive[c];
+        }
+      }
+    }
+  }
+  if (merged.empty()) return;
+  if (labels.empty()) {
+    std::cerr << "kprof_instrument: no counter could be opened, no profile."
+              << std::endl;
+    return;
+  }
+
+  std::vector<FunctionEntry> rows;
+  for (auto& [fn, entry] : merged) rows.push_back(entry);
+  std::sort(rows.begin(), rows.end(),
+            [](auto& a, auto& b) { return a.self[0] > b.self[0]; });
+
+  auto& host = KProf::GetHostInfo();
+  size_t top = EnvSize("KPROF_INSTRUMENT_TOP", 30);
+
+  std::cout << "Flat profile (" << host.modelName << ", " << registry.size()
+            << " thread(s)), sorted by self " << labels.front() << std::endl;
+  std::cout << std::setw(12) << "calls";
+  for (auto& label : labels)
+    std::cout << std::setw(16) << ("self " + label);
+  std::cout << std::setw(16) << ("incl " + labels.front()) << "  function"
+            << std::endl;
+  for (size_t r = 0; r < rows.size() && r < top; ++r) {
+    std::cout << std::setw(12) << rows[r].calls;
+    for (size_t c = 0; c < labels.size(); ++c)
+      std::cout << std::setw(16) << rows[r].self[c];
+    std::cout << std::setw(16) << rows[r].inclusive[0] << "  "
+              << Symbolize(rows[r].fn) << std::endl;
+  }
+  if (dropped)
+    std::cerr << "kprof_instrument: " << dropped
+              << " call(s) not recorded because a function table was full. "
+                 "Increase KPROF_INSTRUMENT_TABLE."
+              << std::endl;
+
+  const char* csv = getenv("KPROF_INSTRUMENT_CSV");
+  if (!csv) return;
+  std::ofstream file(csv);
+  file << "function,calls";
+  for (auto& label : labels) file << ",self-" << label;
+  for (auto& label : labels) file << ",incl-" << label;
+  file << std::endl;
+  for (auto& row : rows) {
+    // names of C++ functions contain commas
+    file << "\"" << Symbolize(row.fn) << "\"," << row.calls;
+    for (size_t c = 0; c < labels.size(); ++c) file << "," << row.self[c];
+    for (size_t c = 0; c < labels.size(); ++c) file << "," << row.inclusive[c];
+    file << std::endl;
+  }
+}
+
+}  // namespace
+
+extern "C" {
+
+NO_INSTRUMENT void __cyg_profile_func_enter(void* fn, void*) {
+  auto p = GetProfile();
+  if (!p || p->busy) return;
+  p->busy = true;
+
+  if (p->depth < kMaxDepth) {
+    auto& frame = p->stack[p->depth];
+    frame.fn = fn;
+    memset(frame.children, 0, sizeof(frame.children));
+    Snapshot(*p, frame.start);
+  }
+  p->depth++;
+  p->busy = false;
+}
+
+NO_INSTRUMENT void __cyg_profile_func_exit(void*, void*) {
+  auto p = profile;
+  if (!p || p->busy || p->depth == 0) return;
+  p->busy = true;
+
+  auto level = --p->depth;
+  if (level < kMaxDepth) {
+    uint64_t now[kMaxCounters];
+    Snapshot(*p, now);
+
+    auto& frame = p->stack[level];
+    auto entry = Lookup(*p, frame.fn);
+    uint64_t delta[kMaxCounters];
+    for (size_t c = 0; c < p->numCounters; ++c) {
+      delta[c] = now[c] - frame.start[c];
+      if (level > 0) p->stack[level - 1].children[c] += delta[c];
+    }
+    if (entry) {
+      entry->calls++;
+      for (size_t c = 0; c < p->numCounters; ++c) {
+        entry->inclusive[c] += delta[c];
+        entry->self[c] += delta[c] - std::min(delta[c], frame.children[c]);
+      }
+    } else {
+      p->dropped++;
+    }
+  }
+  p->busy = false;
+}
+}
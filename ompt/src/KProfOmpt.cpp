@@ -0,0 +1,275 @@
+// OMPT tool: counts every OpenMP parallel region per thread with a
+// KProfEvent that stays open for the lifetime of the thread. The counter set
+// is configured like the default KProfEvent constructor, through
+// KPROF_COUNTER_FILE, KPROF_COUNTER_CONF or KPROF_TOPDOWN.
+
+#include <dlfcn.h>
+#include <omp-tools.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "kprof.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define KPROF_BARRIER_LABEL "Barrier-wait-cycles"
+inline uint64_t BarrierClock() { return __rdtsc(); }
+#else
+#define KPROF_BARRIER_LABEL "Barrier-wait-ns"
+inline uint64_t BarrierClock() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+#endif
+
+using namespace KProf;
+
+namespace {
+
+// one parallel region as seen by one thread
+struct RegionTotals {
+  uint64_t calls = 0;
+  std::vector<double> sums;  // per report entry
+  uint64_t barrierWait = 0;
+  unsigned int index = 0;  // thread number within the team
+};
+
+struct ThreadState {
+  std::unique_ptr<KProfEvent> monitor;
+  std::vector<std::string> labels;
+  std::unordered_map<const void*, RegionTotals> regions;
+
+  const void* region = nullptr;  // region being counted
+  unsigned int depth = 0;        // nesting level of implicit tasks
+  uint64_t barrierStart = 0;
+};
+
+// The runtime calls Finalize() from its own exit handlers, possibly after the
+// static objects of this library were destroyed, so these are never freed.
+std::mutex& registryLock = *new std::mutex;
+std::vector<std::unique_ptr<ThreadState>>& registry =
+    *new std::vector<std::unique_ptr<ThreadState>>;
+thread_local ThreadState* threadState = nullptr;
+
+ThreadState& GetThreadState() {
+  if (!threadState) {
+    auto state = std::make_unique<ThreadState>();
+    state->monitor = std::make_unique<KProfEvent>();
+    threadState = state.get();
+    std::lock_guard<std::mutex> guard(registryLock);
+    registry.push_back(std::move(state));
+  }
+  return *threadState;
+}
+
+bool IsBarrier(ompt_sync_region_t kind) {
+  return kind != ompt_sync_region_taskwait &&
+         kind != ompt_sync_region_taskgroup &&
+         kind != ompt_sync_region_reduction;
+}
+
+void OnThreadBegin(ompt_thread_t, ompt_data_t*) {
+  // open the counters now rather than inside the first region
+  GetThreadState();
+}
+
+void OnThreadEnd(ompt_data_t*) {
+  // the counts stay in the registry, only the descriptors are released
+  if (threadState) threadState->monitor.reset();
+}
+
+void OnParallelBegin(ompt_data_t*, const ompt_frame_t*,
+                     ompt_data_t* parallelData, unsigned int, int,
+                     const void* codeptr) {
+  // regions are identified by the address of the construct
+  parallelData->ptr = const_cast<void*>(codeptr);
+}
+
+void OnParallelEnd(ompt_data_t*, ompt_data_t*, int, const void*) {}
+
+void OnImplicitTask(ompt_scope_endpoint_t endpoint, ompt_data_t* parallelData,
+                    ompt_data_t*, unsigned int, unsigned int index,
+                    int flags) {
+  if (flags & ompt_task_initial) return;
+  auto& state = GetThreadState();
+  if (!state.monitor) return;
+
+  if (endpoint == ompt_scope_begin) {
+    // nested regions are part of the enclosing one
+    if (state.depth++ > 0) return;
+    state.region = parallelData ? parallelData->ptr : nullptr;
+    auto& totals = state.regions[state.region];
+    totals.index = index;
+    state.monitor->StartCounters();
+    return;
+  }
+
+  if (state.depth == 0 || --state.depth > 0) return;
+  state.monitor->StopCounters();
+
+  auto report = state.monitor->GetReport(false);
+  if (state.labels.empty())
+    for (auto& entry : report) state.labels.push_back(entry.GetName());
+
+  auto& totals = state.regions[state.region];
+  totals.sums.resize(report.size(), 0.0);
+  for (size_t i = 0; i < report.size(); ++i)
+    totals.sums[i] += report[i].GetValue();
+  totals.calls++;
+}
+
+void OnSyncRegionWait(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint,
+                      ompt_data_t*, ompt_data_t*, const void*) {
+  if (!IsBarrier(kind) || !threadState || threadState->depth == 0) return;
+  auto& state = *threadState;
+  if (endpoint == ompt_scope_begin) {
+    state.barrierStart = BarrierClock();
+  } else if (state.barrierStart) {
+    state.regions[state.region].barrierWait +=
+        BarrierClock() - state.barrierStart;
+    state.barrierStart = 0;
+  }
+}
+
+std::string RegionName(const void* codeptr) {
+  std::stringstream name;
+  Dl_info info;
+  if (codeptr && dladdr(codeptr, &info) && info.dli_sname) {
+    name << info.dli_sname << "+0x" << std::hex
+         << (static_cast<const char*>(codeptr) -
+             static_cast<const char*>(info.dli_saddr));
+  } else {
+    name << codeptr;
+  }
+  return name.str();
+}
+
+// per-thread totals of one region, ordered by thread number
+struct RegionReport {
+  std::vector<std::string> labels;
+  std::vector<const RegionTotals*> threads;
+};
+
+void PrintRegions(const std::map<const void*, RegionReport>& regions) {
+  for (auto& [codeptr, region] : regions) {
+    uint64_t calls = 0;
+    for (auto thread : region.threads) calls = std::max(calls, thread->calls);
+    std::cout << "Parallel region " << RegionName(codeptr) << ": " << calls
+              << " call(s), " << region.threads.size() << " thread(s)"
+              << std::endl;
+
+    auto columns = region.labels;
+    columns.push_back(KPROF_BARRIER_LABEL);
+    for (size_t c = 0; c < columns.size(); ++c) {
+      double total = 0.0, min = INFINITY, max = -INFINITY;
+      for (auto thread : region.threads) {
+        double value = (c < region.labels.size())
+                           ? (c < thread->sums.size() ? thread->sums[c] : 0.0)
+                           : static_cast<double>(thread->barrierWait);
+        total += value;
+        min = std::min(min, value);
+        max = std::max(max, value);
+      }
+      double mean = total / region.threads.size();
+      std::cout << "  " << std::left << std::setw(22) << columns[c]
+                << std::right << " total " << std::setw(14)
+                << std::setprecision(6) << total << "  min " << std::setw(12)
+                << min << "  max " << std::setw(12) << max << "  imbalance "
+                << std::fixed << std::setprecision(2)
+                << (mean != 0.0 ? 100.0 * (max / mean - 1.0) : 0.0) << "%"
+                << std::defaultfloat << std::endl;
+    }
+  }
+}
+
+void DumpRegions(const std::string& filename,
+                 const std::map<const void*, RegionReport>& regions) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    std::cerr << "Error opening file: " << filename << std::endl;
+    return;
+  }
+
+  bool header = false;
+  for (auto& [codeptr, region] : regions) {
+    if (!header) {
+      file << "region,thread,calls";
+      for (auto& label : region.labels) file << "," << label;
+      file << "," << KPROF_BARRIER_LABEL << std::endl;
+      header = true;
+    }
+    for (auto thread : region.threads) {
+      file << RegionName(codeptr) << "," << thread->index << ","
+           << thread->calls;
+      for (size_t c = 0; c < region.labels.size(); ++c)
+        file << "," << (c < thread->sums.size() ? thread->sums[c] : 0.0);
+      file << "," << thread->barrierWait << std::endl;
+    }
+  }
+}
+
+int Initialize(ompt_function_lookup_t lookup, int, ompt_data_t*) {
+  auto setCallback =
+      reinterpret_cast<ompt_set_callback_t>(lookup("ompt_set_callback"));
+  if (!setCallback) return 0;
+
+  std::pair<ompt_callbacks_t, ompt_callback_t> callbacks[] = {
+      {ompt_callback_thread_begin,
+       reinterpret_cast<ompt_callback_t>(&OnThreadBegin)},
+      {ompt_callback_thread_end,
+       reinterpret_cast<ompt_callback_t>(&OnThreadEnd)},
+      {ompt_callback_parallel_begin,
+       reinterpret_cast<ompt_callback_t>(&OnParallelBegin)},
+      {ompt_callback_parallel_end,
+       reinterpret_cast<ompt_callback_t>(&OnParallelEnd)},
+      {ompt_callback_implicit_task,
+       reinterpret_cast<ompt_callback_t>(&OnImplicitTask)},
+      {ompt_callback_sync_region_wait,
+       reinterpret_cast<ompt_callback_t>(&OnSyncRegionWait)}};
+  for (auto& [event, callback] : callbacks) {
+    auto res = setCallback(event, callback);
+    if (res == ompt_set_never || res == ompt_set_error)
+      std::cerr << "kprof_ompt: the OpenMP runtime does not support callback "
+                << event << "." << std::endl;
+  }
+  return 1;  // keep the tool active
+}
+
+void Finalize(ompt_data_t*) {
+  std::map<const void*, RegionReport> regions;
+  std::lock_guard<std::mutex> guard(registryLock);
+  for (auto& state : registry) {
+    for (auto& [codeptr, totals] : state->regions) {
+      if (totals.calls == 0) continue;
+      auto& region = regions[codeptr];
+      if (region.labels.empty()) region.labels = state->labels;
+      region.threads.push_back(&totals);
+    }
+  }
+  for (auto& [codeptr, region] : regions)
+    std::sort(region.threads.begin(), region.threads.end(),
+              [](auto a, auto b) { return a->index < b->index; });
+
+  PrintRegions(regions);
+  const char* csv = getenv("KPROF_OMPT_CSV");
+  if (csv) DumpRegions(csv, regions);
+}
+
+}  // namespace
+
+extern "C" ompt_start_tool_result_t* ompt_start_tool(unsigned int,
+                                                     const char*) {
+  static ompt_start_tool_result_t result = {&Initialize, &Finalize, {0}};
+  return &result;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Arena.hpp"
+
+// Probes of the memory hierarchy and the branch predictor of the host. Each
+// probe opens the counters matching what it stresses, runs its kernel under
+// KProfHarness and reports the medians over the clean samples, normalized
+// per access (or per byte, for bandwidths).
+namespace KProfProbe {
+struct ProbeOptions {
+  size_t minSize = 4 << 10;  // working sets, bytes
+  size_t maxSize = 0;        // 0 for four times the last level cache
+  size_t repetitions = 5;    // measured runs per point, after one warmup
+  size_t chaseHops = 1 << 20;  // dependent loads per pointer-chase run
+  size_t streamBytes = 64 << 20;  // minimum traffic per STREAM run
+  size_t gathers = 1 << 20;       // loads per random gather run
+  size_t maxPages = 16 << 10;     // TLB probe
+  size_t branches = 1 << 20;      // per branch probe pass
+};
+
+struct ProbePoint {
+  std::string probe;  // e.g. latency, triad, tlb
+  std::string point;  // e.g. 32 KiB, stride=256, p=0.5
+  size_t bytes = 0;   // working set, 0 if it does not apply
+  double metric = 0.0;
+  std::string unit;  // of metric: ns, GB/s
+  // counts per access, in the order the counters were opened
+  std::vector<std::pair<std::string, double>> counters;
+};
+
+// a data or unified cache of CPU 0, or DRAM
+struct MemoryLevel {
+  std::string name;  // L1, L2, L3, DRAM
+  size_t size = 0;   // bytes, SIZE_MAX for DRAM
+};
+
+std::vector<MemoryLevel> MemoryLevels();
+// the innermost level the working set fits into
+std::string LevelOf(size_t bytes, const std::vector<MemoryLevel>&);
+
+// e.g. "1.5 MiB"
+std::string FormatBytes(size_t bytes);
+
+// powers of two and the points halfway between them, in bytes
+std::vector<size_t> WorkingSets(const ProbeOptions&);
+
+// dependent loads through a random cyclic permutation of cache lines
+std::vector<ProbePoint> RunLatency(const ProbeOptions&, KProf::KProfArena&);
+// STREAM copy, scale, add and triad over three arrays of a third of the
+// working set each; bytes counted as STREAM does, without write allocation
+std::vector<ProbePoint> RunStream(const ProbeOptions&, KProf::KProfArena&);
+// independent loads at random positions of the working set
+std::vector<ProbePoint> RunGather(const ProbeOptions&, KProf::KProfArena&);
+// loads at a fixed stride through the largest working set
+std::vector<ProbePoint> RunStrided(const ProbeOptions&, KProf::KProfArena&);
+// dependent loads of one cache line per page, over more and more pages;
+// base pages only
+std::vector<ProbePoint> RunTlb(const ProbeOptions&, KProf::KProfArena&);
+// a data-dependent branch, taken at random with probability p or following
+// a random pattern of growing period
+std::vector<ProbePoint> RunBranch(const ProbeOptions&, KProf::KProfArena&);
+
+};  // namespace KProfProbe
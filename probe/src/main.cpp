@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Arena.hpp"
+#include "HostInfo.hpp"
+#include "probes.hpp"
+
+using namespace KProf;
+using namespace KProfProbe;
+
+// A profile of the memory hierarchy of this host: latency, bandwidth and
+// the matching miss counts per cache level and for DRAM, followed by the
+// individual probes. It needs nothing but libKProf, so it also runs where
+// the demo's BLIS and FFTW cannot be fetched.
+
+struct ProbeDef {
+  const char* name;
+  std::function<std::vector<ProbePoint>(const ProbeOptions&, KProfArena&)>
+      run;
+};
+
+const ProbeDef probeDefs[] = {
+    {"latency", RunLatency}, {"stream", RunStream}, {"gather", RunGather},
+    {"strided", RunStrided}, {"tlb", RunTlb},       {"branch", RunBranch},
+};
+
+double Median(std::vector<double> values) {
+  if (values.empty()) return NAN;
+  auto mid = values.begin() + values.size() / 2;
+  std::nth_element(values.begin(), mid, values.end());
+  return *mid;
+}
+
+// The points of a probe representing a level: those well inside it, at most
+// half its size and twice the size of the level above, as the points near a
+// boundary mix two levels. All points of the level if none qualify.
+std::vector<const ProbePoint*> PointsOfLevel(
+    const std::vector<ProbePoint>& points, const std::string& probe,
+    const std::vector<MemoryLevel>& levels, size_t level) {
+  std::vector<const ProbePoint*> inside, all;
+  auto upper = levels[level].size;
+  auto lower = level ? levels[level - 1].size : 0;
+  for (auto& point : points) {
+    if (point.probe != probe || !point.bytes) continue;
+    if (point.bytes > upper || point.bytes <= lower) continue;
+    all.push_back(&point);
+    if ((upper == SIZE_MAX || point.bytes <= upper / 2) &&
+        point.bytes >= 2 * lower)
+      inside.push_back(&point);
+  }
+  return inside.empty() ? all : inside;
+}
+
+struct ProfileColumn {
+  std::string header;
+  std::string probe;
+  std::string counter;  // empty for the metric of the probe
+};
+
+const ProfileColumn profileColumns[] = {
+    {"latency ns", "latency", ""},
+    {"cycles", "latency", "CPU-cycles"},
+    {"copy GB/s", "copy", ""},
+    {"scale GB/s", "scale", ""},
+    {"add GB/s", "add", ""},
+    {"triad GB/s", "triad", ""},
+    {"gather ns", "gather", ""},
+    {"L1d-miss", "latency", "L1d-read-miss"},
+    {"LLC-miss", "latency", "LLC-read-miss"},
+    {"dTLB-miss", "latency", "dTLB-read-miss"},
+};
+
+double ProfileValue(const std::vector<const ProbePoint*>& points,
+                    const std::string& counter) {
+  std::vector<double> values;
+  for (auto point : points) {
+    if (counter.empty()) {
+      values.push_back(point->metric);
+      continue;
+    }
+    for (auto& [name, value] : point->counters)
+      if (name == counter) values.push_back(value);
+  }
+  return Median(values);
+}
+
+std::string FormatSize(size_t bytes) {
+  return bytes == SIZE_MAX ? "-" : FormatBytes(bytes);
+}
+
+void PrintProfile(const std::vector<ProbePoint>& points,
+                  const std::vector<MemoryLevel>& levels, bool csv) {
+  // only the columns some level has a value for
+  std::vector<const ProfileColumn*> columns;
+  std::vector<std::vector<double>> values(levels.size());
+  for (auto& column : profileColumns) {
+    bool present = false;
+    std::vector<double> perLevel;
+    for (size_t l = 0; l < levels.size(); ++l) {
+      auto value = ProfileValue(
+          PointsOfLevel(points, column.probe, levels, l), column.counter);
+      present |= !std::isnan(value);
+      perLevel.push_back(value);
+    }
+    if (!present) continue;
+    columns.push_back(&column);
+    for (size_t l = 0; l < levels.size(); ++l)
+      values[l].push_back(perLevel[l]);
+  }
+
+  if (csv) {
+    for (size_t l = 0; l < levels.size(); ++l)
+      for (size_t c = 0; c < columns.size(); ++c)
+        if (!std::isnan(values[l][c]))
+          std::cout << "profile," << levels[l].name << ","
+                    << (levels[l].size == SIZE_MAX ? 0 : levels[l].size)
+                    << "," << levels[l].name << "," << columns[c]->header
+                    << "," << values[l][c] << std::endl;
+    return;
+  }
+
+  std::cout << "Memory hierarchy (miss counts per load)" << std::endl;
+  std::cout << std::left << std::setw(8) << "level" << std::right
+            << std::setw(12) << "size";
+  for (auto column : columns) std::cout << std::setw(12) << column->header;
+  std::cout << std::endl;
+  for (size_t l = 0; l < levels.size(); ++l) {
+    // e.g. DRAM when the largest working set fits into the last level
+    if (std::all_of(values[l].begin(), values[l].end(),
+                    [](double value) { return std::isnan(value); }))
+      continue;
+    std::cout << std::left << std::setw(8) << levels[l].name << std::right
+              << std::setw(12) << FormatSize(levels[l].size);
+    for (auto value : values[l])
+      std::cout << std::setw(12) << std::setprecision(4) << value;
+    std::cout << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+void PrintPoints(const std::vector<ProbePoint>& points,
+                 const std::vector<MemoryLevel>& levels, bool csv) {
+  if (csv) {
+    for (auto& point : points) {
+      auto level = point.bytes ? LevelOf(point.bytes, levels) : "";
+      std::cout << point.probe << "," << point.point << "," << point.bytes
+                << "," << level << "," << point.unit << "," << point.metric
+                << std::endl;
+      for (auto& [name, value] : point.counters)
+        std::cout << point.probe << "," << point.point << "," << point.bytes
+                  << "," << level << "," << name << "," << value << std::endl;
+    }
+    return;
+  }
+
+  // one table per probe, its counters as columns
+  for (size_t first = 0; first < points.size();) {
+    auto last = first;
+    while (last < points.size() && points[last].probe == points[first].probe)
+      last++;
+
+    auto& head = points[first];
+    std::cout << head.probe << " (counts per access)" << std::endl;
+    std::cout << std::left << std::setw(16) << "point" << std::setw(6)
+              << "level" << std::right << std::setw(12) << head.unit;
+    for (auto& [name, value] : head.counters)
+      std::cout << std::setw(std::max<int>(12, name.size() + 2)) << name;
+    std::cout << std::endl;
+
+    for (auto i = first; i < last; ++i) {
+      auto& point = points[i];
+      std::cout << std::left << std::setw(16) << point.point << std::setw(6)
+                << (point.bytes ? LevelOf(point.bytes, levels) : "")
+                << std::right << std::setw(12) << std::setprecision(4)
+                << point.metric;
+      for (auto& [name, value] : point.counters)
+        std::cout << std::setw(std::max<int>(12, name.size() + 2)) << value;
+      std::cout << std::endl;
+    }
+    std::cout << std::endl;
+    first = last;
+  }
+}
+
+// a positive decimal number and nothing else, so "-1" cannot wrap around
+bool ParseCount(const char* text, size_t& value) {
+  auto end = text + strlen(text);
+  auto [last, error] = std::from_chars(text, end, value);
+  return error == std::errc() && last == end && value > 0;
+}
+
+int main(int argc, char* argv[]) {
+  ProbeOptions options;
+  bool csv = false;
+  std::vector<std::string> selected;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--csv")
+      csv = true;
+    else if (arg == "--max-size" && i + 1 < argc &&
+             ParseCount(argv[i + 1], options.maxSize) &&
+             options.maxSize <= (SIZE_MAX >> 20)) {
+      options.maxSize <<= 20;
+      ++i;
+    } else if (arg == "--repetitions" && i + 1 < argc &&
+               ParseCount(argv[i + 1], options.repetitions))
+      ++i;
+    else if (arg == "--probes" && i + 1 < argc) {
+      std::stringstream list(argv[++i]);
+      std::string name;
+      while (std::getline(list, name, ',')) selected.push_back(name);
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--csv] [--max-size MiB] [--repetitions N]"
+                   " [--probes latency,stream,gather,strided,tlb,branch]"
+                << std::endl;
+      return 1;
+    }
+  }
+  for (auto& name : selected)
+    if (std::none_of(std::begin(probeDefs), std::end(probeDefs),
+                     [&](auto& def) { return name == def.name; })) {
+      std::cerr << "Unknown probe " << name << std::endl;
+      return 1;
+    }
+
+  auto levels = MemoryLevels();
+  auto& host = GetHostInfo();
+  if (csv)
+    std::cout << "probe,point,bytes,level,quantity,value" << std::endl;
+  else {
+    std::cout << host.modelName << " (" << host.hostname << ")" << std::endl;
+    for (auto& level : levels)
+      if (level.size != SIZE_MAX)
+        std::cout << level.name << " " << FormatSize(level.size) << "  ";
+    std::cout << std::endl << std::endl;
+  }
+
+  KProfArena arena;
+  std::vector<ProbePoint> points;
+  for (auto& def : probeDefs) {
+    if (!selected.empty() &&
+        std::find(selected.begin(), selected.end(), def.name) ==
+            selected.end())
+      continue;
+    if (!csv) std::cerr << "Running " << def.name << std::endl;
+    auto result = def.run(options, arena);
+    points.insert(points.end(), result.begin(), result.end());
+  }
+
+  PrintProfile(points, levels, csv);
+  PrintPoints(points, levels, csv);
+  return 0;
+}
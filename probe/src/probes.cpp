@@ -0,0 +1,451 @@
+#include "probes.hpp"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "Harness.hpp"
+#include "HostInfo.hpp"
+#include "kprof.hpp"
+
+using namespace KProf;
+
+namespace KProfProbe {
+
+struct CounterDef {
+  const char* name;
+  const char* type;  // as written in a config file
+  const char* spec;
+};
+
+// clang-format off
+// Task-clock opens everywhere, so a monitor can be built on hosts without a
+// PMU; it is left out of the results
+const CounterDef latencyCounters[] = {
+    {"CPU-cycles"     , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_CPU_CYCLES"},
+    {"L1d-read-miss"  , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_L1D_READ_MISS"},
+    {"LLC-read-miss"  , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_LL_READ_MISS"},
+    {"dTLB-read-miss" , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_DTLB_READ_MISS"},
+    {"Task-clock"     , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_TASK_CLOCK"},
+};
+
+const CounterDef streamCounters[] = {
+    {"CPU-cycles"     , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_CPU_CYCLES"},
+    {"L1d-read-miss"  , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_L1D_READ_MISS"},
+    {"LLC-read-miss"  , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_LL_READ_MISS"},
+    {"LLC-write-miss" , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_LL_WRITE_MISS"},
+    {"Task-clock"     , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_TASK_CLOCK"},
+};
+
+const CounterDef tlbCounters[] = {
+    {"CPU-cycles"       , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_CPU_CYCLES"},
+    {"dTLB-read-access" , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_DTLB_READ_ACCESS"},
+    {"dTLB-read-miss"   , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_DTLB_READ_MISS"},
+    {"L1d-read-miss"    , "PERF_TYPE_HW_CACHE", "PERF_COUNT_HW_CACHE_L1D_READ_MISS"},
+    {"Task-clock"       , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_TASK_CLOCK"},
+};
+
+const CounterDef branchCounters[] = {
+    {"CPU-cycles"          , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_CPU_CYCLES"},
+    {"HW-instructions"     , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_INSTRUCTIONS"},
+    {"Branch-instructions" , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_BRANCH_INSTRUCTIONS"},
+    {"Branch-misses"       , "PERF_TYPE_HARDWARE", "PERF_COUNT_HW_BRANCH_MISSES"},
+    {"Task-clock"          , "PERF_TYPE_SOFTWARE", "PERF_COUNT_SW_TASK_CLOCK"},
+};
+// clang-format on
+
+const char* kAnchor = "Task-clock";
+
+// results of the kernels, so that the compiler keeps them
+volatile uintptr_t sink;
+
+template <size_t N>
+std::unique_ptr<KProfEvent> OpenMonitor(const CounterDef (&counters)[N]) {
+  char path[] = "/tmp/kprof_probe_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) throw std::runtime_error("Could not create a config file");
+  close(fd);
+
+  {
+    std::ofstream file(path);
+    for (auto& counter : counters)
+      file << counter.name << "," << counter.type << "," << counter.spec
+           << "\n";
+  }
+  // one group, so the counts of a region are comparable
+  auto monitor = std::make_unique<KProfEvent>(path);
+  unlink(path);
+  return monitor;
+}
+
+// median of every report entry over the clean samples of a run
+std::vector<std::pair<std::string, double>> Measure(
+    KProfEvent& monitor, const std::string& label,
+    const ProbeOptions& options, const KProfHarness::Kernel& kernel) {
+  HarnessOptions harnessOptions;
+  harnessOptions.warmup = 1;  // the working set is brought in
+  harnessOptions.repetitions = options.repetitions;
+  harnessOptions.contamination = Contamination::RERUN;
+  KProfHarness harness(harnessOptions);
+  auto result = harness.Run(label, monitor, kernel);
+
+  // entries in report order
+  std::vector<std::string> names;
+  for (auto& sample : result.samples)
+    for (auto entry : sample.report)
+      if (std::find(names.begin(), names.end(), entry.GetName()) == names.end())
+        names.push_back(entry.GetName());
+
+  std::vector<std::pair<std::string, double>> medians;
+  for (auto& name : names) medians.push_back({name, result.CleanMedian(name)});
+  return medians;
+}
+
+// `traffic` bytes moved for a bandwidth, 0 for a time per access
+ProbePoint MakePoint(const std::string& probe, const std::string& point,
+                     size_t bytes,
+                     const std::vector<std::pair<std::string, double>>& medians,
+                     double accesses, double traffic = 0.0) {
+  ProbePoint result;
+  result.probe = probe;
+  result.point = point;
+  result.bytes = bytes;
+  double wallTime = 0.0;
+  for (auto& [name, value] : medians) {
+    if (name == "Wall-time")
+      wallTime = value;
+    else if (name != kAnchor)
+      result.counters.push_back({name, value / accesses});
+  }
+  if (traffic > 0.0) {
+    result.metric = wallTime > 0.0 ? traffic / wallTime : 0.0;  // B/ns
+    result.unit = "GB/s";
+  } else {
+    result.metric = wallTime / accesses;
+    result.unit = "ns";
+  }
+  return result;
+}
+
+std::string FormatBytes(size_t bytes) {
+  const char* units[] = {"B", "KiB", "MiB", "GiB"};
+  double value = bytes;
+  size_t unit = 0;
+  while (value >= 1024 && unit + 1 < std::size(units)) {
+    value /= 1024;
+    unit++;
+  }
+  std::ostringstream out;
+  out << value << " " << units[unit];
+  return out.str();
+}
+
+std::vector<MemoryLevel> MemoryLevels() {
+  std::vector<MemoryLevel> levels;
+  for (auto& cache : GetCaches(0)) {
+    if (cache.type == "Instruction" || cache.size == 0) continue;
+    levels.push_back(
+        {std::string("L").append(std::to_string(cache.level)), cache.size});
+  }
+  levels.push_back({"DRAM", SIZE_MAX});
+  return levels;
+}
+
+std::string LevelOf(size_t bytes, const std::vector<MemoryLevel>& levels) {
+  for (auto& level : levels)
+    if (bytes <= level.size) return level.name;
+  return "-";
+}
+
+size_t MaxWorkingSet(const ProbeOptions& options) {
+  if (options.maxSize) return options.maxSize;
+  // well past the last level cache, within what a build host can spare
+  return std::clamp<size_t>(4 * LastLevelCacheSize(0), 64 << 20, 512 << 20);
+}
+
+// powers of two and the points halfway between them
+std::vector<size_t> Series(size_t from, size_t to) {
+  std::vector<size_t> series;
+  for (size_t value = from; value <= to; value *= 2) {
+    series.push_back(value);
+    if (value + value / 2 <= to) series.push_back(value + value / 2);
+  }
+  return series;
+}
+
+std::vector<size_t> WorkingSets(const ProbeOptions& options) {
+  return Series(std::max<size_t>(options.minSize, 64),
+                MaxWorkingSet(options));
+}
+
+struct alignas(64) Line {
+  Line* next;
+  char padding[64 - sizeof(Line*)];
+};
+
+// a single cycle through all n elements (Sattolo's algorithm), so a chase
+// visits every one of them before it repeats
+std::vector<uint32_t> RandomCycle(size_t n, uint64_t seed) {
+  std::vector<uint32_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::mt19937_64 generator(seed);
+  for (size_t i = n - 1; i > 0; --i) {
+    std::uniform_int_distribution<size_t> pick(0, i - 1);
+    std::swap(order[i], order[pick(generator)]);
+  }
+  return order;
+}
+
+// hops is a multiple of 8
+inline void* Chase(void* start, size_t hops) {
+  auto p = static_cast<Line*>(start);
+  for (size_t i = 0; i < hops; i += 8) {
+    p = p->next;
+    p = p->next;
+    p = p->next;
+    p = p->next;
+    p = p->next;
+    p = p->next;
+    p = p->next;
+    p = p->next;
+  }
+  return p;
+}
+
+std::vector<ProbePoint> RunLatency(const ProbeOptions& options,
+                                   KProfArena& arena) {
+  std::vector<ProbePoint> points;
+  auto monitor = OpenMonitor(latencyCounters);
+  auto hops = (options.chaseHops + 7) / 8 * 8;
+
+  for (auto size : WorkingSets(options)) {
+    auto numLines = size / sizeof(Line);
+    if (numLines < 2) continue;
+    auto lines = arena.Get<Line>("chase", numLines);
+    auto next = RandomCycle(numLines, size);
+    for (size_t i = 0; i < numLines; ++i) lines[i].next = &lines[next[i]];
+
+    auto medians = Measure(*monitor, "latency", options, [&](KProfEvent& m) {
+      m.StartCounters();
+      auto end = Chase(lines, hops);
+      m.StopCounters();
+      sink = reinterpret_cast<uintptr_t>(end);
+    });
+    points.push_back(
+        MakePoint("latency", FormatBytes(size), size, medians, hops));
+  }
+  arena.Release("chase");
+  return points;
+}
+
+std::vector<ProbePoint> RunStream(const ProbeOptions& options,
+                                  KProfArena& arena) {
+  std::vector<ProbePoint> points[4];  // per kernel
+  auto monitor = OpenMonitor(streamCounters);
+  const double scalar = 3.0;
+
+  for (auto size : WorkingSets(options)) {
+    size_t n = size / (3 * sizeof(double));
+    if (n == 0) continue;
+    auto a = arena.Get<double>("stream-a", n);
+    auto b = arena.Get<double>("stream-b", n);
+    auto c = arena.Get<double>("stream-c", n);
+    std::fill(a, a + n, 1.0);
+    std::fill(b, b + n, 2.0);
+    std::fill(c, c + n, 0.0);
+
+    struct StreamKernel {
+      const char* name;
+      size_t bytesPerElement;
+      std::function<void()> pass;
+    };
+    // clang-format off
+    const StreamKernel kernels[] = {
+        {"copy" , 2 * sizeof(double), [&] { for (size_t i = 0; i < n; ++i) c[i] = a[i]; }},
+        {"scale", 2 * sizeof(double), [&] { for (size_t i = 0; i < n; ++i) b[i] = scalar * c[i]; }},
+        {"add"  , 3 * sizeof(double), [&] { for (size_t i = 0; i < n; ++i) c[i] = a[i] + b[i]; }},
+        {"triad", 3 * sizeof(double), [&] { for (size_t i = 0; i < n; ++i) a[i] = b[i] + scalar * c[i]; }},
+    };
+    // clang-format on
+
+    for (size_t k = 0; k < std::size(kernels); ++k) {
+      auto& kernel = kernels[k];
+      auto perPass = n * kernel.bytesPerElement;
+      auto passes = std::max<size_t>(
+          1, (options.streamBytes + perPass - 1) / perPass);
+      auto medians = Measure(*monitor, kernel.name, options,
+                             [&](KProfEvent& m) {
+                               m.StartCounters();
+                               for (size_t pass = 0; pass < passes; ++pass) {
+                                 kernel.pass();
+                                 // every pass has to store
+                                 asm volatile("" ::: "memory");
+                               }
+                               m.StopCounters();
+                             });
+      points[k].push_back(MakePoint(kernel.name, FormatBytes(size), size,
+                                    medians, double(n) * passes,
+                                    double(perPass) * passes));
+    }
+  }
+  for (auto name : {"stream-a", "stream-b", "stream-c"}) arena.Release(name);
+
+  std::vector<ProbePoint> all;
+  for (auto& kernel : points) all.insert(all.end(), kernel.begin(), kernel.end());
+  return all;
+}
+
+std::vector<ProbePoint> RunGather(const ProbeOptions& options,
+                                  KProfArena& arena) {
+  std::vector<ProbePoint> points;
+  auto monitor = OpenMonitor(latencyCounters);
+
+  for (auto size : WorkingSets(options)) {
+    size_t n = size / sizeof(uint64_t);
+    auto data = arena.Get<uint64_t>("gather", n);
+    std::iota(data, data + n, 0);
+
+    auto medians = Measure(*monitor, "gather", options, [&](KProfEvent& m) {
+      m.StartCounters();
+      // the positions come from a xorshift generator rather than an index
+      // array, which would share the caches with the data
+      uint32_t x = 2463534242u;
+      uint64_t sum = 0;
+      for (size_t i = 0; i < options.gathers; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        sum += data[(uint64_t(x) * n) >> 32];
+      }
+      m.StopCounters();
+      sink = sum;
+    });
+    points.push_back(MakePoint("gather", FormatBytes(size), size, medians,
+                               options.gathers));
+  }
+  arena.Release("gather");
+  return points;
+}
+
+std::vector<ProbePoint> RunStrided(const ProbeOptions& options,
+                                   KProfArena& arena) {
+  std::vector<ProbePoint> points;
+  auto monitor = OpenMonitor(latencyCounters);
+  auto size = MaxWorkingSet(options);
+  size_t n = size / sizeof(uint64_t);
+  auto data = arena.Get<uint64_t>("strided", n);
+  std::iota(data, data + n, 0);
+
+  for (size_t stride = sizeof(uint64_t); stride <= 4096; stride *= 2) {
+    auto step = stride / sizeof(uint64_t);
+    auto loads = n / step;
+    auto medians = Measure(*monitor, "strided", options, [&](KProfEvent& m) {
+      m.StartCounters();
+      uint64_t sum = 0;
+      for (size_t i = 0; i < loads; ++i) sum += data[i * step];
+      m.StopCounters();
+      sink = sum;
+    });
+    points.push_back(MakePoint("strided", "stride=" + std::to_string(stride),
+                               0, medians, loads));
+  }
+  arena.Release("strided");
+  return points;
+}
+
+std::vector<ProbePoint> RunTlb(const ProbeOptions& options,
+                               KProfArena& arena) {
+  std::vector<ProbePoint> points;
+  auto monitor = OpenMonitor(tlbCounters);
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  auto linesPerPage = pageSize / sizeof(Line);
+  auto hops = (options.chaseHops + 7) / 8 * 8;
+
+  // transparent huge pages would multiply the reach, so they are declined
+  // before the pages are touched
+  auto bufferOptions = arena.GetDefaults();
+  bufferOptions.alignment = pageSize;
+  bufferOptions.pages = PageSize::BASE;
+  bufferOptions.prefault = false;
+  auto span = options.maxPages * pageSize;
+  auto buffer = arena.Get<char>("tlb", span, bufferOptions);
+  madvise(buffer, span, MADV_NOHUGEPAGE);
+  for (size_t offset = 0; offset < span; offset += pageSize)
+    buffer[offset] = 0;
+
+  for (auto pages : Series(8, options.maxPages)) {
+    // one line per page, at a different offset in each so that the lines
+    // spread over the cache sets
+    auto line = [&](size_t page) {
+      return reinterpret_cast<Line*>(buffer + page * pageSize) +
+             page % linesPerPage;
+    };
+    auto next = RandomCycle(pages, pages);
+    for (size_t i = 0; i < pages; ++i) line(i)->next = line(next[i]);
+
+    auto medians = Measure(*monitor, "tlb", options, [&](KProfEvent& m) {
+      m.StartCounters();
+      auto end = Chase(line(0), hops);
+      m.StopCounters();
+      sink = reinterpret_cast<uintptr_t>(end);
+    });
+    points.push_back(
+        MakePoint("tlb", std::to_string(pages) + " pages", 0, medians, hops));
+  }
+  arena.Release("tlb");
+  return points;
+}
+
+std::vector<ProbePoint> RunBranch(const ProbeOptions& options,
+                                  KProfArena& arena) {
+  std::vector<ProbePoint> points;
+  auto monitor = OpenMonitor(branchCounters);
+  auto n = options.branches;
+  auto bits = arena.Get<uint8_t>("branch", n);
+  std::mt19937_64 generator(n);
+
+  auto measure = [&](const std::string& point) {
+    auto medians = Measure(*monitor, "branch", options, [&](KProfEvent& m) {
+      m.StartCounters();
+      uint64_t taken = 0;
+      for (size_t i = 0; i < n; ++i)
+        if (bits[i]) {
+          // keeps the compiler from turning the branch into a select
+          asm volatile("");
+          taken++;
+        }
+      m.StopCounters();
+      sink = taken;
+    });
+    points.push_back(MakePoint("branch", point, 0, medians, n));
+  };
+
+  for (double p : {0.0, 0.01, 0.1, 0.25, 0.5}) {
+    std::bernoulli_distribution taken(p);
+    for (size_t i = 0; i < n; ++i) bits[i] = taken(generator);
+    std::ostringstream point;
+    point << "p=" << p;
+    measure(point.str());
+  }
+  // a random pattern repeated: predictable once the predictor's history
+  // covers the period
+  std::bernoulli_distribution taken(0.5);
+  for (size_t period = 2; period <= (64 << 10) && period < n; period *= 2) {
+    for (size_t i = 0; i < period; ++i) bits[i] = taken(generator);
+    for (size_t i = period; i < n; ++i) bits[i] = bits[i - period];
+    measure("period=" + std::to_string(period));
+  }
+  arena.Release("branch");
+  return points;
+}
+
+};  // namespace KProfProbe
@@ -0,0 +1,156 @@
+#include "Arena.hpp"
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace KProf {
+
+inline size_t PageBytes(PageSize pages) {
+  switch (pages) {
+    case PageSize::HUGE_2M:
+      return size_t(2) << 20;
+    case PageSize::HUGE_1G:
+      return size_t(1) << 30;
+    default:
+      return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  }
+}
+
+void* KProfArena::Get(const std::string& name, size_t size,
+                      const BufferOptions& options) {
+  auto it = std::find_if(buffers.begin(), buffers.end(),
+                         [&](auto& buffer) { return buffer.name == name; });
+
+  if (it != buffers.end()) {
+    auto& buffer = *it;
+    bool fits = buffer.data && size <= buffer.mapped -
+                                           (static_cast<char*>(buffer.data) -
+                                            static_cast<char*>(buffer.base));
+    bool same = buffer.options.alignment == options.alignment &&
+                buffer.options.pages == options.pages &&
+                buffer.options.numaNode == options.numaNode;
+    if (fits && same) {
+      buffer.size = size;
+      return buffer.data;
+    }
+    Unmap(buffer);
+    buffer.size = size;
+    buffer.options = options;
+    Map(buffer);
+    return buffer.data;
+  }
+
+  ArenaBuffer buffer;
+  buffer.name = name;
+  buffer.size = size;
+  buffer.options = options;
+  Map(buffer);
+  buffers.push_back(buffer);
+  return buffers.back().data;
+}
+
+void KProfArena::Map(ArenaBuffer& buffer) {
+  auto& options = buffer.options;
+  if (options.alignment == 0 || (options.alignment & (options.alignment - 1)))
+    throw std::runtime_error("Buffer " + buffer.name +
+                             ": alignment must be a power of two");
+
+  buffer.pages = options.pages;
+  auto alignment = options.alignment;
+  // transparent huge pages are only used for 2 MiB aligned ranges
+  if (buffer.pages == PageSize::TRANSPARENT_HUGE)
+    alignment = std::max(alignment, size_t(2) << 20);
+
+  auto pageBytes = PageBytes(buffer.pages);
+  auto slack = (alignment > pageBytes) ? alignment : 0;
+  auto length = (std::max(buffer.size, size_t(1)) + slack + pageBytes - 1) /
+                pageBytes * pageBytes;
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (buffer.pages == PageSize::HUGE_2M)
+    flags |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+  if (buffer.pages == PageSize::HUGE_1G)
+    flags |= MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+
+  void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (base == MAP_FAILED && (flags & MAP_HUGETLB)) {
+    std::cerr << "Buffer " << buffer.name
+              << ": no huge pages available (" << strerror(errno)
+              << "). Falling back to transparent huge pages." << std::endl;
+    buffer.pages = PageSize::TRANSPARENT_HUGE;
+    alignment = std::max(alignment, size_t(2) << 20);
+    pageBytes = PageBytes(buffer.pages);
+    length = (std::max(buffer.size, size_t(1)) + alignment + pageBytes - 1) /
+             pageBytes * pageBytes;
+    base = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (base == MAP_FAILED) {
+    std::stringstream errmsg;
+    errmsg << "Cannot map " << length << " bytes for buffer " << buffer.name
+           << ": " << strerror(errno);
+    throw std::runtime_error(errmsg.str());
+  }
+  buffer.base = base;
+  buffer.mapped = length;
+  mappings++;
+
+  if (buffer.pages == PageSize::TRANSPARENT_HUGE &&
+      madvise(base, length, MADV_HUGEPAGE) != 0)
+    std::cerr << "Buffer " << buffer.name
+              << ": madvise(MADV_HUGEPAGE) failed: " << strerror(errno)
+              << std::endl;
+
+  // the policy has to be in place before the pages are touched
+  if (options.numaNode >= 0) {
+    constexpr size_t bitsPerWord = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> nodemask(options.numaNode / bitsPerWord + 1, 0);
+    nodemask[options.numaNode / bitsPerWord] |=
+        1UL << (options.numaNode % bitsPerWord);
+    if (syscall(SYS_mbind, base, length, MPOL_BIND, nodemask.data(),
+                nodemask.size() * bitsPerWord + 1, MPOL_MF_STRICT) != 0)
+      std::cerr << "Buffer " << buffer.name << ": cannot bind to NUMA node "
+                << options.numaNode << ": " << strerror(errno) << std::endl;
+  }
+
+  auto address = reinterpret_cast<uintptr_t>(base);
+  address = (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  buffer.data = reinterpret_cast<void*>(address);
+
+  if (options.prefault) {
+    auto bytes = static_cast<volatile char*>(base);
+    auto step = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    for (size_t offset = 0; offset < length; offset += step) bytes[offset] = 0;
+  }
+}
+
+void KProfArena::Unmap(ArenaBuffer& buffer) {
+  if (buffer.base) munmap(buffer.base, buffer.mapped);
+  buffer.base = nullptr;
+  buffer.data = nullptr;
+  buffer.mapped = 0;
+}
+
+void KProfArena::Release(const std::string& name) {
+  auto it = std::find_if(buffers.begin(), buffers.end(),
+                         [&](auto& buffer) { return buffer.name == name; });
+  if (it == buffers.end()) return;
+  Unmap(*it);
+  buffers.erase(it);
+}
+
+void KProfArena::Clear() {
+  for (auto& buffer : buffers) Unmap(buffer);
+  buffers.clear();
+}
+
+};  // namespace KProf
@@ -0,0 +1,274 @@
+#include "Autotune.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "HostInfo.hpp"
+
+namespace KProf {
+
+KProfAutotuner::KProfAutotuner(const std::string& _name,
+                               const TuningOptions& _options)
+    : name(_name), options(_options) {}
+
+void KProfAutotuner::AddVariant(const std::string& label,
+                                const Kernel& kernel) {
+  variants.push_back({label, {}, kernel});
+}
+
+void KProfAutotuner::AddParameter(const std::string& parameter,
+                                  const std::vector<int64_t>& values) {
+  if (values.empty())
+    throw std::runtime_error("Parameter " + parameter + " has no values");
+  parameters.push_back({parameter, values});
+}
+
+void KProfAutotuner::SetKernel(const ParametricKernel& kernel) {
+  parametric = kernel;
+}
+
+std::vector<KProfAutotuner::Candidate> KProfAutotuner::Candidates() {
+  auto candidates = variants;
+  if (!parametric || parameters.empty()) return candidates;
+
+  // odometer over the value lists, the last parameter moving fastest
+  std::vector<size_t> index(parameters.size(), 0);
+  for (;;) {
+    Candidate candidate;
+    for (size_t p = 0; p < parameters.size(); ++p) {
+      auto& [parameter, values] = parameters[p];
+      candidate.parameters[parameter] = values[index[p]];
+      candidate.label += (p ? " " : "") + parameter + "=" +
+                         std::to_string(values[index[p]]);
+    }
+    auto kernel = parametric;
+    auto point = candidate.parameters;
+    candidate.kernel = [kernel, point](KProfEvent& m, KProfArena& arena) {
+      kernel(m, arena, point);
+    };
+    candidates.push_back(candidate);
+
+    size_t p = parameters.size();
+    while (p > 0 && ++index[p - 1] == parameters[p - 1].second.size())
+      index[--p] = 0;
+    if (p == 0) break;
+  }
+  return candidates;
+}
+
+bool KProfAutotuner::Better(double a, double b) const {
+  if (std::isnan(b)) return !std::isnan(a);
+  if (std::isnan(a)) return false;
+  return options.maximize ? a > b : a < b;
+}
+
+double KProfAutotuner::Evaluate(KProfEvent& monitor,
+                                const Candidate& candidate,
+                                size_t repetitions) {
+  auto harnessOptions = options.harness;
+  harnessOptions.repetitions = repetitions;
+  KProfHarness harness(harnessOptions);
+  auto result = harness.Run(candidate.label, monitor, [&](KProfEvent& m) {
+    candidate.kernel(m, harness.GetArena());
+  });
+
+  auto score = result.CleanMedian(options.objective);
+  if (std::isnan(score) && !result.samples.empty())
+    throw std::runtime_error("Objective " + options.objective +
+                             " is not in the report of " + candidate.label);
+  return score;
+}
+
+TuningResult KProfAutotuner::Tune(const std::string& problem) {
+  TuningResult result;
+  result.tuner = name;
+  result.problem = problem;
+  result.objective = options.objective;
+
+  auto candidates = Candidates();
+  if (candidates.empty())
+    throw std::runtime_error("Autotuner " + name + " has no candidates");
+
+  if (!options.retune && LoadCached(problem, result)) {
+    for (auto& candidate : candidates)
+      if (candidate.label == result.best) {
+        result.parameters = candidate.parameters;
+        return result;
+      }
+    // the space changed since, so the cached winner may not be in it
+    result.cached = false;
+  }
+
+  auto monitor = options.counterConfig.empty()
+                     ? std::make_unique<KProfEvent>()
+                     : std::make_unique<KProfEvent>(options.counterConfig);
+
+  auto evaluate = [&](size_t i, size_t repetitions) {
+    TuningCandidate evaluated;
+    evaluated.label = candidates[i].label;
+    evaluated.parameters = candidates[i].parameters;
+    evaluated.repetitions = repetitions;
+    evaluated.score = Evaluate(*monitor, candidates[i], repetitions);
+    if (options.harness.progress)
+      std::cout << name << ": " << evaluated.label << " -> "
+                << evaluated.score << std::endl;
+    result.evaluated.push_back(evaluated);
+    return evaluated.score;
+  };
+
+  std::vector<size_t> order(candidates.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+
+  std::vector<std::pair<double, size_t>> scored;
+  switch (options.strategy) {
+    case SearchStrategy::RANDOM: {
+      std::mt19937_64 generator(options.seed ? options.seed
+                                             : std::random_device()());
+      std::shuffle(order.begin(), order.end(), generator);
+      order.resize(
+          std::min(order.size(), std::max<size_t>(options.randomTrials, 1)));
+      [[fallthrough]];
+    }
+    case SearchStrategy::EXHAUSTIVE:
+      for (auto i : order)
+        scored.push_back({evaluate(i, options.harness.repetitions), i});
+      break;
+    case SearchStrategy::SUCCESSIVE_HALVING: {
+      auto repetitions = std::max<size_t>(options.firstRound, 1);
+      for (auto i : order) scored.push_back({0.0, i});
+      for (;;) {
+        for (auto& [score, i] : scored) score = evaluate(i, repetitions);
+        if (scored.size() == 1) break;
+        std::stable_sort(scored.begin(), scored.end(),
+                         [&](auto& a, auto& b) {
+                           return Better(a.first, b.first);
+                         });
+        scored.resize((scored.size() + 1) / 2);
+        repetitions = std::min(repetitions * 2,
+                               std::max(options.harness.repetitions,
+                                        repetitions));
+      }
+      break;
+    }
+  }
+
+  auto best = scored.front();
+  for (auto& entry : scored)
+    if (Better(entry.first, best.first)) best = entry;
+  result.best = candidates[best.second].label;
+  result.parameters = candidates[best.second].parameters;
+  result.score = best.first;
+  SaveCached(result);
+  return result;
+}
+
+KProfAutotuner::Kernel KProfAutotuner::GetKernel(const std::string& label) {
+  for (auto& candidate : Candidates())
+    if (candidate.label == label) return candidate.kernel;
+  throw std::runtime_error("Autotuner " + name + " has no candidate " +
+                           label);
+}
+
+std::string KProfAutotuner::CacheFile() {
+  if (!options.cacheFile.empty()) return options.cacheFile;
+  auto env = std::getenv("KPROF_TUNING_CACHE");
+  if (env && *env) return env;
+  return CacheDirectory() + "/tuning.tsv";
+}
+
+// one result per line: tuner, CPU model, problem, objective, best, score,
+// separated by tabs as CPU models and labels may contain commas
+inline std::vector<std::string> SplitTabs(const std::string& line) {
+  std::vector<std::string> fields;
+  std::stringstream stream(line);
+  std::string field;
+  while (std::getline(stream, field, '\t')) fields.push_back(field);
+  return fields;
+}
+
+bool KProfAutotuner::LoadCached(const std::string& problem,
+                                TuningResult& cached) {
+  std::ifstream file(CacheFile());
+  if (!file.is_open()) return false;
+
+  auto& cpu = GetHostInfo().modelName;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    auto fields = SplitTabs(line);
+    if (fields.size() != 6 || fields[0] != name || fields[1] != cpu ||
+        fields[2] != problem || fields[3] != options.objective)
+      continue;
+    cached.best = fields[4];
+    try {
+      cached.score = std::stod(fields[5]);
+    } catch (std::exception&) {
+      cached.score = NAN;
+    }
+    cached.cached = true;
+    return true;
+  }
+  return false;
+}
+
+void KProfAutotuner::SaveCached(const TuningResult& result) {
+  auto filename = CacheFile();
+  auto& cpu = GetHostInfo().modelName;
+
+  // keep every other result
+  std::vector<std::string> lines;
+  {
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.empty() || line[0] == '#') continue;
+      auto fields = SplitTabs(line);
+      if (fields.size() == 6 && fields[0] == name && fields[1] == cpu &&
+          fields[2] == result.problem && fields[3] == result.objective)
+        continue;
+      lines.push_back(line);
+    }
+  }
+
+  std::error_code error;
+  auto dir = std::filesystem::path(filename).parent_path();
+  if (!dir.empty()) std::filesystem::create_directories(dir, error);
+
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    std::cerr << "Cannot write tuning cache " << filename
+              << ". The result will be measured again next time."
+              << std::endl;
+    return;
+  }
+  file << "# KappaProf tuning results, delete to tune again" << std::endl;
+  for (auto& line : lines) file << line << std::endl;
+  file << name << '\t' << cpu << '\t' << result.problem << '\t'
+       << result.objective << '\t' << result.best << '\t'
+       << std::setprecision(17) << result.score << std::endl;
+}
+
+void KProfAutotuner::PrintResult(const TuningResult& result) {
+  std::cout << result.tuner << " (" << result.problem << "): best "
+            << result.best << ", " << result.objective << " "
+            << result.score << (result.cached ? " (cached)" : "")
+            << std::endl;
+  if (result.evaluated.empty()) return;
+
+  std::cout << std::left << std::setw(32) << "Candidate" << std::right
+            << std::setw(8) << "runs" << std::setw(16) << result.objective
+            << std::endl;
+  for (auto& candidate : result.evaluated)
+    std::cout << std::left << std::setw(32) << candidate.label << std::right
+              << std::setw(8) << candidate.repetitions << std::setw(16)
+              << candidate.score << std::endl;
+}
+
+};  // namespace KProf
@@ -0,0 +1,78 @@
+#include "CacheControl.hpp"
+
+#include <cstdlib>
+#include <stdexcept>
+
+#include "HostInfo.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace KProf {
+
+// smallest line size in use, so no line is skipped
+constexpr size_t kFlushStride = 64;
+
+const char* CacheStateName(CacheState state) {
+  switch (state) {
+    case CacheState::COLD:
+      return "cold";
+    case CacheState::WARM:
+      return "warm";
+    case CacheState::PARTIAL:
+      return "partial";
+    default:
+      return "as-is";
+  }
+}
+
+bool FlushBuffer(const void* buffer, size_t size) {
+  auto begin = reinterpret_cast<uintptr_t>(buffer) & ~(kFlushStride - 1);
+  auto end = reinterpret_cast<uintptr_t>(buffer) + size;
+#if defined(__x86_64__) || defined(__i386__)
+  for (auto line = begin; line < end; line += kFlushStride)
+    _mm_clflush(reinterpret_cast<const void*>(line));
+  _mm_mfence();
+  return true;
+#elif defined(__aarch64__)
+  for (auto line = begin; line < end; line += kFlushStride)
+    asm volatile("dc civac, %0" ::"r"(line) : "memory");
+  asm volatile("dsb ish" ::: "memory");
+  return true;
+#else
+  (void)begin;
+  (void)end;
+  return false;
+#endif
+}
+
+void TouchBuffer(const void* buffer, size_t size) {
+  auto bytes = static_cast<const volatile char*>(buffer);
+  char sink = 0;
+  for (size_t offset = 0; offset < size; offset += kFlushStride)
+    sink ^= bytes[offset];
+  if (size) sink ^= bytes[size - 1];
+  (void)sink;
+}
+
+CacheSweeper::CacheSweeper(size_t _size) : size(_size) {
+  if (size == 0) size = 2 * LastLevelCacheSize();
+  // no sysfs cache information, sweep twice a generous 64 MiB LLC
+  if (size == 0) size = size_t(128) << 20;
+
+  buffer = static_cast<char*>(aligned_alloc(4096, (size + 4095) & ~size_t(4095)));
+  if (!buffer) throw std::runtime_error("Cannot allocate the cache sweep buffer");
+  for (size_t offset = 0; offset < size; offset += 4096) buffer[offset] = 1;
+}
+
+CacheSweeper::~CacheSweeper() { free(buffer); }
+
+void CacheSweeper::Sweep() {
+  // writes, so modified lines of the kernel's data are written back as well
+  auto bytes = static_cast<volatile char*>(buffer);
+  for (size_t offset = 0; offset < size; offset += kFlushStride)
+    bytes[offset] = bytes[offset] + 1;
+}
+
+};  // namespace KProf
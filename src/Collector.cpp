@@ -0,0 +1,267 @@
+#include "Collector.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+namespace KProf {
+
+// "KPROFRNG"
+constexpr uint64_t kCollectorMagic = 0x474E52464F52504BULL;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the collector ring needs lock-free 64-bit atomics");
+
+// The ring is a bounded multi-producer queue in the style of D. Vyukov:
+// every record carries a sequence number. A record at ring position pos is
+// free for the producer claiming pos when sequence == pos, and ready for the
+// consumer when sequence == pos + 1. Consuming it sets sequence to
+// pos + capacity, which frees it for the next lap.
+
+inline void CopyName(char* dst, const std::string& src) {
+  auto len = std::min(src.size(), kCollectorNameLength - 1);
+  memcpy(dst, src.data(), len);
+  dst[len] = '\0';
+}
+
+inline int RankFromEnvironment() {
+  // MPI launchers and Slurm export the rank of the process, KPROF_RANK
+  // overrides them
+  for (auto var : {"KPROF_RANK", "OMPI_COMM_WORLD_RANK", "PMI_RANK",
+                   "PMIX_RANK", "SLURM_PROCID"}) {
+    auto value = std::getenv(var);
+    if (value) {
+      try {
+        return std::stoi(value);
+      } catch (std::exception&) {
+      }
+    }
+  }
+  return static_cast<int>(getpid());
+}
+
+KProfPublisher::KProfPublisher(const std::string& name, int _rank)
+    : rank(_rank < 0 ? RankFromEnvironment() : _rank) {
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd == -1) {
+    std::stringstream errmsg;
+    errmsg << "Cannot open collector segment " << name << ": "
+           << strerror(errno) << ". Is the aggregator running?";
+    throw std::runtime_error(errmsg.str());
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  mapped = st.st_size;
+  auto addr =
+      mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED || mapped < sizeof(CollectorSegment))
+    throw std::runtime_error("Cannot map collector segment " + name);
+
+  segment = static_cast<CollectorSegment*>(addr);
+  if (segment->magic != kCollectorMagic ||
+      mapped < sizeof(CollectorSegment) +
+                   segment->capacity * sizeof(CollectorRecord)) {
+    munmap(addr, mapped);
+    segment = nullptr;
+    throw std::runtime_error(name + " is not a KProf collector segment");
+  }
+}
+
+KProfPublisher::~KProfPublisher() {
+  if (segment) munmap(segment, mapped);
+}
+
+bool KProfPublisher::Publish(const std::string& region,
+                             std::vector<KProfCounter>& report) {
+  auto mask = segment->capacity - 1;
+  auto records = segment->Records();
+
+  CollectorRecord* record;
+  auto pos = segment->enqueuePos.load(std::memory_order_relaxed);
+  for (;;) {
+    record = &records[pos & mask];
+    auto seq = record->sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+    if (diff == 0) {
+      if (segment->enqueuePos.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      segment->dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      pos = segment->enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+
+  record->rank = static_cast<uint32_t>(rank);
+  CopyName(record->region, region);
+  auto count = std::min(report.size(), kCollectorCounters);
+  for (size_t i = 0; i < count; ++i) {
+    CopyName(record->counters[i].name, report[i].GetName());
+    record->counters[i].value = report[i].GetValue();
+    record->counters[i].derived = report[i].IsDerived();
+  }
+  record->numCounters = static_cast<uint32_t>(count);
+  record->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+KProfAggregator::KProfAggregator(const std::string& _name, size_t capacity)
+    : name(_name) {
+  // round up to a power of two, the ring indexes with a mask
+  size_t rounded = 1;
+  while (rounded < capacity) rounded <<= 1;
+  capacity = rounded;
+
+  // a segment left behind by a crashed aggregator is replaced
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1) {
+    std::stringstream errmsg;
+    errmsg << "Cannot create collector segment " << name << ": "
+           << strerror(errno);
+    throw std::runtime_error(errmsg.str());
+  }
+
+  mapped = sizeof(CollectorSegment) + capacity * sizeof(CollectorRecord);
+  if (ftruncate(fd, mapped) != 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    throw std::runtime_error("Cannot size collector segment " + name);
+  }
+  auto addr =
+      mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    throw std::runtime_error("Cannot map collector segment " + name);
+  }
+
+  segment = new (addr) CollectorSegment;
+  segment->capacity = capacity;
+  segment->enqueuePos.store(0);
+  segment->dequeuePos.store(0);
+  segment->dropped.store(0);
+  auto records = segment->Records();
+  for (size_t i = 0; i < capacity; ++i) {
+    new (&records[i]) CollectorRecord;
+    records[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  // publishers check the magic last
+  std::atomic_thread_fence(std::memory_order_release);
+  segment->magic = kCollectorMagic;
+}
+
+KProfAggregator::~KProfAggregator() {
+  munmap(segment, mapped);
+  shm_unlink(name.c_str());
+}
+
+size_t KProfAggregator::Drain() {
+  auto mask = segment->capacity - 1;
+  auto records = segment->Records();
+  size_t drained = 0;
+
+  // single consumer, so dequeuePos needs no compare-and-swap
+  auto pos = segment->dequeuePos.load(std::memory_order_relaxed);
+  for (;; ++pos, ++drained) {
+    auto& record = records[pos & mask];
+    if (record.sequence.load(std::memory_order_acquire) != pos + 1) break;
+
+    std::string region(record.region);
+    auto& rankTotals = totals[region][record.rank];
+    auto& order = counterOrder[region];
+    for (uint32_t i = 0; i < record.numCounters; ++i) {
+      std::string counter(record.counters[i].name);
+      if (std::find(order.begin(), order.end(), counter) == order.end())
+        order.push_back(counter);
+      rankTotals[counter] += record.counters[i].value;
+      if (record.counters[i].derived) derivedCounters[region].insert(counter);
+    }
+    recordCounts[region][record.rank]++;
+
+    record.sequence.store(pos + segment->capacity, std::memory_order_release);
+  }
+  segment->dequeuePos.store(pos, std::memory_order_relaxed);
+  return drained;
+}
+
+std::vector<RegionSummary> KProfAggregator::GetReport() {
+  std::vector<RegionSummary> report;
+
+  for (auto& [region, ranks] : totals) {
+    RegionSummary summary;
+    summary.region = region;
+    summary.ranks = ranks.size();
+    for (auto& [rank, count] : recordCounts[region]) summary.records += count;
+
+    for (auto& counter : counterOrder[region]) {
+      RankStatistics stats;
+      stats.counter = counter;
+      stats.derived = derivedCounters[region].count(counter) > 0;
+      bool first = true;
+      for (auto& [rank, values] : ranks) {
+        auto it = values.find(counter);
+        double value = (it == values.end()) ? 0.0 : it->second;
+        // a ratio summed over records means nothing, average it instead
+        if (stats.derived) value /= recordCounts[region][rank];
+        stats.total += value;
+        if (first || value < stats.min) {
+          stats.min = value;
+          stats.minRank = rank;
+        }
+        if (first || value > stats.max) {
+          stats.max = value;
+          stats.maxRank = rank;
+        }
+        first = false;
+      }
+      stats.mean = stats.total / ranks.size();
+      if (stats.derived) stats.total = std::nan("");
+      stats.imbalance = (stats.mean != 0.0) ? stats.max / stats.mean - 1.0 : 0.0;
+      summary.counters.push_back(stats);
+    }
+    report.push_back(summary);
+  }
+  return report;
+}
+
+void KProfAggregator::PrintReport() {
+  for (auto& summary : GetReport()) {
+    std::cout << summary.region << ": " << summary.ranks << " rank(s), "
+              << summary.records << " record(s)" << std::endl;
+    for (auto& stats : summary.counters) {
+      std::cout << "  " << std::left << std::setw(22) << stats.counter
+                << std::right << (stats.derived ? " mean  " : " total ")
+                << std::setw(14) << std::setprecision(6)
+                << (stats.derived ? stats.mean : stats.total) << "  min "
+                << std::setw(12) << stats.min << " (rank " << stats.minRank
+                << ")  max " << std::setw(12) << stats.max << " (rank "
+                << stats.maxRank << ")  imbalance " << std::fixed
+                << std::setprecision(2) << 100.0 * stats.imbalance << "%"
+                << std::defaultfloat << std::endl;
+    }
+  }
+  auto dropped = GetDropped();
+  if (dropped)
+    std::cerr << dropped
+              << " record(s) were dropped because the ring was full. "
+                 "Drain more often or increase its capacity."
+              << std::endl;
+}
+
+};  // namespace KProf
@@ -0,0 +1,317 @@
+#include "Columnar.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace KProf {
+
+template <typename T>
+inline void Put(std::string& out, T value) {
+  char raw[sizeof(T)];
+  memcpy(raw, &value, sizeof(T));
+  out.append(raw, sizeof(T));
+}
+
+inline void PadTo8(std::string& out) {
+  out.append((8 - out.size() % 8) % 8, '\0');
+}
+
+inline uint64_t ZigZag(uint64_t delta) {
+  auto value = static_cast<int64_t>(delta);
+  return (static_cast<uint64_t>(value) << 1) ^
+         static_cast<uint64_t>(value >> 63);
+}
+
+inline uint64_t UnZigZag(uint64_t value) {
+  return (value >> 1) ^ (~(value & 1) + 1);
+}
+
+bool IsColumnarFile(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  char magic[sizeof(kColumnarMagic)];
+  return file.read(magic, sizeof(magic)) &&
+         memcmp(magic, kColumnarMagic, sizeof(magic)) == 0;
+}
+
+std::string ColumnarHeader(const std::vector<std::string>& columns,
+                           const std::vector<bool>& derived,
+                           const Metadata& metadata) {
+  std::string header(kColumnarMagic, sizeof(kColumnarMagic));
+  Put(header, kColumnarVersion);
+  Put(header, static_cast<uint32_t>(columns.size()));
+  Put(header, static_cast<uint32_t>(metadata.size()));
+  for (auto& [key, value] : metadata) {
+    Put(header, static_cast<uint16_t>(key.size()));
+    header += key;
+    Put(header, static_cast<uint32_t>(value.size()));
+    header += value;
+  }
+  for (size_t i = 0; i < columns.size(); ++i) {
+    Put(header, static_cast<uint8_t>(derived[i]));
+    Put(header, static_cast<uint16_t>(columns[i].size()));
+    header += columns[i];
+  }
+  PadTo8(header);
+  return header;
+}
+
+void EncodeChunk(std::string& out,
+                 const std::vector<std::vector<uint64_t>>& values,
+                 const std::vector<bool>& derived, size_t rows, bool delta) {
+  Put(out, static_cast<uint32_t>(rows));
+  Put(out, static_cast<uint32_t>(values.size()));
+
+  std::string varints;
+  for (size_t c = 0; c < values.size(); ++c) {
+    auto& column = values[c];
+    varints.clear();
+    if (delta && !derived[c]) {
+      uint64_t previous = 0;
+      for (size_t r = 0; r < rows; ++r) {
+        auto value = ZigZag(column[r] - previous);
+        previous = column[r];
+        while (value >= 0x80) {
+          varints += static_cast<char>((value & 0x7F) | 0x80);
+          value >>= 7;
+        }
+        varints += static_cast<char>(value);
+      }
+    }
+
+    if (!varints.empty() && varints.size() < rows * sizeof(uint64_t)) {
+      Put(out, static_cast<uint32_t>(ColumnEncoding::DELTA));
+      Put(out, uint32_t(0));
+      Put(out, static_cast<uint64_t>(varints.size()));
+      out += varints;
+      PadTo8(out);
+    } else {
+      Put(out, static_cast<uint32_t>(ColumnEncoding::PLAIN));
+      Put(out, uint32_t(0));
+      Put(out, static_cast<uint64_t>(rows * sizeof(uint64_t)));
+      out.append(reinterpret_cast<const char*>(column.data()),
+                 rows * sizeof(uint64_t));
+    }
+  }
+}
+
+KProfColumnReader::KProfColumnReader(const std::string& _filename)
+    : filename(_filename) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    std::stringstream errmsg;
+    errmsg << "Error opening file: " << filename;
+    throw std::runtime_error(errmsg.str());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0) size = static_cast<size_t>(st.st_size);
+  if (size > 0) {
+    auto mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Cannot map " + filename);
+    }
+    base = static_cast<const uint8_t*>(mapping);
+  }
+  close(fd);  // the mapping keeps the file
+
+  try {
+    Parse();
+  } catch (std::exception&) {
+    if (base) munmap(const_cast<uint8_t*>(base), size);
+    throw;
+  }
+}
+
+KProfColumnReader::~KProfColumnReader() {
+  if (base) munmap(const_cast<uint8_t*>(base), size);
+}
+
+void KProfColumnReader::Parse() {
+  size_t offset = 0;
+  auto available = [&](size_t bytes) { return size - offset >= bytes; };
+  auto get = [&](auto& value) {
+    if (!available(sizeof(value)))
+      throw std::runtime_error(filename + " has a truncated header");
+    memcpy(&value, base + offset, sizeof(value));
+    offset += sizeof(value);
+  };
+  auto getString = [&](size_t length) {
+    if (!available(length))
+      throw std::runtime_error(filename + " has a truncated header");
+    std::string text(reinterpret_cast<const char*>(base + offset), length);
+    offset += length;
+    return text;
+  };
+
+  if (size < sizeof(kColumnarMagic) ||
+      memcmp(base, kColumnarMagic, sizeof(kColumnarMagic)) != 0)
+    throw std::runtime_error(filename + " is not a KProf columnar file");
+  offset = sizeof(kColumnarMagic);
+
+  uint32_t version, numColumns, numEntries;
+  get(version);
+  if (version != kColumnarVersion)
+    throw std::runtime_error(filename + " has unsupported version " +
+                             std::to_string(version));
+  get(numColumns);
+  get(numEntries);
+  for (uint32_t i = 0; i < numEntries; ++i) {
+    uint16_t keyLength;
+    get(keyLength);
+    auto key = getString(keyLength);
+    uint32_t valueLength;
+    get(valueLength);
+    metadata.push_back({key, getString(valueLength)});
+  }
+  for (uint32_t i = 0; i < numColumns; ++i) {
+    uint8_t isDerived;
+    uint16_t length;
+    get(isDerived);
+    get(length);
+    derived.push_back(isDerived);
+    columns.push_back(getString(length));
+  }
+  offset = (offset + 7) / 8 * 8;
+
+  while (offset < size) {
+    auto chunkStart = offset;
+    bool complete = available(8);
+    Chunk chunk;
+    if (complete) {
+      uint32_t chunkRows, chunkColumns;
+      get(chunkRows);
+      get(chunkColumns);
+      chunk.rows = chunkRows;
+      complete = chunkColumns == numColumns;
+    }
+    for (size_t c = 0; complete && c < numColumns; ++c) {
+      uint32_t encoding, reserved;
+      uint64_t bytes;
+      complete = available(16);
+      if (!complete) break;
+      get(encoding);
+      get(reserved);
+      get(bytes);
+      auto padded = (bytes + 7) / 8 * 8;
+      complete = available(padded) &&
+                 (encoding == static_cast<uint32_t>(ColumnEncoding::DELTA) ||
+                  bytes == chunk.rows * sizeof(uint64_t));
+      if (!complete) break;
+      chunk.columns.push_back(
+          {static_cast<ColumnEncoding>(encoding), base + offset, bytes});
+      offset += padded;
+    }
+    if (!complete) {
+      std::cerr << filename << ": incomplete chunk at byte " << chunkStart
+                << ". Ignoring the rest of the file." << std::endl;
+      break;
+    }
+    rows += chunk.rows;
+    chunks.push_back(std::move(chunk));
+  }
+}
+
+std::string KProfColumnReader::GetMetadata(const std::string& key) const {
+  for (auto& [name, value] : metadata)
+    if (name == key) return value;
+  return "";
+}
+
+int KProfColumnReader::FindColumn(const std::string& name) const {
+  for (size_t i = 0; i < columns.size(); ++i)
+    if (columns[i] == name) return static_cast<int>(i);
+  return -1;
+}
+
+std::span<const uint64_t> KProfColumnReader::GetCounts(
+    size_t chunk, size_t column, std::vector<uint64_t>& scratch) const {
+  auto& data = chunks[chunk].columns[column];
+  auto numRows = chunks[chunk].rows;
+  if (data.encoding == ColumnEncoding::PLAIN)
+    return {reinterpret_cast<const uint64_t*>(data.data), numRows};
+
+  scratch.resize(numRows);
+  uint64_t previous = 0;
+  size_t pos = 0;
+  for (size_t r = 0; r < numRows; ++r) {
+    uint64_t value = 0;
+    for (int shift = 0; pos < data.bytes && shift < 64; shift += 7) {
+      auto byte = data.data[pos++];
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) break;
+    }
+    previous += UnZigZag(value);
+    scratch[r] = previous;
+  }
+  return scratch;
+}
+
+std::span<const double> KProfColumnReader::GetMetrics(size_t chunk,
+                                                      size_t column) const {
+  auto& data = chunks[chunk].columns[column];
+  if (data.encoding != ColumnEncoding::PLAIN) return {};
+  return {reinterpret_cast<const double*>(data.data), chunks[chunk].rows};
+}
+
+std::vector<double> KProfColumnReader::GetValues(size_t column) const {
+  std::vector<double> values;
+  values.reserve(rows);
+  std::vector<uint64_t> scratch;
+  for (size_t chunk = 0; chunk < chunks.size(); ++chunk) {
+    if (derived[column]) {
+      auto metrics = GetMetrics(chunk, column);
+      values.insert(values.end(), metrics.begin(), metrics.end());
+    } else {
+      // the report exposes counts as long long
+      for (auto count : GetCounts(chunk, column, scratch))
+        values.push_back(static_cast<double>(static_cast<long long>(count)));
+    }
+  }
+  return values;
+}
+
+void KProfColumnReader::WriteCSV(std::ostream& out) const {
+  for (size_t i = 0; i < columns.size(); ++i)
+    out << (i ? "," : "") << columns[i];
+  out << "\n";
+
+  std::string line;
+  char digits[32];
+  std::vector<std::vector<uint64_t>> scratch(columns.size());
+  std::vector<std::span<const uint64_t>> counts(columns.size());
+  std::vector<std::span<const double>> metrics(columns.size());
+  for (size_t chunk = 0; chunk < chunks.size(); ++chunk) {
+    for (size_t c = 0; c < columns.size(); ++c) {
+      if (derived[c])
+        metrics[c] = GetMetrics(chunk, c);
+      else
+        counts[c] = GetCounts(chunk, c, scratch[c]);
+    }
+    for (size_t r = 0; r < chunks[chunk].rows; ++r) {
+      line.clear();
+      for (size_t c = 0; c < columns.size(); ++c) {
+        if (c) line += ',';
+        auto res = derived[c]
+                       ? std::to_chars(digits, digits + sizeof(digits),
+                                       metrics[c][r])
+                       : std::to_chars(digits, digits + sizeof(digits),
+                                       static_cast<long long>(counts[c][r]));
+        line.append(digits, res.ptr);
+      }
+      line += '\n';
+      out << line;
+    }
+  }
+}
+
+};  // namespace KProf
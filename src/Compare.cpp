@@ -0,0 +1,208 @@
+#include "Compare.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+#include "Columnar.hpp"
+
+namespace KProf {
+
+SampleTable LoadSamples(const std::string& csvFile) {
+  if (IsColumnarFile(csvFile)) {
+    KProfColumnReader reader(csvFile);
+    SampleTable table;
+    table.columns = reader.GetColumns();
+    for (size_t i = 0; i < table.columns.size(); ++i) {
+      table.values.push_back(reader.GetValues(i));
+      table.derived.push_back(reader.IsDerived(i));
+    }
+    return table;
+  }
+
+  std::ifstream file(csvFile);
+  if (!file.is_open()) {
+    std::stringstream errmsg;
+    errmsg << "Error opening file: " << csvFile;
+    throw std::runtime_error(errmsg.str());
+  }
+
+  SampleTable table;
+  std::string line;
+  if (!std::getline(file, line)) return table;
+
+  std::stringstream header(line);
+  std::string column;
+  while (std::getline(header, column, ',')) table.columns.push_back(column);
+  table.values.resize(table.columns.size());
+
+  size_t lineNumber = 1;
+  while (std::getline(file, line)) {
+    lineNumber++;
+    if (line.empty()) continue;
+
+    std::stringstream ss(line);
+    std::string field;
+    size_t i = 0;
+    for (; i < table.columns.size() && std::getline(ss, field, ','); ++i) {
+      try {
+        table.values[i].push_back(std::stod(field));
+      } catch (std::exception&) {
+        table.values[i].push_back(std::nan(""));
+      }
+    }
+    if (i != table.columns.size())
+      std::cerr << csvFile << ":" << lineNumber
+                << ": row is shorter than the header. Ignoring missing values."
+                << std::endl;
+  }
+
+  // the sink writes counts as integers
+  for (auto& column : table.values)
+    table.derived.push_back(
+        std::any_of(column.begin(), column.end(), [](double v) {
+          return !std::isnan(v) && v != std::trunc(v);
+        }));
+  return table;
+}
+
+double Median(std::vector<double> values) {
+  if (values.empty()) return std::nan("");
+  auto mid = values.size() / 2;
+  std::nth_element(values.begin(), values.begin() + mid, values.end());
+  if (values.size() % 2) return values[mid];
+  auto upper = values[mid];
+  auto lower = *std::max_element(values.begin(), values.begin() + mid);
+  return (lower + upper) / 2.0;
+}
+
+// Mann-Whitney U of `a` against `b` with tie correction. Returns the
+// two-sided p-value of the normal approximation and the U of `b`.
+double MannWhitney(const std::vector<double>& a, const std::vector<double>& b,
+                   double& uB) {
+  auto n1 = a.size();
+  auto n2 = b.size();
+  auto n = n1 + n2;
+
+  // pool both samples, remembering where each value came from
+  std::vector<std::pair<double, bool>> pooled;
+  pooled.reserve(n);
+  for (auto v : a) pooled.push_back({v, false});
+  for (auto v : b) pooled.push_back({v, true});
+  std::sort(pooled.begin(), pooled.end(),
+            [](auto& x, auto& y) { return x.first < y.first; });
+
+  // mid-ranks for ties, and the tie correction term sum(t^3 - t)
+  double rankSumB = 0.0;
+  double tieTerm = 0.0;
+  for (size_t i = 0; i < n;) {
+    auto j = i;
+    while (j < n && pooled[j].first == pooled[i].first) j++;
+    double rank = (i + 1 + j) / 2.0;  // average of ranks i+1 .. j
+    for (auto k = i; k < j; ++k)
+      if (pooled[k].second) rankSumB += rank;
+    double t = j - i;
+    tieTerm += t * t * t - t;
+    i = j;
+  }
+
+  uB = rankSumB - n2 * (n2 + 1) / 2.0;
+  double mean = n1 * n2 / 2.0;
+  double variance =
+      n1 * n2 / 12.0 * ((n + 1) - tieTerm / (double(n) * (n - 1)));
+  if (variance <= 0.0) return 1.0;  // all values equal
+
+  // continuity correction towards the mean
+  double diff = std::abs(uB - mean) - 0.5;
+  if (diff < 0.0) diff = 0.0;
+  double z = diff / std::sqrt(variance);
+  return std::erfc(z / std::sqrt(2.0));
+}
+
+std::vector<ComparisonResult> CompareSamples(const SampleTable& baseline,
+                                             const SampleTable& current,
+                                             const CompareOptions& options) {
+  std::vector<ComparisonResult> results;
+
+  for (size_t i = 0; i < baseline.columns.size(); ++i) {
+    auto& name = baseline.columns[i];
+    if (options.ignored.count(name)) continue;
+
+    auto it = std::find(current.columns.begin(), current.columns.end(), name);
+    if (it == current.columns.end()) continue;
+    auto j = it - current.columns.begin();
+
+    // NaN never compares equal and would break the ranking
+    std::vector<double> a, b;
+    for (auto v : baseline.values[i])
+      if (!std::isnan(v)) a.push_back(v);
+    for (auto v : current.values[j])
+      if (!std::isnan(v)) b.push_back(v);
+    if (a.empty() || b.empty()) continue;
+
+    ComparisonResult res;
+    res.counter = name;
+    res.baselineRuns = a.size();
+    res.currentRuns = b.size();
+    res.baselineMedian = Median(a);
+    res.currentMedian = Median(b);
+    res.relativeChange =
+        (res.baselineMedian != 0.0)
+            ? (res.currentMedian - res.baselineMedian) /
+                  std::abs(res.baselineMedian)
+            : (res.currentMedian == 0.0 ? 0.0 : INFINITY);
+
+    double uB;
+    res.pValue = MannWhitney(a, b, uB);
+    // probability that current > baseline, mapped onto [-1, 1]
+    res.effectSize = 2.0 * uB / (double(a.size()) * b.size()) - 1.0;
+
+    res.significant = (res.pValue < options.alpha) &&
+                      (std::abs(res.relativeChange) >= options.threshold);
+    if (options.higherIsBetter.count(name))
+      res.direction = MetricDirection::HIGHER_IS_BETTER;
+    else if (options.lowerIsBetter.count(name))
+      res.direction = MetricDirection::LOWER_IS_BETTER;
+    else if (i < baseline.derived.size() && baseline.derived[i])
+      res.direction = GetMetricDirection(name);
+    else
+      res.direction = MetricDirection::LOWER_IS_BETTER;
+
+    bool increased = res.effectSize > 0.0;
+    res.regression =
+        res.significant && res.direction != MetricDirection::UNKNOWN &&
+        increased != (res.direction == MetricDirection::HIGHER_IS_BETTER);
+    results.push_back(res);
+  }
+  return results;
+}
+
+void PrintComparison(const std::string& title,
+                     const std::vector<ComparisonResult>& results) {
+  std::cout << title << std::endl;
+  for (auto& res : results) {
+    const char* verdict = "unchanged";
+    if (res.regression)
+      verdict = "REGRESSION";
+    else if (res.significant)
+      verdict = res.direction == MetricDirection::UNKNOWN ? "changed"
+                                                          : "improvement";
+    std::cout << "  " << std::left << std::setw(22) << res.counter
+              << std::right << std::setw(16) << std::setprecision(6)
+              << res.baselineMedian << " -> " << std::setw(16)
+              << res.currentMedian << std::setw(9) << std::fixed
+              << std::setprecision(2) << std::showpos
+              << 100.0 * res.relativeChange << "%" << std::noshowpos
+              << "  p=" << std::scientific << std::setprecision(2)
+              << res.pValue << "  r=" << std::fixed << std::setprecision(2)
+              << res.effectSize << "  " << verdict << std::defaultfloat
+              << std::endl;
+  }
+}
+
+};  // namespace KProf
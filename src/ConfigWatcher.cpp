@@ -0,0 +1,170 @@
+#include "ConfigWatcher.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace KProf {
+
+// eventfd of the watcher handling the reload signal
+std::atomic<int> signalWakeFD = -1;
+
+void WakeOnSignal(int) {
+  int fd = signalWakeFD.load();
+  if (fd < 0) return;
+  uint64_t one = 1;
+  [[maybe_unused]] auto res = write(fd, &one, sizeof(one));
+}
+
+KProfConfigWatcher::KProfConfigWatcher(const std::string& _configFile,
+                                       const WatchOptions& _options)
+    : configFile(_configFile), options(_options) {
+  auto slash = configFile.rfind('/');
+  directory = slash == std::string::npos ? "." : configFile.substr(0, slash);
+  basename = slash == std::string::npos ? configFile
+                                        : configFile.substr(slash + 1);
+
+  wakeFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakeFD == -1)
+    throw std::runtime_error(std::string("eventfd failed: ") +
+                             strerror(errno));
+
+  if (options.inotify) {
+    // the directory is watched, as editors replace files by renaming
+    inotifyFD = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotifyFD == -1 ||
+        inotify_add_watch(inotifyFD, directory.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+      std::cerr << "Cannot watch " << directory << ": " << strerror(errno)
+                << ". Reloading on the signal only." << std::endl;
+      if (inotifyFD >= 0) close(inotifyFD);
+      inotifyFD = -1;
+    }
+  }
+
+  if (options.signal) {
+    signalWakeFD = wakeFD;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = WakeOnSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(options.signal, &action, &previousAction);
+  }
+
+  watcher = std::thread(&KProfConfigWatcher::WatchLoop, this);
+}
+
+KProfConfigWatcher::~KProfConfigWatcher() {
+  if (options.signal) {
+    sigaction(options.signal, &previousAction, nullptr);
+    int expected = wakeFD;
+    signalWakeFD.compare_exchange_strong(expected, -1);
+  }
+
+  stopping = true;
+  uint64_t one = 1;
+  [[maybe_unused]] auto res = write(wakeFD, &one, sizeof(one));
+  watcher.join();
+  Reclaim();
+
+  if (inotifyFD >= 0) close(inotifyFD);
+  close(wakeFD);
+}
+
+void KProfConfigWatcher::Attach(KProfEvent& monitor) {
+  std::lock_guard<std::mutex> guard(lock);
+  monitors.push_back(&monitor);
+}
+
+void KProfConfigWatcher::Detach(KProfEvent& monitor) {
+  std::lock_guard<std::mutex> guard(lock);
+  std::erase(monitors, &monitor);
+}
+
+bool KProfConfigWatcher::Reload() {
+  std::lock_guard<std::mutex> guard(lock);
+  if (monitors.empty()) return true;
+
+  // The file is validated once, on this thread, so that a monitor whose
+  // thread has exited cannot reject it for all others. A rejected file
+  // leaves all monitors as they are.
+  try {
+    KProfEvent validated(configFile, 0);
+  } catch (std::exception& e) {
+    std::cerr << "Rejected " << configFile << ": " << e.what()
+              << ". Keeping the current counters." << std::endl;
+    rejected++;
+    return false;
+  }
+
+  // every set is opened before any is published
+  std::vector<KProfEvent*> prepared;
+  for (auto monitor : monitors) {
+    try {
+      prepared.push_back(new KProfEvent(configFile, monitor->GetOwner()));
+    } catch (std::exception& e) {
+      // e.g. the monitor's thread has exited
+      std::cerr << "Cannot open the counters of " << configFile
+                << " for thread " << monitor->GetOwner() << ": " << e.what()
+                << ". Its monitor keeps the current counters." << std::endl;
+      prepared.push_back(nullptr);
+    }
+  }
+
+  for (size_t i = 0; i < monitors.size(); ++i)
+    if (prepared[i]) monitors[i]->PublishConfig(prepared[i]);
+  reloads++;
+  return true;
+}
+
+void KProfConfigWatcher::Reclaim() {
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto monitor : monitors) monitor->ReclaimConfig();
+}
+
+bool KProfConfigWatcher::ConfigChanged() {
+  alignas(inotify_event) char events[4096];
+  bool changed = false;
+  ssize_t length;
+  while ((length = read(inotifyFD, events, sizeof(events))) > 0) {
+    for (ssize_t offset = 0; offset < length;) {
+      auto event = reinterpret_cast<inotify_event*>(events + offset);
+      if (event->len && basename == event->name) changed = true;
+      offset += sizeof(inotify_event) + event->len;
+    }
+  }
+  return changed;
+}
+
+void KProfConfigWatcher::WatchLoop() {
+  pollfd fds[2] = {{wakeFD, POLLIN, 0}, {inotifyFD, POLLIN, 0}};
+  nfds_t count = inotifyFD >= 0 ? 2 : 1;
+  while (!stopping) {
+    // wakes up once a second to close the counters monitors have replaced
+    if (poll(fds, count, 1000) < 0 && errno != EINTR) break;
+    if (stopping) break;
+
+    bool reload = false;
+    uint64_t signals;
+    if ((fds[0].revents & POLLIN) &&
+        read(wakeFD, &signals, sizeof(signals)) == sizeof(signals))
+      reload = true;
+    if (count == 2 && (fds[1].revents & POLLIN) && ConfigChanged()) {
+      // an editor may write the file in several steps
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      ConfigChanged();
+      reload = true;
+    }
+
+    if (reload) Reload();
+    Reclaim();
+  }
+}
+
+};  // namespace KProf
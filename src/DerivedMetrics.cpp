@@ -0,0 +1,269 @@
+#include "DerivedMetrics.hpp"
+
+#include <algorithm>  // for std::find
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace KProf {
+
+inline bool IsLabelStart(char c) {
+  return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+inline bool IsLabelChar(char c) {
+  // labels such as "L1d-read-miss" or "LLC-misses-intel:k" are legal
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' ||
+         c == '.' || c == ':' || c == '[' || c == ']';
+}
+
+MetricDirection GetMetricDirection(const std::string& name) {
+  std::string lower(name);
+  std::transform(lower.begin(), lower.end(), lower.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  auto contains = [&](const char* part) {
+    return lower.find(part) != std::string::npos;
+  };
+
+  // checked first, e.g. Energy-pkg-W or L1d-miss-rate
+  for (auto part : {"cpi", "bound", "bad-spec", "miss", "stall", "latency",
+                    "time", "energy", "contention"})
+    if (contains(part)) return MetricDirection::LOWER_IS_BETTER;
+  if (lower.size() > 2 && lower.compare(lower.size() - 2, 2, "-w") == 0)
+    return MetricDirection::LOWER_IS_BETTER;  // power
+  for (auto part : {"ipc", "flop", "gbps", "bandwidth", "throughput",
+                    "retiring", "hit"})
+    if (contains(part)) return MetricDirection::HIGHER_IS_BETTER;
+  return MetricDirection::UNKNOWN;
+}
+
+KProfMetric::KProfMetric(const std::string& _name,
+                         const std::string& _expression)
+    : name(_name), expression(_expression) {
+  if (name.empty()) Fail("metric has no name");
+
+  pos = 0;
+  depth = 0;
+  ParseExpression();
+  SkipSpaces();
+  if (pos != expression.size()) Fail("unexpected trailing input");
+  if (program.empty()) Fail("empty expression");
+}
+
+void KProfMetric::Fail(const std::string& reason) {
+  std::stringstream errmsg;
+  errmsg << "Invalid metric " << name << " = " << expression << ": " << reason
+         << " (at position " << pos << ")";
+  throw std::runtime_error(errmsg.str());
+}
+
+void KProfMetric::SkipSpaces() {
+  while (pos < expression.size() &&
+         std::isspace(static_cast<unsigned char>(expression[pos])))
+    pos++;
+}
+
+void KProfMetric::Emit(OpCode op, uint32_t index, double constant) {
+  // track the stack depth the program will need so Evaluate() can use a
+  // fixed-size stack
+  switch (op) {
+    case PUSH_COUNTER:
+    case PUSH_CONST:
+      if (++depth > maxStackDepth) Fail("expression nests too deeply");
+      break;
+    case NEG:
+      break;
+    default:
+      depth--;
+      break;
+  }
+  program.push_back({op, index, constant});
+}
+
+// expression := term (('+' | '-') term)*
+void KProfMetric::ParseExpression() {
+  ParseTerm();
+  for (;;) {
+    SkipSpaces();
+    if (pos >= expression.size()) return;
+    char c = expression[pos];
+    if (c != '+' && c != '-') return;
+    pos++;
+    ParseTerm();
+    Emit(c == '+' ? ADD : SUB);
+  }
+}
+
+// term := unary (('*' | '/') unary)*
+void KProfMetric::ParseTerm() {
+  ParseUnary();
+  for (;;) {
+    SkipSpaces();
+    if (pos >= expression.size()) return;
+    char c = expression[pos];
+    if (c != '*' && c != '/') return;
+    pos++;
+    ParseUnary();
+    Emit(c == '*' ? MUL : DIV);
+  }
+}
+
+// unary := '-' unary | primary
+void KProfMetric::ParseUnary() {
+  SkipSpaces();
+  if (pos < expression.size() && expression[pos] == '-') {
+    pos++;
+    ParseUnary();
+    Emit(NEG);
+    return;
+  }
+  ParsePrimary();
+}
+
+// primary := number | label | '(' expression ')'
+void KProfMetric::ParsePrimary() {
+  SkipSpaces();
+  if (pos >= expression.size()) Fail("unexpected end of expression");
+
+  char c = expression[pos];
+  if (c == '(') {
+    pos++;
+    ParseExpression();
+    SkipSpaces();
+    if (pos >= expression.size() || expression[pos] != ')')
+      Fail("missing ')'");
+    pos++;
+    return;
+  }
+
+  if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+    const char* begin = expression.c_str() + pos;
+    char* end = nullptr;
+    double constant = std::strtod(begin, &end);
+    if (end == begin) Fail("invalid number");
+    pos += end - begin;
+    Emit(PUSH_CONST, 0, constant);
+    return;
+  }
+
+  if (IsLabelStart(c)) {
+    size_t start = pos;
+    while (pos < expression.size() && IsLabelChar(expression[pos])) pos++;
+    auto label = expression.substr(start, pos - start);
+
+    auto it = std::find(operands.begin(), operands.end(), label);
+    auto index = static_cast<uint32_t>(it - operands.begin());
+    if (it == operands.end()) operands.push_back(label);
+    Emit(PUSH_COUNTER, index);
+    return;
+  }
+
+  Fail(std::string("unexpected character '") + c + "'");
+}
+
+bool KProfMetric::Bind(const std::vector<std::string>& labels) {
+  // map operand index -> report index once, then patch the program
+  std::vector<uint32_t> slots(operands.size());
+  for (size_t i = 0; i < operands.size(); ++i) {
+    auto it = std::find(labels.begin(), labels.end(), operands[i]);
+    if (it == labels.end()) return false;
+    slots[i] = static_cast<uint32_t>(it - labels.begin());
+  }
+
+  // metrics may be re-bound, so keep the operand indices intact in `program`
+  boundProgram = program;
+  for (auto& instruction : boundProgram)
+    if (instruction.op == PUSH_COUNTER)
+      instruction.index = slots[instruction.index];
+  return true;
+}
+
+double KProfMetric::Evaluate(const double* values) const {
+  double stack[maxStackDepth];
+  size_t top = 0;
+
+  for (const auto& instruction : boundProgram) {
+    switch (instruction.op) {
+      case PUSH_COUNTER:
+        stack[top++] = values[instruction.index];
+        break;
+      case PUSH_CONST:
+        stack[top++] = instruction.constant;
+        break;
+      case NEG:
+        stack[top - 1] = -stack[top - 1];
+        break;
+      case ADD:
+        top--;
+        stack[top - 1] += stack[top];
+        break;
+      case SUB:
+        top--;
+        stack[top - 1] -= stack[top];
+        break;
+      case MUL:
+        top--;
+        stack[top - 1] *= stack[top];
+        break;
+      case DIV:
+        top--;
+        stack[top - 1] = (stack[top] == 0.0)
+                             ? std::numeric_limits<double>::quiet_NaN()
+                             : stack[top - 1] / stack[top];
+        break;
+    }
+  }
+  return (top == 1) ? stack[0] : std::numeric_limits<double>::quiet_NaN();
+}
+
+std::vector<std::vector<std::string>> PlanCoScheduling(
+    const std::vector<KProfMetric>& metrics,
+    const std::vector<std::string>& available) {
+  // union of operand sets which share a counter, i.e. connected components
+  std::vector<std::vector<std::string>> sets;
+
+  for (const auto& metric : metrics) {
+    std::vector<std::string> current;
+    for (const auto& label : metric.GetOperands())
+      if (std::find(available.begin(), available.end(), label) !=
+          available.end())
+        current.push_back(label);
+    if (current.size() < 2) continue;  // nothing to keep together
+
+    // merge every existing set that overlaps with this one
+    for (size_t i = 0; i < sets.size();) {
+      bool overlaps = false;
+      for (const auto& label : sets[i])
+        if (std::find(current.begin(), current.end(), label) !=
+            current.end()) {
+          overlaps = true;
+          break;
+        }
+
+      if (!overlaps) {
+        ++i;
+        continue;
+      }
+      for (const auto& label : sets[i])
+        if (std::find(current.begin(), current.end(), label) == current.end())
+          current.push_back(label);
+      sets.erase(sets.begin() + i);
+    }
+    sets.push_back(current);
+  }
+
+  // keep the order in which counters were declared
+  for (auto& set : sets)
+    std::stable_sort(set.begin(), set.end(),
+                     [&](const std::string& a, const std::string& b) {
+                       return std::find(available.begin(), available.end(),
+                                        a) <
+                              std::find(available.begin(), available.end(), b);
+                     });
+  return sets;
+}
+
+};  // namespace KProf
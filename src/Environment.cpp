@@ -0,0 +1,161 @@
+#include "Environment.hpp"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "HostInfo.hpp"
+
+namespace KProf {
+
+KProfEnvironmentGuard::KProfEnvironmentGuard(const EnvironmentOptions& _options)
+    : options(_options) {
+  report.cpu = (options.cpu >= 0) ? options.cpu : sched_getcpu();
+
+  if (options.pin && report.cpu >= 0) {
+    restoreMask = sched_getaffinity(0, sizeof(previousMask), &previousMask) == 0;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(report.cpu, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) == 0) {
+      report.pinned = true;
+    } else {
+      report.warnings.push_back("could not pin to CPU " +
+                                std::to_string(report.cpu) + ": " +
+                                strerror(errno));
+      restoreMask = false;
+    }
+  } else if (options.pin) {
+    report.warnings.push_back("could not determine the current CPU");
+  }
+
+  if (options.lockMemory) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+      report.memoryLocked = true;
+    } else {
+      report.warnings.push_back(std::string("mlockall failed: ") +
+                                strerror(errno) + " (check RLIMIT_MEMLOCK)");
+    }
+  }
+
+  const std::string root = "/sys/devices/system/cpu/";
+  if (report.cpu >= 0) {
+    auto dir = root + "cpu" + std::to_string(report.cpu) + "/";
+    report.governor = ReadSysfs(dir + "cpufreq/scaling_governor");
+
+    for (auto cpu :
+         ParseCpuList(ReadSysfs(dir + "topology/thread_siblings_list")))
+      if (cpu != report.cpu) report.siblings.push_back(cpu);
+  }
+
+  // intel_pstate inverts the knob, acpi-cpufreq and amd-pstate do not
+  auto noTurbo = ReadSysfsInt(root + "intel_pstate/no_turbo");
+  if (noTurbo >= 0)
+    report.turbo = !noTurbo;
+  else
+    report.turbo = ReadSysfsInt(root + "cpufreq/boost");
+
+  ReadCpuTimes(busyStart, totalStart);
+}
+
+KProfEnvironmentGuard::~KProfEnvironmentGuard() {
+  if (report.memoryLocked) munlockall();
+  if (restoreMask) sched_setaffinity(0, sizeof(previousMask), &previousMask);
+}
+
+void KProfEnvironmentGuard::ReadCpuTimes(std::vector<uint64_t>& busy,
+                                         std::vector<uint64_t>& total) {
+  busy.assign(report.siblings.size(), 0);
+  total.assign(report.siblings.size(), 0);
+
+  // cpuN user nice system idle iowait irq softirq steal guest guest_nice
+  std::ifstream stat("/proc/stat");
+  std::string line;
+  while (std::getline(stat, line)) {
+    if (line.compare(0, 3, "cpu") != 0 || line.size() < 4 ||
+        !isdigit(line[3]))
+      continue;
+
+    std::stringstream ss(line.substr(3));
+    int cpu;
+    ss >> cpu;
+    auto it = std::find(report.siblings.begin(), report.siblings.end(), cpu);
+    if (it == report.siblings.end()) continue;
+    auto idx = it - report.siblings.begin();
+
+    // guest time is already included in user time
+    uint64_t field, sum = 0, idle = 0;
+    for (int i = 0; i < 8 && ss >> field; ++i) {
+      sum += field;
+      if (i == 3 || i == 4) idle += field;
+    }
+    busy[idx] = sum - idle;
+    total[idx] = sum;
+  }
+}
+
+void KProfEnvironmentGuard::Prefault(void* buffer, size_t size) {
+  auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  auto bytes = static_cast<volatile char*>(buffer);
+  for (size_t offset = 0; offset < size; offset += pageSize)
+    bytes[offset] = bytes[offset];
+  if (size) bytes[size - 1] = bytes[size - 1];
+  report.prefaultedBytes += size;
+}
+
+EnvironmentReport KProfEnvironmentGuard::Report() {
+  EnvironmentReport res = report;
+
+  std::vector<uint64_t> busy, total;
+  ReadCpuTimes(busy, total);
+  uint64_t busySum = 0, totalSum = 0;
+  for (size_t i = 0; i < busy.size(); ++i) {
+    busySum += busy[i] - busyStart[i];
+    totalSum += total[i] - totalStart[i];
+  }
+  if (totalSum) res.siblingLoad = static_cast<double>(busySum) / totalSum;
+
+  if (!res.governor.empty() && res.governor != "performance")
+    res.warnings.push_back("CPU " + std::to_string(res.cpu) +
+                           " uses the '" + res.governor +
+                           "' governor, not 'performance'");
+  if (res.turbo == 1)
+    res.warnings.push_back(
+        "turbo/boost is enabled, the core clock depends on load and "
+        "temperature");
+  if (res.siblingLoad > options.siblingLoadLimit) {
+    std::stringstream msg;
+    msg << "SMT siblings of CPU " << res.cpu << " were " << std::fixed
+        << std::setprecision(1) << 100.0 * res.siblingLoad << "% busy";
+    res.warnings.push_back(msg.str());
+  }
+  return res;
+}
+
+void KProfEnvironmentGuard::PrintReport(const EnvironmentReport& report) {
+  std::cout << "Environment: CPU " << report.cpu
+            << (report.pinned ? " (pinned)" : " (not pinned)") << ", governor "
+            << (report.governor.empty() ? "unknown" : report.governor)
+            << ", turbo "
+            << (report.turbo < 0 ? "unknown" : (report.turbo ? "on" : "off"));
+  if (report.siblingLoad >= 0.0)
+    std::cout << ", SMT sibling load " << std::fixed << std::setprecision(1)
+              << 100.0 * report.siblingLoad << "%" << std::defaultfloat;
+  if (report.memoryLocked) std::cout << ", memory locked";
+  if (report.prefaultedBytes)
+    std::cout << ", " << report.prefaultedBytes << " bytes prefaulted";
+  std::cout << std::endl;
+
+  for (auto& warning : report.warnings)
+    std::cerr << "Warning: " << warning
+              << ". Results may not be reproducible." << std::endl;
+}
+
+};  // namespace KProf
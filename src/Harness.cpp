@@ -0,0 +1,228 @@
+#include "Harness.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+namespace KProf {
+
+double HarnessResult::CleanMedian(const std::string& entry) const {
+  std::vector<double> values;
+  for (int clean = 1; clean >= 0 && values.empty(); --clean)
+    for (auto& sample : samples) {
+      if (clean && sample.contaminated) continue;
+      for (auto counter : sample.report)
+        // signed, corrected counts may go below zero
+        if (counter.GetName() == entry) values.push_back(counter.GetValue());
+    }
+  if (values.empty()) return NAN;
+  auto mid = values.begin() + values.size() / 2;
+  std::nth_element(values.begin(), mid, values.end());
+  return *mid;
+}
+
+HarnessResult KProfHarness::Run(const std::string& label, KProfEvent& monitor,
+                                const Kernel& kernel) {
+  HarnessResult result;
+  result.label = label;
+  result.samples.reserve(options.repetitions);
+
+  std::unique_ptr<KProfEnvironmentGuard> guard;
+  if (options.guardEnvironment) {
+    guard = std::make_unique<KProfEnvironmentGuard>(options.environment);
+    for (auto& buffer : AllBuffers())
+      guard->Prefault(buffer.first, buffer.second);
+    if (options.environment.trackFrequency) monitor.TrackFrequency();
+  }
+
+  result.cacheState = options.cacheState;
+  result.flushMethod = options.flushMethod;
+
+  // arena buffers appear during the first kernel call, so the fallbacks are
+  // decided after it, be it a warmup or a measured call
+  bool checkedBuffers = false;
+  auto checkBuffers = [&] {
+    if (checkedBuffers) return;
+    checkedBuffers = true;
+    bool flushes = options.cacheState == CacheState::COLD ||
+                   options.cacheState == CacheState::PARTIAL;
+    bool noBuffers = buffers.empty() && arena.GetBuffers().empty();
+    if (flushes && result.flushMethod == FlushMethod::CLFLUSH && noBuffers) {
+      std::cerr << "No buffers registered to flush. Sweeping the last level "
+                   "cache instead."
+                << std::endl;
+      result.flushMethod = FlushMethod::SWEEP;
+    }
+    if (options.cacheState == CacheState::WARM && noBuffers)
+      std::cerr << "No buffers registered to warm up. The cache state is "
+                   "left as-is."
+                << std::endl;
+  };
+
+  for (size_t i = 0; i < options.warmup; ++i) {
+    PrepareCache(result);
+    kernel(monitor);
+    checkBuffers();
+  }
+
+  for (size_t i = 0; i < options.repetitions; ++i) {
+    for (size_t attempt = 0;; ++attempt) {
+      auto preparationTime = PrepareCache(result);
+      kernel(monitor);
+      checkBuffers();
+      auto run = result.runs++;
+
+      // read before GetReport(), whose overhead run restarts the counters
+      auto disturbances = monitor.GetDisturbances();
+      bool contaminated = monitor.IsContaminated();
+      if (contaminated) result.contaminated++;
+
+      if (contaminated && options.contamination == Contamination::RERUN &&
+          attempt < options.maxReruns) {
+        result.reruns++;
+        continue;
+      }
+      if (contaminated && options.contamination == Contamination::DISCARD) {
+        result.discarded++;
+        break;
+      }
+
+      Sample sample;
+      sample.report = monitor.GetReport(options.overheadCorrection);
+      sample.disturbances = disturbances;
+      sample.contaminated =
+          contaminated && options.contamination != Contamination::KEEP;
+      sample.preparationTime = preparationTime;
+      sample.run = run;
+      result.samples.push_back(std::move(sample));
+      break;
+    }
+
+    if (options.progress)
+      std::cout << "Completed " << i + 1 << "/" << options.repetitions
+                << " iterations. \r" << std::flush;
+  }
+  if (options.progress) std::cout << std::endl;
+
+  if (guard) {
+    result.guarded = true;
+    result.environment = guard->Report();
+    CheckFrequency(result);
+  }
+  return result;
+}
+
+std::vector<std::pair<void*, size_t>> KProfHarness::AllBuffers() {
+  auto all = buffers;
+  for (auto& buffer : arena.GetBuffers())
+    all.push_back({buffer.data, buffer.size});
+  return all;
+}
+
+uint64_t KProfHarness::PrepareCache(HarnessResult& result) {
+  if (options.cacheState == CacheState::ASIS) return 0;
+  auto start = std::chrono::steady_clock::now();
+  auto targets = AllBuffers();
+
+  if (options.cacheState != CacheState::WARM) {
+    if (result.flushMethod == FlushMethod::CLFLUSH) {
+      for (auto& buffer : targets)
+        if (!FlushBuffer(buffer.first, buffer.second)) {
+          std::cerr << "Cache line flushes are not supported on this "
+                       "architecture. Sweeping the last level cache instead."
+                    << std::endl;
+          result.flushMethod = FlushMethod::SWEEP;
+          break;
+        }
+    }
+    if (result.flushMethod == FlushMethod::SWEEP) {
+      if (!sweeper) sweeper = std::make_unique<CacheSweeper>(options.sweepSize);
+      sweeper->Sweep();
+    }
+  }
+
+  if (options.cacheState == CacheState::WARM) {
+    for (auto& buffer : targets) TouchBuffer(buffer.first, buffer.second);
+  } else if (options.cacheState == CacheState::PARTIAL) {
+    for (auto& buffer : targets)
+      TouchBuffer(buffer.first, buffer.second * options.residentFraction);
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  result.preparationTime += elapsed;
+  result.preparations++;
+  return elapsed;
+}
+
+void KProfHarness::CheckFrequency(HarnessResult& result) {
+  std::vector<double> ratios(result.samples.size(), std::nan(""));
+  for (size_t i = 0; i < result.samples.size(); ++i)
+    for (auto& counter : result.samples[i].report)
+      if (counter.GetName() == "Frequency-ratio") ratios[i] = counter.GetValue();
+
+  std::vector<double> valid;
+  for (auto ratio : ratios)
+    if (!std::isnan(ratio)) valid.push_back(ratio);
+  if (valid.empty()) return;
+
+  auto mid = valid.begin() + valid.size() / 2;
+  std::nth_element(valid.begin(), mid, valid.end());
+  auto median = *mid;
+  if (median <= 0.0) return;
+
+  for (size_t i = 0; i < ratios.size(); ++i) {
+    if (std::isnan(ratios[i])) continue;
+    if (std::abs(ratios[i] / median - 1.0) >
+        options.environment.frequencyDrift) {
+      result.samples[i].frequencyDrift = true;
+      result.drifted++;
+    }
+  }
+
+  if (result.drifted) {
+    std::stringstream msg;
+    msg << result.drifted << " of " << result.samples.size()
+        << " samples ran at a clock more than " << std::fixed
+        << std::setprecision(1) << 100.0 * options.environment.frequencyDrift
+        << "% away from the median";
+    result.environment.warnings.push_back(msg.str());
+  }
+}
+
+void KProfHarness::PrintSummary(const HarnessResult& result) {
+  size_t flagged = 0;
+  for (auto& sample : result.samples)
+    if (sample.contaminated) flagged++;
+
+  std::cout << result.label << ": " << result.samples.size() << " samples, "
+            << result.runs << " runs, " << std::fixed << std::setprecision(2)
+            << 100.0 * result.ContaminationRate() << std::defaultfloat
+            << "% contaminated (" << result.reruns << " re-run, "
+            << result.discarded << " discarded, " << flagged << " flagged)"
+            << std::endl;
+
+  if (result.cacheState != CacheState::ASIS) {
+    std::cout << "Cache: " << CacheStateName(result.cacheState);
+    if (result.cacheState != CacheState::WARM)
+      std::cout << " ("
+                << (result.flushMethod == FlushMethod::CLFLUSH ? "clflush"
+                                                               : "sweep")
+                << ")";
+    if (result.preparations)
+      std::cout << ", preparation " << std::fixed << std::setprecision(1)
+                << result.preparationTime / 1e3 / result.preparations
+                << std::defaultfloat << " us per run";
+    std::cout << std::endl;
+  }
+
+  if (result.guarded)
+    KProfEnvironmentGuard::PrintReport(result.environment);
+}
+
+};  // namespace KProf
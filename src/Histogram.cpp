@@ -0,0 +1,162 @@
+#include "Histogram.hpp"
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+
+namespace KProf {
+
+uint64_t LogLinearHistogram::LowerBound(size_t bucket) {
+  if (bucket < kSubBuckets) return bucket;
+  auto exponent = (bucket >> kSubBits) + kSubBits - 1;
+  return static_cast<uint64_t>(kSubBuckets | (bucket & (kSubBuckets - 1)))
+         << (exponent - kSubBits);
+}
+
+uint64_t LogLinearHistogram::Width(size_t bucket) {
+  if (bucket < kSubBuckets) return 1;
+  return uint64_t(1) << ((bucket >> kSubBits) - 1);
+}
+
+void LogLinearHistogram::Merge(const LogLinearHistogram& other) {
+  for (size_t i = 0; i < kBuckets; ++i) buckets[i] += other.buckets[i];
+  count += other.count;
+}
+
+inline double Midpoint(size_t bucket) {
+  return LogLinearHistogram::LowerBound(bucket) +
+         (LogLinearHistogram::Width(bucket) - 1) / 2.0;
+}
+
+double LogLinearHistogram::Percentile(double percentile) const {
+  if (count == 0) return NAN;
+  // rank of the value, counted from 1
+  auto rank = static_cast<uint64_t>(std::ceil(percentile / 100.0 * count));
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) return Midpoint(i);
+  }
+  return NAN;
+}
+
+double LogLinearHistogram::Mean() const {
+  if (count == 0) return NAN;
+  double sum = 0.0;
+  for (size_t i = 0; i < kBuckets; ++i)
+    if (buckets[i]) sum += buckets[i] * Midpoint(i);
+  return sum / count;
+}
+
+// histograms of this thread, indexed by the id of the distribution
+thread_local std::vector<void*> threadHistograms;
+std::atomic<uint64_t> nextDistributionId = 0;
+
+KProfDistribution::KProfDistribution(const std::string& _name)
+    : name(_name), id(nextDistributionId++) {}
+
+KProfDistribution::~KProfDistribution() = default;
+
+KProfDistribution::ThreadHistograms& KProfDistribution::GetThreadHistograms(
+    KProfEvent& monitor) {
+  if (id < threadHistograms.size() && threadHistograms[id])
+    return *static_cast<ThreadHistograms*>(threadHistograms[id]);
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (columns.empty()) {
+    columns = monitor.GetCounterNames();
+    if (columns.size() > kDistributionValues)
+      columns.resize(kDistributionValues);
+    columns.push_back("Wall-time (ns)");
+  }
+
+  auto created = std::make_unique<ThreadHistograms>();
+  created->columns = columns.size();
+  created->buckets = std::make_unique<std::atomic<uint64_t>[]>(
+      columns.size() * LogLinearHistogram::kBuckets);
+  auto histograms = created.get();
+  threads.push_back(std::move(created));
+
+  if (threadHistograms.size() <= id) threadHistograms.resize(id + 1, nullptr);
+  threadHistograms[id] = histograms;
+  return *histograms;
+}
+
+void KProfDistribution::Record(KProfEvent& monitor) {
+  auto& histograms = GetThreadHistograms(monitor);
+  uint64_t values[kDistributionValues + 1];
+  auto numCounts = monitor.ReadCounts(
+      values, std::min(histograms.columns - 1, kDistributionValues));
+  auto wallTime = histograms.columns - 1;
+  values[wallTime] = monitor.GetDuration();
+
+  for (size_t i = 0; i < histograms.columns; ++i) {
+    if (i >= numCounts && i != wallTime) continue;
+    // only this thread writes, so a plain increment suffices; the atomic
+    // keeps concurrent readers well defined
+    auto& bucket =
+        histograms.buckets[i * LogLinearHistogram::kBuckets +
+                           LogLinearHistogram::BucketOf(values[i])];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  }
+}
+
+std::vector<std::string> KProfDistribution::GetColumns() {
+  std::lock_guard<std::mutex> guard(lock);
+  return columns;
+}
+
+LogLinearHistogram KProfDistribution::GetHistogram(size_t column) {
+  LogLinearHistogram merged;
+  std::lock_guard<std::mutex> guard(lock);
+  if (column >= columns.size()) return merged;
+  for (auto& thread : threads)
+    for (size_t b = 0; b < LogLinearHistogram::kBuckets; ++b) {
+      auto count =
+          thread->buckets[column * LogLinearHistogram::kBuckets + b].load(
+              std::memory_order_relaxed);
+      if (count) merged.Add(LogLinearHistogram::LowerBound(b), count);
+    }
+  return merged;
+}
+
+std::vector<DistributionSummary> KProfDistribution::GetReport() {
+  std::vector<DistributionSummary> report;
+  auto names = GetColumns();
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto histogram = GetHistogram(i);
+    DistributionSummary summary;
+    summary.name = names[i];
+    summary.count = histogram.GetCount();
+    summary.mean = histogram.Mean();
+    summary.p50 = histogram.Percentile(50.0);
+    summary.p90 = histogram.Percentile(90.0);
+    summary.p99 = histogram.Percentile(99.0);
+    summary.p999 = histogram.Percentile(99.9);
+    summary.max = histogram.Percentile(100.0);
+    report.push_back(summary);
+  }
+  return report;
+}
+
+void KProfDistribution::PrintReport() {
+  auto report = GetReport();
+  if (report.empty()) return;
+  std::cout << (name.empty() ? "Distribution" : name) << ": "
+            << report.front().count << " calls" << std::endl;
+  std::cout << std::left << std::setw(24) << "Counter" << std::right
+            << std::setw(12) << "mean" << std::setw(12) << "p50"
+            << std::setw(12) << "p90" << std::setw(12) << "p99"
+            << std::setw(12) << "p99.9" << std::setw(12) << "max"
+            << std::endl;
+  for (auto& summary : report)
+    std::cout << std::left << std::setw(24) << summary.name << std::right
+              << std::setprecision(6) << std::setw(12) << summary.mean
+              << std::setw(12) << summary.p50 << std::setw(12) << summary.p90
+              << std::setw(12) << summary.p99 << std::setw(12)
+              << summary.p999 << std::setw(12) << summary.max << std::endl;
+}
+
+};  // namespace KProf
@@ -0,0 +1,222 @@
+#include "HostInfo.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace KProf {
+
+#if defined(__x86_64__) || defined(__i386__)
+void ReadCPUID(HostInfo& info) {
+  unsigned int eax, ebx, ecx, edx;
+
+  // vendor string is spread over ebx, edx, ecx in that order
+  __cpuid(0, eax, ebx, ecx, edx);
+  auto maxLeaf = eax;
+  char vendor[13];
+  memcpy(vendor, &ebx, 4);
+  memcpy(vendor + 4, &edx, 4);
+  memcpy(vendor + 8, &ecx, 4);
+  vendor[12] = '\0';
+  info.vendor = vendor;
+
+  __cpuid(1, eax, ebx, ecx, edx);
+  auto baseFamily = (eax >> 8) & 0xF;
+  auto baseModel = (eax >> 4) & 0xF;
+  info.stepping = eax & 0xF;
+  info.family = baseFamily;
+  if (baseFamily == 0xF) info.family += (eax >> 20) & 0xFF;
+  info.model = baseModel;
+  if (baseFamily == 0x6 || baseFamily == 0xF)
+    info.model |= ((eax >> 16) & 0xF) << 4;
+
+  // leaf 7, edx bit 15 marks Intel hybrid parts
+  if (maxLeaf >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    info.hybrid = info.IsIntel() && ((edx >> 15) & 1);
+  }
+
+  __cpuid(0x80000000, eax, ebx, ecx, edx);
+  if (eax >= 0x80000004) {
+    char brand[49];
+    for (unsigned int leaf = 0; leaf < 3; ++leaf) {
+      __cpuid(0x80000002 + leaf, eax, ebx, ecx, edx);
+      memcpy(brand + leaf * 16, &eax, 4);
+      memcpy(brand + leaf * 16 + 4, &ebx, 4);
+      memcpy(brand + leaf * 16 + 8, &ecx, 4);
+      memcpy(brand + leaf * 16 + 12, &edx, 4);
+    }
+    brand[48] = '\0';
+    info.modelName = brand;
+    // brand strings are padded with spaces on some parts
+    auto first = info.modelName.find_first_not_of(' ');
+    auto last = info.modelName.find_last_not_of(' ');
+    if (first != std::string::npos)
+      info.modelName = info.modelName.substr(first, last - first + 1);
+  }
+}
+#endif
+
+void ReadProcCpuinfo(HostInfo& info) {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    // only the first processor block is of interest
+    if (line.empty()) break;
+
+    auto colonpos = line.find(':');
+    if (colonpos == std::string::npos) continue;
+    auto key = line.substr(0, line.find_last_not_of(" \t", colonpos - 1) + 1);
+    auto value = (colonpos + 2 <= line.size()) ? line.substr(colonpos + 2)
+                                               : std::string("");
+
+    try {
+      if (key == "vendor_id" || key == "CPU implementer")
+        info.vendor = value;
+      else if (key == "model name" || key == "Model")
+        info.modelName = value;
+      else if (key == "cpu family" || key == "CPU architecture")
+        info.family = std::stoul(value, nullptr, 0);
+      else if (key == "model" || key == "CPU part")
+        info.model = std::stoul(value, nullptr, 0);
+      else if (key == "stepping" || key == "CPU revision")
+        info.stepping = std::stoul(value, nullptr, 0);
+    } catch (std::exception&) {
+      // leave unparsable fields at their defaults
+    }
+  }
+}
+
+const HostInfo& GetHostInfo() {
+  static const HostInfo info = [] {
+    HostInfo res;
+#if defined(__x86_64__) || defined(__i386__)
+    ReadCPUID(res);
+#else
+    ReadProcCpuinfo(res);
+#endif
+    char hostname[256] = {0};
+    if (gethostname(hostname, sizeof(hostname) - 1) == 0)
+      res.hostname = hostname;
+    return res;
+  }();
+  return info;
+}
+
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    try {
+      auto dashpos = range.find('-');
+      int lo = std::stoi(range.substr(0, dashpos));
+      int hi =
+          (dashpos == std::string::npos) ? lo : std::stoi(range.substr(dashpos + 1));
+      for (int cpu = lo; cpu <= hi; ++cpu) cpus.push_back(cpu);
+    } catch (std::exception&) {
+      // trailing newline or empty list
+    }
+  }
+  return cpus;
+}
+
+std::string ReadSysfs(const std::string& path) {
+  std::ifstream file(path);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+int ReadSysfsInt(const std::string& path) {
+  try {
+    return std::stoi(ReadSysfs(path));
+  } catch (std::exception&) {
+    return -1;
+  }
+}
+
+std::vector<CpuTopology> GetTopology() {
+  std::vector<CpuTopology> topology;
+  const std::string root = "/sys/devices/system/cpu/";
+
+  for (auto cpu : ParseCpuList(ReadSysfs(root + "online"))) {
+    CpuTopology entry;
+    entry.cpu = cpu;
+    auto dir = root + "cpu" + std::to_string(cpu) + "/";
+    entry.core = ReadSysfsInt(dir + "topology/core_id");
+    entry.package = ReadSysfsInt(dir + "topology/physical_package_id");
+    entry.siblings = ParseCpuList(ReadSysfs(dir + "topology/thread_siblings_list"));
+    if (entry.siblings.empty()) entry.siblings.push_back(cpu);
+
+    // caches are sorted by level, the last one is the LLC
+    for (auto& cache : GetCaches(cpu))
+      if (!cache.sharedWith.empty()) entry.llc = cache.sharedWith.front();
+    if (entry.llc == -1) entry.llc = (entry.package == -1) ? 0 : entry.package;
+
+    topology.push_back(entry);
+  }
+  return topology;
+}
+
+std::vector<CacheInfo> GetCaches(int cpu) {
+  std::vector<CacheInfo> caches;
+  auto dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cache/";
+
+  for (int index = 0;
+       std::filesystem::exists(dir + "index" + std::to_string(index));
+       ++index) {
+    auto cacheDir = dir + "index" + std::to_string(index) + "/";
+    CacheInfo cache;
+    cache.level = ReadSysfsInt(cacheDir + "level");
+    cache.type = ReadSysfs(cacheDir + "type");
+    cache.sharedWith = ParseCpuList(ReadSysfs(cacheDir + "shared_cpu_list"));
+    auto lineSize = ReadSysfsInt(cacheDir + "coherency_line_size");
+    if (lineSize > 0) cache.lineSize = lineSize;
+
+    // sizes are given as e.g. 48K or 32M
+    auto size = ReadSysfs(cacheDir + "size");
+    try {
+      size_t suffix;
+      cache.size = std::stoull(size, &suffix);
+      if (suffix < size.size()) {
+        if (size[suffix] == 'K') cache.size <<= 10;
+        if (size[suffix] == 'M') cache.size <<= 20;
+        if (size[suffix] == 'G') cache.size <<= 30;
+      }
+    } catch (std::exception&) {
+      continue;
+    }
+    caches.push_back(cache);
+  }
+
+  std::stable_sort(caches.begin(), caches.end(),
+                   [](auto& a, auto& b) { return a.level < b.level; });
+  return caches;
+}
+
+size_t LastLevelCacheSize(int cpu) {
+  auto caches = GetCaches(cpu);
+  for (auto it = caches.rbegin(); it != caches.rend(); ++it)
+    if (it->type != "Instruction") return it->size;
+  return 0;
+}
+
+std::string CacheDirectory() {
+  if (auto xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+    return std::string(xdg) + "/kprof";
+  if (auto home = std::getenv("HOME"); home && *home)
+    return std::string(home) + "/.cache/kprof";
+  return "/tmp/kprof";
+}
+
+};  // namespace KProf
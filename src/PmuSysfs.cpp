@@ -0,0 +1,134 @@
+#include "PmuSysfs.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "HostInfo.hpp"
+
+namespace KProf {
+
+const std::string pmuRoot = "/sys/bus/event_source/devices/";
+
+inline bool ReadFirstLine(const std::string& path, std::string& line) {
+  std::ifstream file(path);
+  if (!file.is_open()) return false;
+  return static_cast<bool>(std::getline(file, line));
+}
+
+int PmuType(const std::string& pmu) {
+  std::string line;
+  if (!ReadFirstLine(pmuRoot + pmu + "/type", line)) return -1;
+  try {
+    return std::stoi(line);
+  } catch (std::exception&) {
+    return -1;
+  }
+}
+
+bool PmuHasEvent(const std::string& pmu, const std::string& event) {
+  std::ifstream file(pmuRoot + pmu + "/events/" + event);
+  return file.is_open();
+}
+
+// Places `value` into the bit ranges of a format spec like "config:0-7,32-35",
+// lowest bits of the value going into the first range.
+bool ApplyFormat(const std::string& format, uint64_t value, uint64_t& config) {
+  auto colonpos = format.find(':');
+  if (colonpos == std::string::npos) return false;
+  if (format.substr(0, colonpos) != "config") return false;
+
+  std::stringstream ss(format.substr(colonpos + 1));
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    unsigned lo, hi;
+    auto dashpos = range.find('-');
+    try {
+      lo = std::stoul(range.substr(0, dashpos));
+      hi = (dashpos == std::string::npos) ? lo
+                                          : std::stoul(range.substr(dashpos + 1));
+    } catch (std::exception&) {
+      return false;
+    }
+    for (auto bit = lo; bit <= hi && bit < 64; ++bit) {
+      config |= (value & 1) << bit;
+      value >>= 1;
+    }
+  }
+  return true;
+}
+
+bool PmuEncodeTerms(const std::string& pmu, const std::string& terms,
+                    uint64_t& config) {
+  config = 0;
+  std::stringstream ss(terms);
+  std::string term;
+  while (std::getline(ss, term, ',')) {
+    // strip whitespace and the trailing newline of sysfs files
+    auto first = term.find_first_not_of(" \t\n");
+    if (first == std::string::npos) continue;
+    term = term.substr(first, term.find_last_not_of(" \t\n") - first + 1);
+
+    // bare flags like "edge" mean "edge=1"
+    auto eqpos = term.find('=');
+    auto key = term.substr(0, eqpos);
+    uint64_t value = 1;
+    if (eqpos != std::string::npos) {
+      try {
+        value = std::stoull(term.substr(eqpos + 1), nullptr, 0);
+      } catch (std::exception&) {
+        return false;
+      }
+    }
+
+    std::string format;
+    if (!ReadFirstLine(pmuRoot + pmu + "/format/" + key, format)) {
+      // perf tool-only terms which do not end up in the config
+      if (key == "period" || key == "name") continue;
+      return false;
+    }
+    if (!ApplyFormat(format, value, config)) return false;
+  }
+  return true;
+}
+
+bool PmuEventConfig(const std::string& pmu, const std::string& event,
+                    uint64_t& config) {
+  std::string terms;
+  if (!ReadFirstLine(pmuRoot + pmu + "/events/" + event, terms)) return false;
+  return PmuEncodeTerms(pmu, terms, config);
+}
+
+std::vector<std::string> FindPmus(const std::string& prefix) {
+  std::vector<std::string> pmus;
+  std::error_code error;
+  for (auto& entry : std::filesystem::directory_iterator(pmuRoot, error)) {
+    auto name = entry.path().filename().string();
+    if (name.compare(0, prefix.size(), prefix) == 0) pmus.push_back(name);
+  }
+  std::sort(pmus.begin(), pmus.end());
+  return pmus;
+}
+
+std::vector<int> PmuCpumask(const std::string& pmu) {
+  return ParseCpuList(ReadSysfs(pmuRoot + pmu + "/cpumask"));
+}
+
+bool PmuEventScale(const std::string& pmu, const std::string& event,
+                   double& scale, std::string& unit) {
+  std::string line;
+  if (!ReadFirstLine(pmuRoot + pmu + "/events/" + event + ".scale", line))
+    return false;
+  try {
+    scale = std::stod(line);
+  } catch (std::exception&) {
+    return false;
+  }
+  if (!ReadFirstLine(pmuRoot + pmu + "/events/" + event + ".unit", unit))
+    unit.clear();
+  return true;
+}
+
+};  // namespace KProf
@@ -0,0 +1,599 @@
+#include "ResultStore.hpp"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include "HostInfo.hpp"
+
+namespace KProf {
+
+namespace fs = std::filesystem;
+
+constexpr size_t kStoreHeaderSize = 16;  // magic, version, padding
+
+inline std::string FileHeader(const char (&magic)[8]) {
+  std::string header(magic, sizeof(magic));
+  header.append(reinterpret_cast<const char*>(&kStoreVersion),
+                sizeof(kStoreVersion));
+  header.append(4, '\0');
+  return header;
+}
+
+inline size_t PadTo8(size_t bytes) { return (bytes + 7) / 8 * 8; }
+
+inline int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// appends `data` at the end of `filename`, creating it with `header` first
+inline uint64_t AppendToFile(const std::string& filename,
+                             const std::string& header, const void* data,
+                             size_t bytes) {
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd == -1) throw std::runtime_error("Error opening file: " + filename);
+  struct stat info;
+  fstat(fd, &info);
+  uint64_t offset = info.st_size;
+  bool ok = true;
+  if (offset == 0 && !header.empty()) {
+    ok = write(fd, header.data(), header.size()) == (ssize_t)header.size();
+    offset = header.size();
+  }
+  ok = ok && write(fd, data, bytes) == (ssize_t)bytes;
+  close(fd);
+  if (!ok) throw std::runtime_error("Could not write to " + filename);
+  return offset;
+}
+
+// Held while appending, so that concurrent writers do not interleave
+class StoreLock {
+ public:
+  StoreLock(const std::string& directory) {
+    fd = open((directory + "/store.lock").c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd != -1) flock(fd, LOCK_EX);
+  }
+  ~StoreLock() {
+    if (fd != -1) close(fd);  // releases the lock
+  }
+
+ private:
+  int fd = -1;
+};
+
+inline std::string ReadFirstLine(const fs::path& path) {
+  std::ifstream file(path);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+// HEAD of the git checkout containing the working directory, read from the
+// .git directory as git itself may not be installed
+std::string GitRevision() {
+  std::error_code error;
+  for (auto dir = fs::current_path(error); !dir.empty();
+       dir = dir.parent_path()) {
+    auto gitDir = dir / ".git";
+    if (fs::is_regular_file(gitDir)) {
+      // a worktree or submodule: "gitdir: <path>"
+      auto line = ReadFirstLine(gitDir);
+      if (line.rfind("gitdir: ", 0) != 0) return "";
+      gitDir = fs::path(line.substr(8));
+      if (gitDir.is_relative()) gitDir = dir / gitDir;
+    }
+    if (fs::is_directory(gitDir)) {
+      auto head = ReadFirstLine(gitDir / "HEAD");
+      if (head.rfind("ref: ", 0) != 0) return head;  // detached
+      auto ref = head.substr(5);
+
+      std::vector<fs::path> dirs = {gitDir};
+      auto common = ReadFirstLine(gitDir / "commondir");
+      if (!common.empty()) dirs.push_back(gitDir / common);
+      for (auto& d : dirs) {
+        auto sha = ReadFirstLine(d / ref);
+        if (!sha.empty()) return sha;
+        std::ifstream packed(d / "packed-refs");
+        std::string line;
+        while (std::getline(packed, line))
+          if (line.size() > 41 && line.compare(41, std::string::npos, ref) == 0)
+            return line.substr(0, 40);
+      }
+      return "";
+    }
+    if (dir == dir.root_path()) break;
+  }
+  return "";
+}
+
+int64_t ParseStoreTime(const std::string& text) {
+  const std::pair<char, int64_t> units[] = {
+      {'m', 60}, {'h', 3600}, {'d', 86400}, {'w', 7 * 86400}};
+  if (!text.empty())
+    for (auto [unit, seconds] : units)
+      if (text.back() == unit &&
+          text.find_first_not_of("0123456789") == text.size() - 1 &&
+          text.size() > 1)
+        return Now() -
+               std::stoll(text.substr(0, text.size() - 1)) * seconds *
+                   1000000000LL;
+
+  struct tm parsed = {};
+  for (auto format : {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%d"}) {
+    memset(&parsed, 0, sizeof(parsed));
+    auto end = strptime(text.c_str(), format, &parsed);
+    if (end && *end == '\0') return timegm(&parsed) * 1000000000LL;
+  }
+  throw std::runtime_error("Invalid time " + text +
+                           ", expected e.g. 90d or 2024-05-01");
+}
+
+std::string FormatStoreTime(int64_t timestamp) {
+  time_t seconds = timestamp / 1000000000LL;
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  char text[32];
+  strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &utc);
+  return text;
+}
+
+double StoredRecord::Get(const std::string& column) const {
+  for (auto& [name, value] : values)
+    if (name == column) return value;
+  return NAN;
+}
+
+KProfResultStore::KProfResultStore(const StoreOptions& _options)
+    : options(_options) {
+  directory = options.directory;
+  if (directory.empty()) {
+    if (auto env = std::getenv("KPROF_STORE"); env && *env)
+      directory = env;
+    else if (auto xdg = std::getenv("XDG_DATA_HOME"); xdg && *xdg)
+      directory = std::string(xdg) + "/kprof/results";
+    else if (auto home = std::getenv("HOME"); home && *home)
+      directory = std::string(home) + "/.local/share/kprof/results";
+    else
+      directory = "kprof-results";
+  }
+  if (options.revision.empty()) {
+    auto env = std::getenv("KPROF_REVISION");
+    options.revision = (env && *env) ? env : GitRevision();
+    if (options.revision.empty()) options.revision = "unknown";
+  }
+  if (options.host.empty()) {
+    options.host = GetHostInfo().modelName;
+    if (options.host.empty()) options.host = GetHostInfo().hostname;
+  }
+
+  std::error_code error;
+  fs::create_directories(directory, error);
+  if (!fs::is_directory(directory))
+    throw std::runtime_error("Cannot create the result store " + directory);
+  Refresh();
+}
+
+KProfResultStore::~KProfResultStore() {
+  Unmap(index);
+  for (auto& [id, mapping] : segments) Unmap(mapping);
+}
+
+void KProfResultStore::Unmap(Mapping& mapping) {
+  if (mapping.base) munmap(const_cast<uint8_t*>(mapping.base), mapping.size);
+  mapping = Mapping();
+}
+
+void KProfResultStore::LoadStrings() {
+  std::ifstream file(directory + "/strings.kpd", std::ios::binary);
+  if (!file.is_open()) return;
+  file.seekg(stringsRead);
+  std::string line;
+  // a line still being written has no newline yet
+  while (std::getline(file, line) && !file.eof()) {
+    stringsRead += line.size() + 1;
+    stringIds.emplace(line, strings.size());
+    strings.push_back(line);
+  }
+}
+
+uint32_t KProfResultStore::Intern(const std::string& text) {
+  // one string per line
+  auto clean = text;
+  std::replace(clean.begin(), clean.end(), '\n', ' ');
+  auto it = stringIds.find(clean);
+  if (it != stringIds.end()) return it->second;
+
+  auto line = clean + "\n";
+  AppendToFile(directory + "/strings.kpd", "", line.data(), line.size());
+  stringsRead += line.size();
+  stringIds.emplace(clean, strings.size());
+  strings.push_back(clean);
+  return strings.size() - 1;
+}
+
+const StoreIndexEntry& KProfResultStore::Entry(size_t i) const {
+  return reinterpret_cast<const StoreIndexEntry*>(index.base +
+                                                  kStoreHeaderSize)[i];
+}
+
+void KProfResultStore::MapIndex() {
+  auto filename = directory + "/index.kpi";
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) return;  // nothing appended yet
+  struct stat info;
+  fstat(fd, &info);
+  size_t size = info.st_size;
+  if (size <= index.size || size < kStoreHeaderSize) {
+    close(fd);
+    return;
+  }
+
+  Unmap(index);
+  auto base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    throw std::runtime_error("Could not map " + filename);
+  index = {static_cast<const uint8_t*>(base), size};
+  if (memcmp(index.base, kStoreIndexMagic, sizeof(kStoreIndexMagic)) != 0)
+    throw std::runtime_error(filename + " is not a KappaProf store index");
+
+  // a torn entry at the end is left out
+  auto total = (size - kStoreHeaderSize) / sizeof(StoreIndexEntry);
+  for (; entries < total; ++entries) {
+    auto& entry = Entry(entries);
+    auto& list = series[{entry.label, entry.configHash, entry.host}];
+    // entries mostly arrive in time order
+    auto position = std::upper_bound(
+        list.begin(), list.end(), entry.timestamp,
+        [&](int64_t timestamp, uint32_t i) {
+          return timestamp < Entry(i).timestamp;
+        });
+    list.insert(position, entries);
+  }
+}
+
+void KProfResultStore::Refresh() {
+  MapIndex();
+  // strings precede the entries using them
+  LoadStrings();
+}
+
+const KProfResultStore::Mapping& KProfResultStore::MapSegment(
+    uint32_t segment, size_t end) {
+  auto& mapping = segments[segment];
+  if (mapping.size >= end) return mapping;
+
+  auto filename = directory + "/segment-" + std::to_string(segment) + ".kps";
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) throw std::runtime_error("Error opening file: " + filename);
+  struct stat info;
+  fstat(fd, &info);
+  size_t size = info.st_size;
+  if (size < end) {
+    close(fd);
+    throw std::runtime_error(filename + " is shorter than its index says");
+  }
+  Unmap(mapping);
+  auto base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    throw std::runtime_error("Could not map " + filename);
+  mapping = {static_cast<const uint8_t*>(base), size};
+  return mapping;
+}
+
+size_t KProfResultStore::RecordAt(const StoreIndexEntry& entry,
+                                  const uint32_t*& columns,
+                                  const uint8_t*& values) {
+  auto& head = MapSegment(entry.segment, entry.offset + 8);
+  uint32_t count;
+  memcpy(&count, head.base + entry.offset, sizeof(count));
+  auto idsBytes = PadTo8(count * sizeof(uint32_t));
+  auto& mapping = MapSegment(
+      entry.segment, entry.offset + 8 + idsBytes + count * sizeof(double));
+  columns = reinterpret_cast<const uint32_t*>(mapping.base + entry.offset + 8);
+  values = mapping.base + entry.offset + 8 + idsBytes;
+  return count;
+}
+
+StoredRecord KProfResultStore::ReadRecord(const StoreIndexEntry& entry) {
+  StoredRecord record;
+  record.label = strings.at(entry.label);
+  record.host = strings.at(entry.host);
+  record.revision = strings.at(entry.revision);
+  record.configHash = entry.configHash;
+  record.timestamp = entry.timestamp;
+
+  const uint32_t* columns;
+  const uint8_t* values;
+  auto count = RecordAt(entry, columns, values);
+  for (size_t i = 0; i < count; ++i) {
+    double value;
+    memcpy(&value, values + i * sizeof(double), sizeof(value));
+    record.values.push_back({strings.at(columns[i]), value});
+  }
+  return record;
+}
+
+void KProfResultStore::Append(
+    const std::string& label,
+    const std::vector<std::pair<std::string, double>>& values,
+    int64_t timestamp) {
+  StoreLock lock(directory);
+  // other processes may have appended strings and entries
+  Refresh();
+
+  std::vector<std::string> names;
+  for (auto& [name, value] : values) names.push_back(name);
+
+  StoreIndexEntry entry;
+  entry.label = Intern(label);
+  entry.host = Intern(options.host);
+  entry.revision = Intern(options.revision);
+  entry.configHash = ConfigHash(names);
+  entry.timestamp = timestamp ? timestamp : Now();
+
+  std::vector<uint32_t> ids;
+  for (auto& name : names) ids.push_back(Intern(name));
+  uint32_t count = ids.size();
+  std::string record;
+  record.append(reinterpret_cast<const char*>(&count), sizeof(count));
+  record.append(4, '\0');
+  record.append(reinterpret_cast<const char*>(ids.data()),
+                ids.size() * sizeof(uint32_t));
+  record.append(PadTo8(record.size()) - record.size(), '\0');
+  for (auto& [name, value] : values)
+    record.append(reinterpret_cast<const char*>(&value), sizeof(value));
+
+  // the segment of the last record, unless it is full
+  entry.segment = entries ? Entry(entries - 1).segment : 0;
+  auto segmentFile = [&] {
+    return directory + "/segment-" + std::to_string(entry.segment) + ".kps";
+  };
+  std::error_code error;
+  auto used = fs::file_size(segmentFile(), error);
+  if (!error && used + record.size() > options.segmentSize) entry.segment++;
+  entry.offset = AppendToFile(segmentFile(), FileHeader(kStoreSegmentMagic),
+                              record.data(), record.size());
+
+  // drop a torn entry before appending, it would shift all later ones
+  auto indexFile = directory + "/index.kpi";
+  auto indexSize = fs::file_size(indexFile, error);
+  if (!error && indexSize > kStoreHeaderSize &&
+      (indexSize - kStoreHeaderSize) % sizeof(StoreIndexEntry))
+    fs::resize_file(indexFile,
+                    indexSize - (indexSize - kStoreHeaderSize) %
+                                    sizeof(StoreIndexEntry));
+  AppendToFile(indexFile, FileHeader(kStoreIndexMagic), &entry,
+               sizeof(entry));
+  MapIndex();
+}
+
+void KProfResultStore::Append(const std::string& label,
+                              const std::vector<KProfCounter>& report,
+                              int64_t timestamp) {
+  std::vector<std::pair<std::string, double>> values;
+  for (auto entry : report)
+    // corrected counts may go below zero
+    values.push_back({entry.GetName(), entry.IsDerived()
+                                           ? entry.GetValue()
+                                           : (double)entry.GetCount()});
+  Append(label, values, timestamp);
+}
+
+void KProfResultStore::Append(const HarnessResult& result,
+                              int64_t timestamp) {
+  if (!timestamp) timestamp = Now();
+  for (auto& sample : result.samples)
+    Append(result.label, sample.report, timestamp);
+}
+
+template <typename Fn>
+void KProfResultStore::ForEachEntry(const StoreQuery& query, Fn&& fn) {
+  Refresh();
+  // a string never stored matches nothing
+  auto lookup = [&](const std::string& text, int64_t& id) {
+    if (text.empty()) return true;
+    auto it = stringIds.find(text);
+    if (it == stringIds.end()) return false;
+    id = it->second;
+    return true;
+  };
+  int64_t label = -1, host = -1, revision = -1;
+  if (!lookup(query.label, label) || !lookup(query.host, host) ||
+      !lookup(query.revision, revision))
+    return;
+
+  for (auto& [key, list] : series) {
+    auto& [seriesLabel, configHash, seriesHost] = key;
+    if ((label != -1 && seriesLabel != label) ||
+        (host != -1 && seriesHost != host) ||
+        (query.configHash && configHash != query.configHash))
+      continue;
+    auto first = std::lower_bound(list.begin(), list.end(), query.from,
+                                  [&](uint32_t i, int64_t from) {
+                                    return Entry(i).timestamp < from;
+                                  });
+    for (auto it = first; it != list.end(); ++it) {
+      auto& entry = Entry(*it);
+      if (entry.timestamp > query.to) break;
+      if (revision != -1 && entry.revision != revision) continue;
+      fn(entry);
+    }
+  }
+}
+
+std::vector<StoredRecord> KProfResultStore::Query(const StoreQuery& query) {
+  std::vector<StoredRecord> records;
+  ForEachEntry(query, [&](const StoreIndexEntry& entry) {
+    records.push_back(ReadRecord(entry));
+  });
+  return records;
+}
+
+inline std::string PeriodOf(int64_t timestamp, StoreGrouping grouping) {
+  time_t seconds = timestamp / 1000000000LL;
+  auto days = seconds / 86400 - (seconds % 86400 < 0);
+  if (grouping == StoreGrouping::WEEK)
+    days -= (days + 3) % 7;  // back to Monday, 1970-01-01 was a Thursday
+  seconds = days * 86400;
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  char text[16];
+  strftime(text, sizeof(text),
+           grouping == StoreGrouping::MONTH ? "%Y-%m" : "%Y-%m-%d", &utc);
+  return text;
+}
+
+std::vector<StoreSummary> KProfResultStore::Summarize(
+    const StoreQuery& query, const std::string& column,
+    StoreGrouping grouping) {
+  Refresh();
+  auto columnId = stringIds.find(column);
+  if (columnId == stringIds.end()) return {};
+
+  struct Group {
+    StoreSummary summary;
+    std::vector<double> values;
+  };
+  // by series and group, in the order the groups are first seen
+  std::map<std::tuple<uint32_t, uint64_t, uint32_t, std::string>, Group>
+      groups;
+  ForEachEntry(query, [&](const StoreIndexEntry& entry) {
+    const uint32_t* columns;
+    const uint8_t* values;
+    auto count = RecordAt(entry, columns, values);
+    auto position =
+        std::find(columns, columns + count, columnId->second) - columns;
+    if (position == (ptrdiff_t)count) return;
+    double value;
+    memcpy(&value, values + position * sizeof(double), sizeof(value));
+
+    std::string period;
+    if (grouping == StoreGrouping::REVISION)
+      period = strings.at(entry.revision);
+    else if (grouping != StoreGrouping::NONE)
+      period = PeriodOf(entry.timestamp, grouping);
+    auto& group =
+        groups[{entry.label, entry.configHash, entry.host, period}];
+    if (group.values.empty()) {
+      group.summary.label = strings.at(entry.label);
+      group.summary.host = strings.at(entry.host);
+      group.summary.configHash = entry.configHash;
+      group.summary.group = period;
+      group.summary.first = entry.timestamp;
+    }
+    group.summary.last = entry.timestamp;
+    group.values.push_back(value);
+  });
+
+  std::vector<StoreSummary> summaries;
+  for (auto& [key, group] : groups) {
+    auto& values = group.values;
+    auto& summary = group.summary;
+    summary.count = values.size();
+    double sum = 0.0;
+    for (auto value : values) sum += value;
+    summary.mean = sum / values.size();
+    double squares = 0.0;
+    for (auto value : values)
+      squares += (value - summary.mean) * (value - summary.mean);
+    summary.stddev =
+        values.size() > 1 ? std::sqrt(squares / (values.size() - 1)) : 0.0;
+    std::sort(values.begin(), values.end());
+    summary.min = values.front();
+    summary.max = values.back();
+    summary.median = values.size() % 2
+                         ? values[values.size() / 2]
+                         : (values[values.size() / 2 - 1] +
+                            values[values.size() / 2]) /
+                               2;
+    summaries.push_back(summary);
+  }
+  // revisions have no order of their own, so they are ordered by time
+  std::stable_sort(summaries.begin(), summaries.end(),
+                   [](const StoreSummary& a, const StoreSummary& b) {
+                     return std::tie(a.label, a.host, a.configHash, a.first) <
+                            std::tie(b.label, b.host, b.configHash, b.first);
+                   });
+  return summaries;
+}
+
+std::vector<StoreSeries> KProfResultStore::GetSeries() {
+  Refresh();
+  std::vector<StoreSeries> result;
+  for (auto& [key, list] : series) {
+    auto& [label, configHash, host] = key;
+    StoreSeries entry;
+    entry.label = strings.at(label);
+    entry.host = strings.at(host);
+    entry.configHash = configHash;
+    entry.records = list.size();
+    std::set<uint32_t> revisions;
+    for (auto i : list) revisions.insert(Entry(i).revision);
+    entry.revisions = revisions.size();
+    entry.first = Entry(list.front()).timestamp;
+    entry.last = Entry(list.back()).timestamp;
+    result.push_back(entry);
+  }
+  return result;
+}
+
+uint64_t KProfResultStore::ConfigHash(
+    const std::vector<std::string>& columns) {
+  // FNV-1a over the names, each followed by a newline
+  uint64_t hash = 14695981039346656037ull;
+  for (auto& column : columns)
+    for (auto c : column + "\n") {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= 1099511628211ull;
+    }
+  return hash ? hash : 1;  // 0 matches any configuration in a query
+}
+
+void KProfResultStore::PrintSummary(const std::vector<StoreSummary>& summaries,
+                                    const std::string& column) {
+  std::cout << column << std::endl;
+  std::cout << std::left << std::setw(24) << "Label" << std::setw(10)
+            << "Config" << std::setw(14) << "Group" << std::right
+            << std::setw(8) << "n" << std::setw(14) << "mean"
+            << std::setw(12) << "stddev" << std::setw(14) << "min"
+            << std::setw(14) << "median" << std::setw(14) << "max"
+            << std::endl;
+  std::string host;
+  for (auto& summary : summaries) {
+    if (summary.host != host) {
+      host = summary.host;
+      std::cout << host << ":" << std::endl;
+    }
+    std::ostringstream config;
+    config << std::hex << std::setw(8) << std::setfill('0')
+           << (summary.configHash >> 32);
+    std::cout << std::left << std::setw(24) << summary.label << std::setw(10)
+              << config.str() << std::setw(14) << summary.group.substr(0, 12)
+              << std::right << std::setw(8) << summary.count
+              << std::setprecision(6) << std::setw(14) << summary.mean
+              << std::setw(12) << summary.stddev << std::setw(14)
+              << summary.min << std::setw(14) << summary.median
+              << std::setw(14) << summary.max << std::endl;
+  }
+}
+
+};  // namespace KProf
@@ -0,0 +1,442 @@
+#include "Roofline.hpp"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+#include "Arena.hpp"
+#include "HostInfo.hpp"
+#include "PmuSysfs.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KPROF_TRIAD_CLONES \
+  __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define KPROF_TRIAD_CLONES
+#endif
+
+namespace KProf {
+
+// Peak kernels: independent chains of multiply-adds, enough of them to hide
+// the latency of the FMA units. Each returns its accumulators folded into a
+// single value, so that the compiler cannot drop the work.
+constexpr int kChains = 12;
+constexpr double kMul = 0.999999;
+constexpr double kAdd = 1e-6;
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE has no FMA, a multiply and an add per step instead
+__attribute__((target("sse2"))) double PeakSSE(uint64_t iterations) {
+  __m128d acc[kChains];
+  auto mul = _mm_set1_pd(kMul), add = _mm_set1_pd(kAdd);
+  for (int c = 0; c < kChains; ++c) acc[c] = _mm_set1_pd(c);
+  for (uint64_t i = 0; i < iterations; ++i) {
+#pragma GCC unroll 12
+    for (int c = 0; c < kChains; ++c)
+      acc[c] = _mm_add_pd(_mm_mul_pd(acc[c], mul), add);
+  }
+  for (int c = 1; c < kChains; ++c) acc[0] = _mm_add_pd(acc[0], acc[c]);
+  return _mm_cvtsd_f64(acc[0]);
+}
+
+__attribute__((target("avx2,fma"))) double PeakAVX2(uint64_t iterations) {
+  __m256d acc[kChains];
+  auto mul = _mm256_set1_pd(kMul), add = _mm256_set1_pd(kAdd);
+  for (int c = 0; c < kChains; ++c) acc[c] = _mm256_set1_pd(c);
+  for (uint64_t i = 0; i < iterations; ++i) {
+#pragma GCC unroll 12
+    for (int c = 0; c < kChains; ++c)
+      acc[c] = _mm256_fmadd_pd(acc[c], mul, add);
+  }
+  for (int c = 1; c < kChains; ++c) acc[0] = _mm256_add_pd(acc[0], acc[c]);
+  return _mm256_cvtsd_f64(acc[0]);
+}
+
+__attribute__((target("avx512f"))) double PeakAVX512(uint64_t iterations) {
+  __m512d acc[kChains];
+  auto mul = _mm512_set1_pd(kMul), add = _mm512_set1_pd(kAdd);
+  for (int c = 0; c < kChains; ++c) acc[c] = _mm512_set1_pd(c);
+  for (uint64_t i = 0; i < iterations; ++i) {
+#pragma GCC unroll 12
+    for (int c = 0; c < kChains; ++c)
+      acc[c] = _mm512_fmadd_pd(acc[c], mul, add);
+  }
+  for (int c = 1; c < kChains; ++c) acc[0] = _mm512_add_pd(acc[0], acc[c]);
+  // not _mm512_reduce_add_pd, which trips -Wuninitialized in gcc 12
+  double lanes[8];
+  _mm512_storeu_pd(lanes, acc[0]);
+  double sum = 0.0;
+  for (auto lane : lanes) sum += lane;
+  return sum;
+}
+#else
+double PeakScalar(uint64_t iterations) {
+  double acc[kChains];
+  for (int c = 0; c < kChains; ++c) acc[c] = c;
+  for (uint64_t i = 0; i < iterations; ++i) {
+#pragma GCC unroll 12
+    for (int c = 0; c < kChains; ++c) acc[c] = std::fma(acc[c], kMul, kAdd);
+  }
+  for (int c = 1; c < kChains; ++c) acc[0] += acc[c];
+  return acc[0];
+}
+#endif
+
+// The triad works on whole 64 byte vectors, the clones pick the widest
+// registers the CPU has. The compiler is not asked to vectorize (the
+// library builds with -Os), the vector type does it.
+typedef double TriadVector __attribute__((vector_size(64)));
+
+KPROF_TRIAD_CLONES void Triad(TriadVector* __restrict a,
+                              const TriadVector* __restrict b,
+                              const TriadVector* __restrict c, size_t n,
+                              double scalar) {
+  for (size_t i = 0; i < n; ++i) a[i] = b[i] + scalar * c[i];
+}
+
+static volatile double roofSink;
+
+// Seconds for the fastest of `trials` calls of kernel(count), with count
+// grown until a call lasts at least minTime
+template <typename Kernel>
+double BestTime(Kernel&& kernel, uint64_t& count, double minTime,
+                size_t trials) {
+  auto timed = [&]() {
+    auto start = std::chrono::steady_clock::now();
+    kernel(count);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  };
+
+  count = 1;
+  auto best = timed();
+  while (best < minTime) {
+    auto scale = (best > 0.0) ? 1.2 * minTime / best : 16.0;
+    count = static_cast<uint64_t>(count * std::clamp(scale, 2.0, 1024.0));
+    best = timed();
+  }
+  for (size_t t = 1; t < trials; ++t) best = std::min(best, timed());
+  return best;
+}
+
+const BandwidthRoof* MachineModel::Roof(const std::string& level) const {
+  for (auto& roof : bandwidths)
+    if (roof.level == level) return &roof;
+  return nullptr;
+}
+
+double MachineModel::Ridge(const std::string& level) const {
+  auto roof = Roof(level);
+  return (roof && roof->bandwidth > 0.0) ? peak / roof->bandwidth : NAN;
+}
+
+MachineModel KProfRoofline::Measure() {
+  MachineModel measured;
+  measured.cpu = GetHostInfo().modelName;
+
+  // flops per iteration: chains x lanes x (multiply + add)
+  std::vector<std::tuple<std::string, double (*)(uint64_t), int>> kernels;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  kernels.push_back({"SSE", &PeakSSE, kChains * 2 * 2});
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    kernels.push_back({"AVX2", &PeakAVX2, kChains * 4 * 2});
+  if (__builtin_cpu_supports("avx512f"))
+    kernels.push_back({"AVX-512", &PeakAVX512, kChains * 8 * 2});
+#else
+  kernels.push_back({"scalar", &PeakScalar, kChains * 2});
+#endif
+
+  for (auto& [isa, kernel, flops] : kernels) {
+    uint64_t iterations;
+    auto seconds = BestTime(
+        [&, kernel = kernel](uint64_t n) { roofSink = kernel(n); },
+        iterations, options.minTime, options.trials);
+    auto gflops = static_cast<double>(iterations) * flops / seconds / 1e9;
+    measured.peaks.push_back({isa, gflops});
+    if (gflops > measured.peak) {
+      measured.peak = gflops;
+      measured.isa = isa;
+    }
+  }
+
+  // a working set of half of each data cache, and one well past the last
+  int cpu = sched_getcpu();
+  if (cpu < 0) cpu = 0;
+  std::vector<std::pair<std::string, size_t>> levels;
+  for (auto& cache : GetCaches(cpu))
+    if (cache.type != "Instruction" && cache.size)
+      levels.push_back({"L" + std::to_string(cache.level), cache.size / 2});
+  auto dram = options.dramSize ? options.dramSize
+                               : std::max(4 * LastLevelCacheSize(cpu),
+                                          size_t(64) << 20);
+  levels.push_back({"DRAM", dram});
+
+  KProfArena arena;
+  for (auto& [level, workingSet] : levels) {
+    auto n = std::max<size_t>(workingSet / (3 * sizeof(TriadVector)), 1);
+    auto a = arena.Get<TriadVector>("roofline-a", n);
+    auto b = arena.Get<TriadVector>("roofline-b", n);
+    auto c = arena.Get<TriadVector>("roofline-c", n);
+    for (size_t i = 0; i < n; ++i) {
+      a[i] = TriadVector{} + 0.0;
+      b[i] = TriadVector{} + 1.0;
+      c[i] = TriadVector{} + 2.0;
+    }
+
+    uint64_t sweeps;
+    auto seconds = BestTime(
+        [&](uint64_t count) {
+          for (uint64_t s = 0; s < count; ++s) Triad(a, b, c, n, kMul);
+        },
+        sweeps, options.minTime, options.trials);
+    roofSink = a[n / 2][0];
+
+    BandwidthRoof roof;
+    roof.level = level;
+    roof.workingSet = 3 * n * sizeof(TriadVector);
+    roof.bandwidth =
+        static_cast<double>(sweeps) * roof.workingSet / seconds / 1e9;
+    measured.bandwidths.push_back(roof);
+  }
+  return measured;
+}
+
+std::string KProfRoofline::CacheFile() {
+  if (!options.cacheFile.empty()) return options.cacheFile;
+  auto env = std::getenv("KPROF_MACHINE_MODEL");
+  if (env && *env) return env;
+  return CacheDirectory() + "/machine-model.csv";
+}
+
+bool KProfRoofline::LoadModel(const std::string& filename,
+                              MachineModel& loaded) {
+  // one record per line: cpu,<brand> / isa,<isa> / peak,<isa>,<GFLOP/s> /
+  // bandwidth,<level>,<bytes>,<GB/s>
+  std::ifstream file(filename);
+  if (!file.is_open()) return false;
+
+  MachineModel cached;
+  std::string line;
+  try {
+    while (std::getline(file, line)) {
+      if (line.empty() || line[0] == '#') continue;
+      auto comma = line.find(',');
+      auto key = line.substr(0, comma);
+      auto rest = (comma == std::string::npos) ? "" : line.substr(comma + 1);
+
+      std::vector<std::string> fields;
+      std::stringstream stream(rest);
+      std::string field;
+      while (std::getline(stream, field, ',')) fields.push_back(field);
+
+      if (key == "cpu") {
+        cached.cpu = rest;  // brand strings may contain commas
+      } else if (key == "isa") {
+        cached.isa = rest;
+      } else if (key == "peak" && fields.size() == 2) {
+        cached.peaks.push_back({fields[0], std::stod(fields[1])});
+      } else if (key == "bandwidth" && fields.size() == 3) {
+        cached.bandwidths.push_back(
+            {fields[0], std::stoul(fields[1]), std::stod(fields[2])});
+      }
+    }
+  } catch (std::exception&) {
+    std::cerr << "Malformed machine model " << filename
+              << ". Measuring it again." << std::endl;
+    return false;
+  }
+
+  // a model is only valid on the CPU it was measured on
+  if (cached.cpu != GetHostInfo().modelName || cached.peaks.empty() ||
+      cached.bandwidths.empty())
+    return false;
+  for (auto& [isa, gflops] : cached.peaks)
+    if (isa == cached.isa) cached.peak = gflops;
+  loaded = cached;
+  return true;
+}
+
+void KProfRoofline::SaveModel(const std::string& filename,
+                              const MachineModel& measured) {
+  std::error_code error;
+  auto dir = std::filesystem::path(filename).parent_path();
+  if (!dir.empty()) std::filesystem::create_directories(dir, error);
+
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    std::cerr << "Cannot write machine model " << filename
+              << ". It will be measured again next time." << std::endl;
+    return;
+  }
+  file << "# KappaProf machine model, delete to measure again" << std::endl;
+  file << "cpu," << measured.cpu << std::endl;
+  file << "isa," << measured.isa << std::endl;
+  for (auto& [isa, gflops] : measured.peaks)
+    file << "peak," << isa << "," << gflops << std::endl;
+  for (auto& roof : measured.bandwidths)
+    file << "bandwidth," << roof.level << "," << roof.workingSet << ","
+         << roof.bandwidth << std::endl;
+}
+
+const MachineModel& KProfRoofline::GetModel() {
+  if (loaded) return model;
+
+  auto filename = CacheFile();
+  if (options.remeasure || !LoadModel(filename, model)) {
+    std::cerr << "Measuring the machine model for " << GetHostInfo().modelName
+              << "." << std::endl;
+    model = Measure();
+    SaveModel(filename, model);
+  }
+  loaded = true;
+  return model;
+}
+
+RooflinePoint KProfRoofline::Place(const std::string& label, double flops,
+                                   double bytes, double seconds,
+                                   const std::string& level) {
+  auto& machine = GetModel();
+
+  RooflinePoint point;
+  point.label = label;
+  point.level = level;
+  point.flops = flops;
+  point.bytes = bytes;
+  point.seconds = seconds;
+  point.intensity = (bytes > 0.0) ? flops / bytes : INFINITY;
+  point.attained = (seconds > 0.0) ? flops / seconds / 1e9 : 0.0;
+
+  auto roof = machine.Roof(level);
+  if (!roof) {
+    std::cerr << "Memory level " << level << " is not in the machine model. "
+              << "Using DRAM instead." << std::endl;
+    roof = machine.Roof("DRAM");
+    point.level = "DRAM";
+  }
+
+  auto memoryRoof = roof ? roof->bandwidth * point.intensity : INFINITY;
+  point.computeBound = memoryRoof >= machine.peak;
+  point.ceiling = std::min(machine.peak, memoryRoof);
+  return point;
+}
+
+inline bool FindEntry(std::vector<KProfCounter>& report,
+                      const std::string& name, double& value) {
+  for (auto& entry : report)
+    if (entry.GetName() == name) {
+      value = entry.GetValue();
+      return true;
+    }
+  return false;
+}
+
+RooflinePoint KProfRoofline::Place(const std::string& label,
+                                   std::vector<KProfCounter>& report,
+                                   double flops, double bytes,
+                                   const std::string& level) {
+  if (flops <= 0.0 && !FindEntry(report, "FLOPs", flops))
+    std::cerr << "No FLOP count for " << label
+              << ". Declare it or call KProfEvent::TrackFlops()." << std::endl;
+  if (bytes <= 0.0 && !FindEntry(report, "Bytes", bytes))
+    std::cerr << "No byte count for " << label
+              << ". Declare it or define a Bytes metric." << std::endl;
+
+  double wallTime = 0.0;
+  FindEntry(report, "Wall-time", wallTime);
+  return Place(label, flops, bytes, wallTime / 1e9, level);
+}
+
+RooflinePoint KProfRoofline::Place(const HarnessResult& result, double flops,
+                                   double bytes, const std::string& level) {
+  if (result.samples.empty())
+    throw std::runtime_error("No samples to place for " + result.label);
+
+  auto median = [&](const std::string& name, double declared) {
+    if (declared > 0.0) return declared;
+    auto value = result.CleanMedian(name);
+    return std::isnan(value) ? 0.0 : value;
+  };
+
+  std::vector<KProfCounter> summary;
+  auto medianFlops = median("FLOPs", flops);
+  auto medianBytes = median("Bytes", bytes);
+  summary.push_back(KProfCounter("Wall-time", median("Wall-time", 0.0)));
+  return Place(result.label, summary, medianFlops, medianBytes, level);
+}
+
+void KProfRoofline::PrintModel(const MachineModel& machine) {
+  std::cout << "Machine model of " << machine.cpu << " (one core)"
+            << std::endl;
+  for (auto& [isa, gflops] : machine.peaks)
+    std::cout << "  Peak " << std::left << std::setw(8) << isa << std::right
+              << std::fixed << std::setprecision(1) << std::setw(10) << gflops
+              << " GFLOP/s" << std::defaultfloat << std::endl;
+  for (auto& roof : machine.bandwidths)
+    std::cout << "  " << std::left << std::setw(13) << roof.level
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << roof.bandwidth << " GB/s     ridge "
+              << std::setprecision(2) << machine.Ridge(roof.level)
+              << " FLOP/byte, " << (roof.workingSet >> 10) << " KiB working set"
+              << std::defaultfloat << std::endl;
+}
+
+void KProfRoofline::PrintPoint(const RooflinePoint& point) {
+  std::cout << point.label << ": " << std::fixed << std::setprecision(3)
+            << point.intensity << " FLOP/byte, " << std::setprecision(2)
+            << point.attained << " of " << point.ceiling << " GFLOP/s ("
+            << std::setprecision(1) << 100.0 * point.Efficiency()
+            << "% of the ceiling), "
+            << (point.computeBound ? "compute" : point.level + " bandwidth")
+            << " bound" << std::defaultfloat << std::endl;
+}
+
+void KProfEvent::TrackFlops() {
+  for (auto& metric : metrics)
+    if (metric.GetName() == "FLOPs") return;
+
+  auto& host = GetHostInfo();
+  std::string corePmu = (PmuType("cpu_core") != -1) ? "cpu_core" : "cpu";
+  int rawType = PmuType(corePmu);
+  if (rawType == -1) rawType = PERF_TYPE_RAW;
+
+  std::vector<CounterSpec> specs;
+  if (host.IsIntel()) {
+    // FP_ARITH_INST_RETIRED (Broadwell and later) counts instructions per
+    // vector width, and FMAs twice. Unit masks of equal weight share a
+    // counter: scalar, 128b double, 128b single and 256b double, 256b
+    // single and 512b double, 512b single.
+    specs = {{"FP-scalar", rawType, IntelRaw(0xC7, 0x03), USER},
+             {"FP-2-wide", rawType, IntelRaw(0xC7, 0x04), USER},
+             {"FP-4-wide", rawType, IntelRaw(0xC7, 0x18), USER},
+             {"FP-8-wide", rawType, IntelRaw(0xC7, 0x60), USER},
+             {"FP-16-wide", rawType, IntelRaw(0xC7, 0x80), USER}};
+    AddMetric("FLOPs",
+              "FP-scalar + 2 * FP-2-wide + 4 * FP-4-wide + 8 * FP-8-wide + "
+              "16 * FP-16-wide");
+  } else if (host.IsAMD() && host.family >= 0x17) {
+    // FP_RET_SSE_AVX_OPS counts floating point operations, FMAs as two
+    specs = {{"FP-ops", rawType, AMDRaw(0x03, 0xFF), USER}};
+    AddMetric("FLOPs", "FP-ops");
+  } else {
+    std::cerr << "No floating point operation counters are known for "
+              << host.modelName << ". Declare the FLOP count instead."
+              << std::endl;
+    return;
+  }
+  RegisterCounterSet(specs);
+}
+
+};  // namespace KProf
@@ -0,0 +1,162 @@
+#include "Sampling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+
+#include "DerivedMetrics.hpp"
+
+namespace KProf {
+
+// xorshift64*, only advanced when a sample is taken
+inline uint64_t NextRandom() {
+  thread_local uint64_t state =
+      reinterpret_cast<uintptr_t>(&state) ^
+      static_cast<uint64_t>(
+          std::chrono::steady_clock::now().time_since_epoch().count()) ^
+      0x9E3779B97F4A7C15ull;
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545F4914F6CDD1Dull;
+}
+
+KProfSampledRegion::KProfSampledRegion(KProfEvent& _monitor,
+                                       const SamplingOptions& _options)
+    : monitor(_monitor), options(_options) {
+  if (options.period == 0) options.period = 1;
+  if (options.maxPeriod < options.period) options.maxPeriod = options.period;
+  counts.resize(monitor.GetNumCounters());
+
+  // Start and stop cost of the monitor, also counted by a sampled region:
+  // the least of a few empty regions
+  empty.assign(counts.size() + 1, std::numeric_limits<double>::max());
+  for (int i = 0; i < 16; ++i) {
+    monitor.StartCounters();
+    monitor.StopCounters();
+    monitor.ReadCounts(counts.data(), counts.size());
+    for (size_t c = 0; c < counts.size(); ++c)
+      empty[c] = std::min(empty[c], static_cast<double>(counts[c]));
+    empty.back() =
+        std::min(empty.back(), static_cast<double>(monitor.GetDuration()));
+  }
+  Reset();
+}
+
+void KProfSampledRegion::Reset() {
+  samples = 0;
+  scheduled = 0;
+  instrumentationTime = 0.0;
+  means.assign(counts.size() + 1, 0.0);
+  deviations.assign(counts.size() + 1, 0.0);
+  period = options.policy == SamplingPolicy::ALWAYS ? 1 : options.period;
+  Schedule();
+}
+
+void KProfSampledRegion::Schedule() {
+  if (options.policy == SamplingPolicy::TIME_BUDGET && samples > 0) {
+    // the gap at which one sample's cost is the budgeted share of the time
+    // the region runs in between
+    auto cost = instrumentationTime / samples;
+    auto regionTime = std::max(means.back() - empty.back(), 1.0);
+    auto gap = std::ceil(cost / (options.overheadBudget * regionTime));
+    period = static_cast<uint64_t>(
+        std::clamp(gap, 1.0, static_cast<double>(options.maxPeriod)));
+  }
+
+  uint64_t gap = period;
+  if (options.policy == SamplingPolicy::RANDOM && period > 1)
+    gap = 1 + NextRandom() % (2 * period - 1);
+  countdown = gap;
+  scheduled += gap;
+}
+
+void KProfSampledRegion::StartSample() {
+  sampleStart = std::chrono::high_resolution_clock::now();
+  monitor.StartCounters();
+}
+
+void KProfSampledRegion::StopSample() {
+  monitor.StopCounters();
+  auto region = static_cast<double>(monitor.GetDuration());
+
+  // Welford's update, exact for the integer counts as long as they fit a
+  // double's mantissa
+  monitor.ReadCounts(counts.data(), counts.size());
+  samples++;
+  auto n = static_cast<double>(samples);
+  for (size_t i = 0; i < means.size(); ++i) {
+    auto value = i < counts.size() ? static_cast<double>(counts[i]) : region;
+    auto delta = value - means[i];
+    means[i] += delta / n;
+    deviations[i] += delta * (value - means[i]);
+  }
+
+  auto elapsed = std::chrono::duration<double, std::nano>(
+                     std::chrono::high_resolution_clock::now() - sampleStart)
+                     .count();
+  instrumentationTime += elapsed - std::max(region - empty.back(), 0.0);
+  Schedule();
+}
+
+SamplingReport KProfSampledRegion::GetReport() {
+  SamplingReport report;
+  report.calls = GetCalls();
+  report.samples = samples;
+
+  auto names = monitor.GetCounterNames();
+  names.push_back("Wall-time");
+  auto corrected = means;
+  if (options.overheadCorrection)
+    for (size_t i = 0; i < corrected.size(); ++i)
+      corrected[i] = std::max(corrected[i] - empty[i], 0.0);
+
+  auto calls = static_cast<double>(report.calls);
+  auto n = static_cast<double>(samples);
+  // without replacement from `calls` calls
+  auto correction = calls > 0 ? std::sqrt(std::max(1.0 - n / calls, 0.0)) : 0;
+  for (size_t i = 0; i < names.size() && i < corrected.size(); ++i) {
+    SampledValue value;
+    value.name = names[i];
+    value.perCall = samples ? corrected[i] : NAN;
+    value.perCallError =
+        samples > 1 ? std::sqrt(deviations[i] / (n - 1) / n) * correction
+                    : NAN;
+    value.total = value.perCall * calls;
+    value.totalError = value.perCallError * calls;
+    report.counters.push_back(value);
+  }
+  report.counters.back().name = "Wall-time (ns)";
+
+  auto regionTime = std::max(means.back() - empty.back(), 0.0) * calls;
+  report.overhead = regionTime > 0 ? instrumentationTime / regionTime : NAN;
+
+  // metrics of the per-call means, i.e. ratios of the extrapolated totals
+  std::vector<double> inputs(corrected.begin(), corrected.end());
+  for (auto& [name, expression] : monitor.GetMetricDefinitions()) {
+    KProfMetric metric(name, expression);
+    auto value = metric.Bind(names) ? metric.Evaluate(inputs.data()) : NAN;
+    report.metrics.push_back({name, value});
+    names.push_back(name);
+    inputs.push_back(value);
+  }
+  return report;
+}
+
+void KProfSampledRegion::PrintReport(const SamplingReport& report) {
+  std::cout << report.samples << " of " << report.calls
+            << " calls sampled, overhead " << std::fixed
+            << std::setprecision(2) << 100.0 * report.overhead
+            << std::defaultfloat << "% of the region's time" << std::endl;
+  for (auto& value : report.counters)
+    std::cout << value.name << " : " << std::setprecision(6) << value.perCall
+              << " +- " << value.perCallError << " per call, "
+              << value.total << " +- " << value.totalError << " total"
+              << std::endl;
+  for (auto& [name, value] : report.metrics)
+    std::cout << name << " : " << value << std::endl;
+}
+
+};  // namespace KProf
@@ -0,0 +1,153 @@
+#include "Scheduler.hpp"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include "HostInfo.hpp"
+
+namespace KProf {
+
+std::vector<int> KProfScheduler::PlanSlots() {
+  std::vector<int> allowed;
+  cpu_set_t mask;
+  if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &mask)) allowed.push_back(cpu);
+  }
+
+  auto candidates = options.cpus;
+  if (candidates.empty()) {
+    // isolated CPUs are outside the affinity mask unless asked for, e.g.
+    // with taskset, and a cpuset may exclude them altogether, so only those
+    // the workers can be pinned to are preferred
+    for (auto cpu :
+         ParseCpuList(ReadSysfs("/sys/devices/system/cpu/isolated")))
+      if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+        candidates.push_back(cpu);
+    if (candidates.empty()) candidates = allowed;
+  }
+
+  auto topology = GetTopology();
+  std::set<std::pair<int, int>> usedCores;  // (package, core)
+  std::set<int> usedCaches;
+  std::vector<int> slots;
+  for (auto cpu : candidates) {
+    auto it = std::find_if(topology.begin(), topology.end(),
+                           [&](auto& entry) { return entry.cpu == cpu; });
+    if (it == topology.end()) {
+      std::cerr << "CPU " << cpu << " is not online. Skipping it."
+                << std::endl;
+      continue;
+    }
+
+    if (options.isolation != Isolation::SHARED &&
+        !usedCores.insert({it->package, it->core}).second)
+      continue;
+    if (options.isolation == Isolation::LLC &&
+        !usedCaches.insert(it->llc).second)
+      continue;
+
+    slots.push_back(cpu);
+    if (options.maxWorkers && slots.size() == options.maxWorkers) break;
+  }
+  return slots;
+}
+
+HarnessResult KProfScheduler::RunJob(BenchmarkJob& job, int cpu) {
+  // the counter session is opened on, and pinned with, the worker thread
+  auto monitor = job.counterConfig.empty()
+                     ? std::make_unique<KProfEvent>()
+                     : std::make_unique<KProfEvent>(job.counterConfig);
+
+  auto jobOptions = job.options;
+  if (jobOptions.guardEnvironment) jobOptions.environment.cpu = cpu;
+  KProfHarness harness(jobOptions);
+  return harness.Run(job.label, *monitor, [&](KProfEvent& m) {
+    job.kernel(m, harness.GetArena());
+  });
+}
+
+ScheduleResult KProfScheduler::Run(std::vector<BenchmarkJob>& jobs) {
+  ScheduleResult schedule;
+  schedule.results.resize(jobs.size());
+  schedule.cpus.assign(jobs.size(), -1);
+  schedule.slots = PlanSlots();
+  if (schedule.slots.empty())
+    throw std::runtime_error("No CPU available to run benchmark jobs on");
+
+  std::vector<size_t> shared, exclusive;
+  for (size_t i = 0; i < jobs.size(); ++i)
+    (jobs[i].exclusive ? exclusive : shared).push_back(i);
+
+  std::mutex lock;
+  std::exception_ptr failure;
+  size_t completed = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  auto work = [&](int cpu, const std::vector<size_t>& queue,
+                  std::atomic<size_t>& next) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+      std::lock_guard<std::mutex> guard(lock);
+      std::cerr << "Cannot pin worker to CPU " << cpu << ": "
+                << strerror(errno) << ". Its jobs run unpinned." << std::endl;
+    }
+
+    for (auto idx = next++; idx < queue.size(); idx = next++) {
+      auto job = queue[idx];
+      try {
+        schedule.results[job] = RunJob(jobs[job], cpu);
+        schedule.cpus[job] = cpu;
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!failure) failure = std::current_exception();
+        next = queue.size();  // stop handing out work
+      }
+
+      std::lock_guard<std::mutex> guard(lock);
+      completed++;
+      if (options.progress)
+        std::cout << "Completed " << jobs[job].label << " on CPU " << cpu
+                  << " (" << completed << "/" << jobs.size() << ")"
+                  << std::endl;
+    }
+  };
+
+  std::atomic<size_t> next = 0;
+  std::vector<std::thread> workers;
+  auto numWorkers = std::min(schedule.slots.size(), shared.size());
+  for (size_t w = 0; w < numWorkers; ++w)
+    workers.emplace_back(work, schedule.slots[w], std::cref(shared),
+                         std::ref(next));
+  for (auto& worker : workers) worker.join();
+
+  // exclusive jobs see an otherwise idle set of slots
+  if (!failure && !exclusive.empty()) {
+    std::atomic<size_t> nextExclusive = 0;
+    std::thread worker(work, schedule.slots.front(), std::cref(exclusive),
+                       std::ref(nextExclusive));
+    worker.join();
+  }
+
+  schedule.wallTime = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  if (failure) std::rethrow_exception(failure);
+  return schedule;
+}
+
+};  // namespace KProf
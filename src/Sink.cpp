@@ -0,0 +1,284 @@
+#include "Sink.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "HostInfo.hpp"
+
+namespace KProf {
+
+constexpr char kSinkMagic[8] = {'K', 'P', 'R', 'O', 'F', 'R', 'O', 'W'};
+constexpr uint32_t kSinkVersion = 1;
+
+std::string JsonString(const std::string& text) {
+  std::stringstream out;
+  out << '"';
+  for (auto c : text) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+          << static_cast<int>(c) << std::dec << std::setfill(' ');
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+template <typename T>
+inline void AppendNumber(std::string& buffer, T value) {
+  char digits[32];
+  auto res = std::to_chars(digits, digits + sizeof(digits), value);
+  buffer.append(digits, res.ptr);
+}
+
+template <typename T>
+inline void AppendBytes(std::string& buffer, T value) {
+  char raw[sizeof(T)];
+  memcpy(raw, &value, sizeof(T));  // little endian on every target
+  buffer.append(raw, sizeof(T));
+}
+
+KProfSink::KProfSink(const std::string& _filename, SinkFormat _format,
+                     const SinkOptions& _options)
+    : filename(_filename), format(_format), options(_options) {
+  int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC;
+  if (!options.append) flags |= O_TRUNC;
+  fd = open(filename.c_str(), flags, 0644);
+  if (fd == -1) {
+    std::stringstream errmsg;
+    errmsg << "Cannot open output file " << filename << ": "
+           << strerror(errno);
+    throw std::runtime_error(errmsg.str());
+  }
+
+  struct stat st;
+  existing = fstat(fd, &st) == 0 && st.st_size > 0;
+
+  // some slack, so that the row crossing bufferSize does not reallocate
+  buffer.reserve(options.bufferSize + options.bufferSize / 4);
+  if (options.background) writer = std::thread(&KProfSink::WriterLoop, this);
+}
+
+KProfSink::~KProfSink() {
+  Flush();
+  if (writer.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+  }
+  close(fd);
+}
+
+void KProfSink::WriteHeader(std::vector<KProfCounter>& report) {
+  for (auto& entry : report) {
+    columns.push_back(entry.GetName());
+    derived.push_back(entry.IsDerived());
+    jsonKeys.push_back(JsonString(entry.GetName()) + ":");
+  }
+
+  std::string header;
+  switch (format) {
+    case SinkFormat::CSV:
+      for (size_t i = 0; i < columns.size(); ++i)
+        header += (i ? "," : "") + columns[i];
+      header += "\n";
+      break;
+    case SinkFormat::JSONL:
+      return;  // every line names its fields
+    case SinkFormat::BINARY:
+      header.append(kSinkMagic, sizeof(kSinkMagic));
+      AppendBytes(header, kSinkVersion);
+      AppendBytes(header, static_cast<uint32_t>(columns.size()));
+      for (size_t i = 0; i < columns.size(); ++i) {
+        AppendBytes(header, static_cast<uint8_t>(derived[i]));
+        AppendBytes(header, static_cast<uint16_t>(columns[i].size()));
+        header += columns[i];
+      }
+      break;
+    case SinkFormat::COLUMNAR: {
+      auto& host = GetHostInfo();
+      Metadata metadata = {{"host", host.hostname}, {"cpu", host.modelName}};
+      metadata.insert(metadata.end(), options.metadata.begin(),
+                      options.metadata.end());
+      header = ColumnarHeader(columns, derived, metadata);
+      // one chunk is staged in these, allocated once
+      staged.resize(columns.size());
+      for (auto& column : staged)
+        column.reserve(options.bufferSize / (8 * columns.size()) + 1);
+      break;
+    }
+  }
+
+  if (!existing) {
+    buffer += header;
+    return;
+  }
+  // rows appended to a binary file must have its columns
+  if (format == SinkFormat::BINARY || format == SinkFormat::COLUMNAR) {
+    std::string found(header.size(), '\0');
+    if (pread(fd, found.data(), found.size(), 0) !=
+            static_cast<ssize_t>(found.size()) ||
+        found != header)
+      throw std::runtime_error(filename +
+                               " holds reports with different columns");
+  }
+}
+
+void KProfSink::FormatRow(std::vector<KProfCounter>& report) {
+  switch (format) {
+    case SinkFormat::CSV:
+      for (size_t i = 0; i < report.size(); ++i) {
+        if (i) buffer += ',';
+        if (derived[i])
+          AppendNumber(buffer, report[i].GetValue());
+        else
+          AppendNumber(buffer, report[i].GetCount());
+      }
+      buffer += '\n';
+      break;
+    case SinkFormat::JSONL:
+      buffer += '{';
+      for (size_t i = 0; i < report.size(); ++i) {
+        if (i) buffer += ',';
+        buffer += jsonKeys[i];
+        if (!derived[i])
+          AppendNumber(buffer, report[i].GetCount());
+        else if (std::isfinite(report[i].GetValue()))
+          AppendNumber(buffer, report[i].GetValue());
+        else
+          buffer += "null";  // JSON has no nan
+      }
+      buffer += "}\n";
+      break;
+    case SinkFormat::BINARY:
+      for (size_t i = 0; i < report.size(); ++i) {
+        if (derived[i])
+          AppendBytes(buffer, report[i].GetValue());
+        else
+          AppendBytes(buffer, static_cast<uint64_t>(report[i].GetCount()));
+      }
+      break;
+    case SinkFormat::COLUMNAR:
+      for (size_t i = 0; i < report.size(); ++i) {
+        if (derived[i]) {
+          uint64_t bits;
+          auto value = report[i].GetValue();
+          memcpy(&bits, &value, sizeof(bits));
+          staged[i].push_back(bits);
+        } else {
+          staged[i].push_back(static_cast<uint64_t>(report[i].GetCount()));
+        }
+      }
+      stagedRows++;
+      break;
+  }
+}
+
+bool KProfSink::Write(std::vector<KProfCounter>& report) {
+  if (columns.empty()) {
+    WriteHeader(report);
+  } else if (report.size() != columns.size()) {
+    std::cerr << "Report with " << report.size() << " entries does not fit "
+              << filename << ", which has " << columns.size()
+              << " columns. Ignoring report." << std::endl;
+    return false;
+  }
+
+  FormatRow(report);
+  rows++;
+  if (stagedRows * columns.size() * sizeof(uint64_t) >= options.bufferSize)
+    EncodeStaged();
+  if (buffer.size() >= options.bufferSize) Submit();
+  return true;
+}
+
+void KProfSink::EncodeStaged() {
+  if (stagedRows == 0) return;
+  EncodeChunk(buffer, staged, derived, stagedRows, options.deltaEncode);
+  for (auto& column : staged) column.clear();
+  stagedRows = 0;
+}
+
+void KProfSink::Submit() {
+  if (buffer.empty()) return;
+  if (!options.background) {
+    WriteOut(buffer);
+    buffer.clear();
+    return;
+  }
+
+  std::string next;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    pending.push_back(std::move(buffer));
+    // reuse a buffer the writer is done with
+    if (!spare.empty()) {
+      next = std::move(spare.back());
+      spare.pop_back();
+    }
+  }
+  wake.notify_one();
+  buffer = std::move(next);
+  if (buffer.capacity() < options.bufferSize)
+    buffer.reserve(options.bufferSize + options.bufferSize / 4);
+}
+
+void KProfSink::Flush() {
+  EncodeStaged();
+  Submit();
+  if (!options.background) return;
+  std::unique_lock<std::mutex> guard(lock);
+  drained.wait(guard, [&]() { return pending.empty() && !writing; });
+}
+
+void KProfSink::WriteOut(const std::string& chunk) {
+  size_t done = 0;
+  while (done < chunk.size()) {
+    auto res = write(fd, chunk.data() + done, chunk.size() - done);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "Error writing " << filename << ": " << strerror(errno)
+                << ". " << chunk.size() - done << " bytes are lost."
+                << std::endl;
+      return;
+    }
+    done += static_cast<size_t>(res);
+  }
+}
+
+void KProfSink::WriterLoop() {
+  std::unique_lock<std::mutex> guard(lock);
+  for (;;) {
+    wake.wait(guard, [&]() { return stopping || !pending.empty(); });
+    if (pending.empty()) return;  // stopping, and everything is written
+
+    auto chunk = std::move(pending.front());
+    pending.pop_front();
+    writing = true;
+    guard.unlock();
+    WriteOut(chunk);
+    chunk.clear();
+    guard.lock();
+    spare.push_back(std::move(chunk));
+    writing = false;
+    drained.notify_all();
+  }
+}
+
+};  // namespace KProf
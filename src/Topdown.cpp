@@ -0,0 +1,142 @@
+#include "HostInfo.hpp"
+#include "PmuSysfs.hpp"
+#include "kprof.hpp"
+
+// Top-down microarchitecture analysis (TMA). Level 1 splits the issue slots
+// of the core into Frontend-Bound, Bad-Speculation, Backend-Bound and
+// Retiring; level 2 further splits Backend-Bound into Memory-Bound and
+// Core-Bound. All categories are fractions of the available slots and are
+// reported as derived metrics, so their counters are co-scheduled.
+namespace KProf {
+
+void KProfEvent::ConfigureTopdown(TopdownLevel level) {
+  if (typeMap.empty()) ConstructTypeMap();
+
+  auto& host = GetHostInfo();
+  std::vector<CounterSpec> specs;
+  // level 2 falls back to the cycle-activity split unless handled natively
+  bool stallBreakdown = (level >= TOPDOWN_L2);
+
+  // hybrid parts export the P-core PMU as cpu_core
+  std::string corePmu = (PmuType("cpu_core") != -1) ? "cpu_core" : "cpu";
+  int rawType = PmuType(corePmu);
+  if (rawType == -1) rawType = PERF_TYPE_RAW;
+
+  uint64_t config;
+  if (host.IsIntel() && PmuEventConfig(corePmu, "slots", config)) {
+    // Icelake and later: the slots fixed counter and the PERF_METRICS
+    // register. The kernel reports each topdown-* event as its share of
+    // slots, and requires slots to lead their group.
+    specs.push_back({"TD-slots", rawType, config, USER});
+
+    const std::pair<const char*, const char*> level1[] = {
+        {"TD-fe-bound", "topdown-fe-bound"},
+        {"TD-bad-spec", "topdown-bad-spec"},
+        {"TD-be-bound", "topdown-be-bound"},
+        {"TD-retiring", "topdown-retiring"}};
+    for (auto& [label, event] : level1)
+      if (PmuEventConfig(corePmu, event, config))
+        specs.push_back({label, rawType, config, USER});
+
+    AddMetric("Frontend-Bound", "TD-fe-bound / TD-slots");
+    AddMetric("Bad-Speculation", "TD-bad-spec / TD-slots");
+    AddMetric("Backend-Bound", "TD-be-bound / TD-slots");
+    AddMetric("Retiring", "TD-retiring / TD-slots");
+
+    // Sapphire Rapids and the Alder Lake P-core add level 2 to PERF_METRICS
+    if (level >= TOPDOWN_L2 &&
+        PmuEventConfig(corePmu, "topdown-mem-bound", config)) {
+      specs.push_back({"TD-mem-bound", rawType, config, USER});
+      AddMetric("Memory-Bound", "TD-mem-bound / TD-slots");
+      AddMetric("Core-Bound", "Backend-Bound - Memory-Bound");
+      stallBreakdown = false;
+    }
+  } else if (host.IsIntel() && host.family == 6) {
+    // Older cores: four issue slots per cycle, derived from cycles
+    // clang-format off
+    specs.push_back({"TD-cycles"          , PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, USER});
+    specs.push_back({"TD-not-delivered"   , rawType, IntelRaw(0x9C, 0x01), USER});  // IDQ_UOPS_NOT_DELIVERED.CORE
+    specs.push_back({"TD-uops-issued"     , rawType, IntelRaw(0x0E, 0x01), USER});  // UOPS_ISSUED.ANY
+    specs.push_back({"TD-retire-slots"    , rawType, IntelRaw(0xC2, 0x02), USER});  // UOPS_RETIRED.RETIRE_SLOTS
+    specs.push_back({"TD-recovery-cycles" , rawType, IntelRaw(0x0D, 0x01), USER});  // INT_MISC.RECOVERY_CYCLES
+    // clang-format on
+
+    AddMetric("Frontend-Bound", "TD-not-delivered / (4 * TD-cycles)");
+    AddMetric("Bad-Speculation",
+              "(TD-uops-issued - TD-retire-slots + 4 * TD-recovery-cycles) / "
+              "(4 * TD-cycles)");
+    AddMetric("Retiring", "TD-retire-slots / (4 * TD-cycles)");
+    AddMetric("Backend-Bound",
+              "1 - Frontend-Bound - Bad-Speculation - Retiring");
+  } else if (host.IsAMD() && host.IsZen4OrLater()) {
+    // Zen 4 introduced the per-slot dispatch stall events used below
+    // Zen 4 dispatches 6 ops per cycle, Zen 5 dispatches 8
+    auto width = std::to_string((host.family >= 0x1A) ? 8 : 6);
+    // clang-format off
+    specs.push_back({"TD-cycles"          , PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, USER});
+    specs.push_back({"TD-no-dispatch-fe"  , PERF_TYPE_RAW, AMDRaw(0x1A0, 0x01), USER});  // de_no_dispatch_per_slot.no_ops_from_frontend
+    specs.push_back({"TD-no-dispatch-be"  , PERF_TYPE_RAW, AMDRaw(0x1A0, 0x1E), USER});  // de_no_dispatch_per_slot.backend_stalls
+    specs.push_back({"TD-no-dispatch-smt" , PERF_TYPE_RAW, AMDRaw(0x1A0, 0x60), USER});  // de_no_dispatch_per_slot.smt_contention
+    specs.push_back({"TD-ops-dispatched"  , PERF_TYPE_RAW, AMDRaw(0x0AA, 0x07), USER});  // de_src_op_disp.all
+    specs.push_back({"TD-ops-retired"     , PERF_TYPE_RAW, AMDRaw(0x0C1, 0x00), USER});  // ex_ret_ops
+    // clang-format on
+
+    auto slots = "(" + width + " * TD-cycles)";
+    AddMetric("Frontend-Bound", "TD-no-dispatch-fe / " + slots);
+    AddMetric("Bad-Speculation",
+              "(TD-ops-dispatched - TD-ops-retired) / " + slots);
+    AddMetric("Backend-Bound", "TD-no-dispatch-be / " + slots);
+    AddMetric("Retiring", "TD-ops-retired / " + slots);
+    AddMetric("SMT-Contention", "TD-no-dispatch-smt / " + slots);
+
+    if (level >= TOPDOWN_L2) {
+      // clang-format off
+      specs.push_back({"TD-not-complete"      , PERF_TYPE_RAW, AMDRaw(0x0D6, 0x02), USER});  // ex_no_retire.not_complete
+      specs.push_back({"TD-load-not-complete" , PERF_TYPE_RAW, AMDRaw(0x0D6, 0xA2), USER});  // ex_no_retire.load_not_complete
+      // clang-format on
+      AddMetric("Memory-Bound",
+                "Backend-Bound * TD-load-not-complete / TD-not-complete");
+      AddMetric("Core-Bound", "Backend-Bound - Memory-Bound");
+      stallBreakdown = false;
+    }
+  } else {
+    std::stringstream errmsg;
+    errmsg << "Top-down analysis is not supported on " << host.vendor
+           << " family 0x" << std::hex << host.family << " model 0x"
+           << host.model << " (" << host.modelName << ")";
+    throw std::runtime_error(errmsg.str());
+  }
+
+  if (stallBreakdown) {
+    // Intel without level 2 in PERF_METRICS: split Backend-Bound by the
+    // share of stall cycles with an outstanding load or a full store buffer.
+    // This is the TMA Memory_Bound ratio with the few-uops-executed term
+    // reduced to its 1_PORTS_UTIL part, leaving out the 2_PORTS_UTIL cycles
+    // TMA weights by the retiring fraction.
+    // clang-format off
+    specs.push_back({"TD-stalls-total"    , rawType, IntelRaw(0xA3, 0x04, 4) , USER});  // CYCLE_ACTIVITY.STALLS_TOTAL
+    specs.push_back({"TD-stalls-mem"      , rawType, IntelRaw(0xA3, 0x14, 20), USER});  // CYCLE_ACTIVITY.STALLS_MEM_ANY
+    specs.push_back({"TD-bound-on-stores" , rawType, IntelRaw(0xA6, 0x40)    , USER});  // EXE_ACTIVITY.BOUND_ON_STORES
+    specs.push_back({"TD-one-port-util"   , rawType, IntelRaw(0xA6, 0x02)    , USER});  // EXE_ACTIVITY.1_PORTS_UTIL
+    // clang-format on
+    AddMetric("Memory-Bound",
+              "Backend-Bound * (TD-stalls-mem + TD-bound-on-stores) / "
+              "(TD-stalls-total + TD-one-port-util + TD-bound-on-stores)");
+    AddMetric("Core-Bound", "Backend-Bound - Memory-Bound");
+  }
+
+  if (host.hybrid)
+    std::cerr << "Top-down events are only counted on P-cores. Pin the "
+                 "process to a P-core for complete results."
+              << std::endl;
+
+  RegisterCounterSet(specs);
+
+  if (events.size() == 0) {
+    names.resize(0);
+    throw std::runtime_error(
+        "No counter is available. Please check your code/system!");
+  }
+}
+
+};  // namespace KProf
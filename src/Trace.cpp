@@ -0,0 +1,403 @@
+#include "Trace.hpp"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "DerivedMetrics.hpp"
+#include "Sink.hpp"
+
+namespace KProf {
+
+// the tracer this thread recorded into last, and its buffer there
+struct ThreadCache {
+  uint64_t tracer = 0;
+  void* buffer = nullptr;
+};
+thread_local ThreadCache threadCache;
+std::atomic<uint64_t> nextTracerId = 1;
+
+KProfTracer::KProfTracer(const TraceOptions& _options)
+    : options(_options),
+      id(nextTracerId++),
+      epoch(std::chrono::high_resolution_clock::now()) {}
+
+KProfTracer::~KProfTracer() {
+  if (!options.file.empty()) Export();
+  auto dropped = GetDropped();
+  if (dropped)
+    std::cerr << dropped
+              << " region(s) were not traced because a thread's buffer was "
+                 "full. Increase TraceOptions::eventsPerThread."
+              << std::endl;
+}
+
+KProfTracer::ThreadBuffer& KProfTracer::GetThreadBuffer() {
+  if (threadCache.tracer == id)
+    return *static_cast<ThreadBuffer*>(threadCache.buffer);
+
+  auto tid = static_cast<pid_t>(syscall(SYS_gettid));
+  std::lock_guard<std::mutex> guard(lock);
+  ThreadBuffer* buffer = nullptr;
+  for (auto& candidate : buffers)
+    if (candidate->tid == tid) buffer = candidate.get();
+  if (!buffer) {
+    auto created = std::make_unique<ThreadBuffer>();
+    created->tid = tid;
+    created->records =
+        std::make_unique<TraceRecord[]>(options.eventsPerThread);
+    buffer = created.get();
+    buffers.push_back(std::move(created));
+  }
+  threadCache = {id, buffer};
+  return *buffer;
+}
+
+uint32_t KProfTracer::GetSchema(ThreadBuffer& buffer, KProfEvent& monitor) {
+  // a monitor keeps its counter set until it adopts a reloaded one, so it
+  // is only looked up once per monitor and set, also when a thread
+  // alternates between several monitors
+  auto generation = monitor.GetGeneration();
+  for (auto& cached : buffer.schemaCache)
+    if (cached.monitor == &monitor && cached.generation == generation)
+      return cached.schema;
+
+  Schema schema{monitor.GetCounterNames(), monitor.GetMetricDefinitions()};
+  std::lock_guard<std::mutex> guard(lock);
+  uint32_t index = 0;
+  while (index < schemas.size() &&
+         (schemas[index].counters != schema.counters ||
+          schemas[index].metrics != schema.metrics))
+    ++index;
+  if (index == schemas.size()) schemas.push_back(schema);
+
+  buffer.schemaCache[buffer.nextCacheSlot] = {&monitor, generation, index};
+  buffer.nextCacheSlot = (buffer.nextCacheSlot + 1) % kSchemaCacheSize;
+  return index;
+}
+
+bool KProfTracer::Record(const char* name, KProfEvent& monitor) {
+  auto& buffer = GetThreadBuffer();
+  auto index = buffer.count.load(std::memory_order_relaxed);
+  if (index == options.eventsPerThread) {
+    buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  auto& record = buffer.records[index];
+  record.name = name;
+  record.begin = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     monitor.GetStartTime() - epoch)
+                     .count();
+  record.end = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   monitor.GetStopTime() - epoch)
+                   .count();
+  record.schema = GetSchema(buffer, monitor);
+  record.numValues =
+      static_cast<uint32_t>(monitor.ReadCounts(record.values, kTraceValues));
+  // publishes the record to a concurrent Export()
+  buffer.count.store(index + 1, std::memory_order_release);
+  return true;
+}
+
+uint64_t KProfTracer::GetDropped() {
+  std::lock_guard<std::mutex> guard(lock);
+  uint64_t dropped = 0;
+  for (auto& buffer : buffers) dropped += buffer->dropped.load();
+  return dropped;
+}
+
+std::vector<KProfTracer::ThreadTrace> KProfTracer::Snapshot() {
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<ThreadTrace> traces;
+  for (auto& buffer : buffers) {
+    auto count = buffer->count.load(std::memory_order_acquire);
+    traces.push_back({buffer->tid, {buffer->records.get(),
+                                    buffer->records.get() + count}});
+  }
+  return traces;
+}
+
+std::vector<std::vector<double>> KProfTracer::EvaluateMetrics(
+    const ThreadTrace& trace) {
+  // the metrics are compiled again against the recorded counters, those
+  // using other report entries (e.g. energy) cannot be evaluated
+  std::vector<std::vector<KProfMetric>> programs(schemas.size());
+  std::vector<std::vector<bool>> bound(schemas.size());
+  for (size_t s = 0; s < schemas.size(); ++s) {
+    auto labels = schemas[s].counters;
+    labels.push_back("Wall-time");
+    for (auto& [name, expression] : schemas[s].metrics) {
+      programs[s].emplace_back(name, expression);
+      bound[s].push_back(programs[s].back().Bind(labels));
+      labels.push_back(name);
+    }
+  }
+
+  std::vector<std::vector<double>> values;
+  std::vector<double> inputs;
+  for (auto& record : trace.records) {
+    auto& schema = schemas[record.schema];
+    auto numCounters = schema.counters.size();
+    inputs.assign(numCounters + 1 + schema.metrics.size(), NAN);
+    for (size_t i = 0; i < std::min<size_t>(record.numValues, numCounters); ++i)
+      inputs[i] = static_cast<double>(record.values[i]);
+    inputs[numCounters] = static_cast<double>(record.end - record.begin);
+
+    std::vector<double> metrics(schema.metrics.size(), NAN);
+    for (size_t m = 0; m < metrics.size(); ++m) {
+      if (bound[record.schema][m])
+        metrics[m] = programs[record.schema][m].Evaluate(inputs.data());
+      inputs[numCounters + 1 + m] = metrics[m];
+    }
+    values.push_back(metrics);
+  }
+  return values;
+}
+
+void KProfTracer::WriteChrome(std::ostream& out,
+                              const std::vector<ThreadTrace>& traces) {
+  // timestamps are microseconds, with the nanoseconds as decimals
+  auto micros = [](uint64_t ns) {
+    std::stringstream ts;
+    ts << ns / 1000 << "." << std::setw(3) << std::setfill('0') << ns % 1000;
+    return ts.str();
+  };
+
+  auto pid = getpid();
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  auto separator = [&]() {
+    if (!first) out << ",";
+    out << "\n";
+    first = false;
+  };
+
+  for (auto& trace : traces) {
+    auto metricValues = EvaluateMetrics(trace);
+    for (size_t r = 0; r < trace.records.size(); ++r) {
+      auto& record = trace.records[r];
+      auto& schema = schemas[record.schema];
+
+      separator();
+      out << "{\"name\":" << JsonString(record.name)
+          << ",\"cat\":\"kprof\",\"ph\":\"X\",\"pid\":" << pid
+          << ",\"tid\":" << trace.tid << ",\"ts\":" << micros(record.begin)
+          << ",\"dur\":" << micros(record.end - record.begin)
+          << ",\"args\":{";
+      for (size_t i = 0; i < record.numValues; ++i)
+        out << (i ? "," : "") << JsonString(schema.counters[i]) << ":"
+            << record.values[i];
+      out << "}}";
+
+      // counter tracks hold the value for the region and drop to zero
+      // after it
+      for (size_t m = 0; m < schema.metrics.size(); ++m) {
+        auto value = metricValues[r][m];
+        if (!std::isfinite(value)) continue;
+        auto track = JsonString(schema.metrics[m].first + " (tid " +
+                                std::to_string(trace.tid) + ")");
+        for (auto [ts, sample] :
+             {std::pair{record.begin, value}, std::pair{record.end, 0.0}}) {
+          separator();
+          out << "{\"name\":" << track << ",\"ph\":\"C\",\"pid\":" << pid
+              << ",\"tid\":" << trace.tid << ",\"ts\":" << micros(ts)
+              << ",\"args\":{\"value\":" << std::setprecision(17) << sample
+              << "}}";
+        }
+      }
+    }
+  }
+  out << "\n]}" << std::endl;
+}
+
+// Minimal protobuf encoder for the few Perfetto messages written below
+class ProtoMessage {
+ public:
+  void Varint(uint32_t field, uint64_t value) {
+    Key(field, 0);
+    PutVarint(value);
+  }
+  void Double(uint32_t field, double value) {
+    Key(field, 1);
+    char raw[8];
+    memcpy(raw, &value, sizeof(raw));  // little endian on every target
+    bytes.append(raw, sizeof(raw));
+  }
+  void String(uint32_t field, const std::string& value) {
+    Key(field, 2);
+    PutVarint(value.size());
+    bytes += value;
+  }
+  void Message(uint32_t field, const ProtoMessage& message) {
+    String(field, message.bytes);
+  }
+  const std::string& Bytes() const { return bytes; }
+
+ private:
+  void Key(uint32_t field, uint32_t wireType) {
+    PutVarint((static_cast<uint64_t>(field) << 3) | wireType);
+  }
+  void PutVarint(uint64_t value) {
+    while (value >= 0x80) {
+      bytes += static_cast<char>((value & 0x7F) | 0x80);
+      value >>= 7;
+    }
+    bytes += static_cast<char>(value);
+  }
+
+ private:
+  std::string bytes;
+};
+
+// field numbers from perfetto/protos/perfetto/trace/
+namespace perfetto {
+constexpr uint32_t kTracePacket = 1;  // Trace
+// TracePacket
+constexpr uint32_t kTimestamp = 8;
+constexpr uint32_t kSequenceId = 10;
+constexpr uint32_t kTrackEvent = 11;
+constexpr uint32_t kSequenceFlags = 13;
+constexpr uint32_t kTrackDescriptor = 60;
+constexpr uint64_t kIncrementalStateCleared = 1;
+// TrackDescriptor
+constexpr uint32_t kUuid = 1;
+constexpr uint32_t kTrackName = 2;
+constexpr uint32_t kThread = 4;
+constexpr uint32_t kParentUuid = 5;
+constexpr uint32_t kCounter = 8;
+// ThreadDescriptor
+constexpr uint32_t kPid = 1;
+constexpr uint32_t kTid = 2;
+// TrackEvent
+constexpr uint32_t kDebugAnnotations = 4;
+constexpr uint32_t kType = 9;
+constexpr uint32_t kTrackUuid = 11;
+constexpr uint32_t kName = 23;
+constexpr uint32_t kDoubleCounterValue = 44;
+constexpr uint64_t kSliceBegin = 1, kSliceEnd = 2, kCounterSample = 4;
+// DebugAnnotation
+constexpr uint32_t kAnnotationUint = 3;
+constexpr uint32_t kAnnotationName = 10;
+}  // namespace perfetto
+
+void KProfTracer::WritePerfetto(std::ostream& out,
+                                const std::vector<ThreadTrace>& traces) {
+  using namespace perfetto;
+  auto emit = [&](const ProtoMessage& packet) {
+    ProtoMessage wrapper;
+    wrapper.Message(kTracePacket, packet);
+    out.write(wrapper.Bytes().data(), wrapper.Bytes().size());
+  };
+
+  auto pid = getpid();
+  uint64_t nextUuid = 1;
+  for (size_t t = 0; t < traces.size(); ++t) {
+    auto& trace = traces[t];
+    // one packet sequence per thread, so each is in timestamp order
+    auto sequence = static_cast<uint32_t>(t + 1);
+
+    auto threadUuid = nextUuid++;
+    ProtoMessage thread, descriptor, packet;
+    thread.Varint(kPid, pid);
+    thread.Varint(kTid, trace.tid);
+    descriptor.Varint(kUuid, threadUuid);
+    descriptor.Message(kThread, thread);
+    packet.Varint(kSequenceId, sequence);
+    packet.Varint(kSequenceFlags, kIncrementalStateCleared);
+    packet.Message(kTrackDescriptor, descriptor);
+    emit(packet);
+
+    // a counter track per metric name on this thread
+    std::vector<std::pair<std::string, uint64_t>> counterTracks;
+    auto counterTrack = [&](const std::string& name) {
+      for (auto& [track, uuid] : counterTracks)
+        if (track == name) return uuid;
+      auto uuid = nextUuid++;
+      ProtoMessage descriptor, packet;
+      descriptor.Varint(kUuid, uuid);
+      descriptor.Varint(kParentUuid, threadUuid);
+      descriptor.String(kTrackName, name);
+      descriptor.Message(kCounter, ProtoMessage());
+      packet.Varint(kSequenceId, sequence);
+      packet.Message(kTrackDescriptor, descriptor);
+      emit(packet);
+      counterTracks.push_back({name, uuid});
+      return uuid;
+    };
+
+    auto trackEvent = [&](uint64_t ts, const ProtoMessage& event) {
+      ProtoMessage packet;
+      packet.Varint(kTimestamp, ts);
+      packet.Varint(kSequenceId, sequence);
+      packet.Message(kTrackEvent, event);
+      emit(packet);
+    };
+
+    auto metricValues = EvaluateMetrics(trace);
+    for (size_t r = 0; r < trace.records.size(); ++r) {
+      auto& record = trace.records[r];
+      auto& schema = schemas[record.schema];
+
+      ProtoMessage begin;
+      begin.Varint(kType, kSliceBegin);
+      begin.Varint(kTrackUuid, threadUuid);
+      begin.String(kName, record.name);
+      for (size_t i = 0; i < record.numValues; ++i) {
+        ProtoMessage annotation;
+        annotation.String(kAnnotationName, schema.counters[i]);
+        annotation.Varint(kAnnotationUint, record.values[i]);
+        begin.Message(kDebugAnnotations, annotation);
+      }
+      trackEvent(record.begin, begin);
+
+      for (size_t m = 0; m < schema.metrics.size(); ++m) {
+        if (!std::isfinite(metricValues[r][m])) continue;
+        ProtoMessage sample;
+        sample.Varint(kType, kCounterSample);
+        sample.Varint(kTrackUuid, counterTrack(schema.metrics[m].first));
+        sample.Double(kDoubleCounterValue, metricValues[r][m]);
+        trackEvent(record.begin, sample);
+      }
+
+      ProtoMessage end;
+      end.Varint(kType, kSliceEnd);
+      end.Varint(kTrackUuid, threadUuid);
+      trackEvent(record.end, end);
+
+      for (size_t m = 0; m < schema.metrics.size(); ++m) {
+        if (!std::isfinite(metricValues[r][m])) continue;
+        ProtoMessage sample;
+        sample.Varint(kType, kCounterSample);
+        sample.Varint(kTrackUuid, counterTrack(schema.metrics[m].first));
+        sample.Double(kDoubleCounterValue, 0.0);
+        trackEvent(record.end, sample);
+      }
+    }
+  }
+}
+
+void KProfTracer::Export(const std::string& filename, TraceFormat format) {
+  auto traces = Snapshot();
+
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Error opening file: " << filename << std::endl;
+    return;
+  }
+
+  // threads meeting a new counter set wait for the export to finish
+  std::lock_guard<std::mutex> guard(lock);
+  if (format == TraceFormat::PERFETTO)
+    WritePerfetto(file, traces);
+  else
+    WriteChrome(file, traces);
+}
+
+};  // namespace KProf
@@ -0,0 +1,352 @@
+#include "Uncore.hpp"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+
+#include "HostInfo.hpp"
+#include "PmuSysfs.hpp"
+
+namespace KProf {
+
+inline double UnitBytes(const std::string& unit) {
+  if (unit == "KiB") return 1024.0;
+  if (unit == "MiB") return 1024.0 * 1024.0;
+  if (unit == "GiB") return 1024.0 * 1024.0 * 1024.0;
+  if (unit == "MB") return 1e6;
+  if (unit == "GB") return 1e9;
+  if (unit == "64Bytes") return 64.0;
+  return 1.0;  // Bytes, or no unit
+}
+
+inline int PackageOf(int cpu) {
+  for (auto& entry : GetTopology())
+    if (entry.cpu == cpu) return entry.package;
+  return -1;
+}
+
+int OpenSystemWide(int type, uint64_t config, int cpu, uint64_t readFormat) {
+  // uncore events support neither exclusions nor inheritance, and stay
+  // enabled from here on
+  perf_event_attr pe;
+  memset(&pe, 0, sizeof(struct perf_event_attr));
+  pe.type = static_cast<uint32_t>(type);
+  pe.size = sizeof(struct perf_event_attr);
+  pe.config = config;
+  pe.read_format = readFormat;
+  return static_cast<int>(syscall(SYS_perf_event_open, &pe, -1, cpu, -1, 0));
+}
+
+KProfMemoryCounters::KProfMemoryCounters() {
+  auto& host = GetHostInfo();
+
+  if (host.IsIntel()) {
+    // event pairs exported by the server, client and free running IMCs
+    const std::pair<const char*, const char*> casEvents[] = {
+        {"cas_count_read", "cas_count_write"},
+        {"data_reads", "data_writes"},
+        {"data_read", "data_write"},
+        {"read", "write"}};
+    // the free running counters see the same traffic, never use both
+    for (auto freeRunning : {false, true}) {
+      if (Available()) break;
+      for (auto& pmu : FindPmus("uncore_imc")) {
+        if ((pmu.find("free_running") != std::string::npos) != freeRunning)
+          continue;
+        for (auto& [read, write] : casEvents)
+          if (OpenNamed(pmu, read, write)) break;
+      }
+    }
+  } else if (host.IsAMD() && host.IsZen4OrLater()) {
+    // umc_cas_cmd.rd and umc_cas_cmd.wr, one UMC PMU per channel
+    for (auto& pmu : FindPmus("amd_umc_")) {
+      uint64_t read, write;
+      if (PmuEncodeTerms(pmu, "event=0x0a,rdwrmask=0x1", read) &&
+          PmuEncodeTerms(pmu, "event=0x0a,rdwrmask=0x2", write)) {
+        Open(pmu, read, READ, 64.0);
+        Open(pmu, write, WRITE, 64.0);
+      }
+    }
+  } else if (host.IsAMD() && host.family >= 0x17) {
+    // dram_channel_data_controller_0..7 count 64 byte beats, both ways
+    for (uint64_t channel = 0; channel < 8; ++channel) {
+      uint64_t config;
+      auto terms = "event=" + std::to_string(0x07 | (channel << 6)) +
+                   ",umask=0x38";
+      if (PmuEncodeTerms("amd_df", terms, config))
+        Open("amd_df", config, BOTH, 64.0);
+    }
+  }
+
+  if (!Available())
+    std::cerr << "No memory controller counters could be opened on "
+              << host.modelName << ". Memory traffic is not reported."
+              << std::endl;
+}
+
+KProfMemoryCounters::~KProfMemoryCounters() {
+  for (auto& counter : counters) close(counter.fd);
+}
+
+bool KProfMemoryCounters::OpenNamed(const std::string& pmu,
+                                    const std::string& read,
+                                    const std::string& write) {
+  uint64_t readConfig, writeConfig;
+  if (!PmuEventConfig(pmu, read, readConfig) ||
+      !PmuEventConfig(pmu, write, writeConfig))
+    return false;
+
+  // counts are CAS commands unless the kernel says otherwise
+  auto bytesPerCount = [&](const std::string& event) {
+    double scale;
+    std::string unit;
+    if (!PmuEventScale(pmu, event, scale, unit)) return 64.0;
+    return scale * UnitBytes(unit);
+  };
+  Open(pmu, readConfig, READ, bytesPerCount(read));
+  Open(pmu, writeConfig, WRITE, bytesPerCount(write));
+  return true;
+}
+
+void KProfMemoryCounters::Open(const std::string& pmu, uint64_t config,
+                               Direction direction, double bytesPerCount) {
+  auto type = PmuType(pmu);
+  if (type == -1) return;
+
+  auto cpus = PmuCpumask(pmu);
+  if (cpus.empty()) cpus.push_back(0);
+  for (auto cpu : cpus) {
+    int fd = OpenSystemWide(
+        type, config, cpu,
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING);
+    if (fd < 0) {
+      std::cerr << "Error " << errno << " opening " << pmu << " on CPU "
+                << cpu << ": " << strerror(errno)
+                << ". Ignoring this counter on the current system."
+                << std::endl;
+      continue;
+    }
+
+    Counter counter;
+    counter.pmu = pmu;
+    counter.fd = fd;
+    counter.package = PackageOf(cpu);
+    counter.direction = direction;
+    counter.bytesPerCount = bytesPerCount;
+    counters.push_back(counter);
+  }
+}
+
+KProfMemoryCounters::Reading KProfMemoryCounters::ReadCounter(int fd) {
+  Reading reading;
+  if (read(fd, &reading, sizeof(reading)) != sizeof(reading)) return Reading();
+  return reading;
+}
+
+std::vector<std::string> KProfMemoryCounters::GetPmus() const {
+  std::vector<std::string> pmus;
+  for (auto& counter : counters)
+    if (std::find(pmus.begin(), pmus.end(), counter.pmu) == pmus.end())
+      pmus.push_back(counter.pmu);
+  return pmus;
+}
+
+void KProfMemoryCounters::Start() {
+  for (auto& counter : counters) counter.start = ReadCounter(counter.fd);
+}
+
+void KProfMemoryCounters::Stop() {
+  for (auto& counter : counters) {
+    auto end = ReadCounter(counter.fd);
+    counter.delta = end.value - counter.start.value;
+    // extrapolated to the whole region if the counter was multiplexed
+    auto enabled = end.enabled - counter.start.enabled;
+    auto running = end.running - counter.start.running;
+    if (running && running < enabled)
+      counter.delta = static_cast<uint64_t>(
+          static_cast<double>(counter.delta) * enabled / running);
+  }
+}
+
+std::vector<SocketTraffic> KProfMemoryCounters::GetTraffic() const {
+  std::map<int, SocketTraffic> packages;
+  for (auto& counter : counters) {
+    auto& traffic = packages[counter.package];
+    traffic.package = counter.package;
+    auto bytes = static_cast<uint64_t>(counter.delta * counter.bytesPerCount);
+    switch (counter.direction) {
+      case READ:
+        traffic.bytesRead += bytes;
+        break;
+      case WRITE:
+        traffic.bytesWritten += bytes;
+        break;
+      case BOTH:
+        // attributed to reads, the split is unknown
+        traffic.bytesRead += bytes;
+        traffic.split = false;
+        break;
+    }
+  }
+
+  std::vector<SocketTraffic> traffic;
+  for (auto& [package, socket] : packages) traffic.push_back(socket);
+  return traffic;
+}
+
+// RAPL domains and the name of their zones under /sys/class/powercap
+const std::pair<const char*, const char*> kEnergyDomains[] = {
+    {"energy-pkg", "package-"},
+    {"energy-cores", "core"},
+    {"energy-ram", "dram"},
+    {"energy-gpu", "uncore"},
+    {"energy-psys", "psys"}};
+
+const std::string powercapRoot = "/sys/class/powercap/";
+
+KProfEnergyCounters::KProfEnergyCounters(
+    const std::vector<std::pair<std::string, std::string>>& domains) {
+  auto requested = domains;
+  bool explicitDomains = !requested.empty();
+  if (!explicitDomains)
+    for (auto& [event, zone] : kEnergyDomains)
+      // energy-pkg -> Energy-pkg
+      requested.push_back({"E" + std::string(event + 1), event});
+
+  for (auto& [label, event] : requested) {
+    auto domain = readings.size();
+    readings.push_back({label, event, 0.0});
+    if (OpenPerf(domain, event) || OpenPowercap(domain, event)) continue;
+
+    readings.pop_back();
+    if (explicitDomains)
+      std::cerr << "Energy domain " << event
+                << " is not available on this system. Ignoring it."
+                << std::endl;
+  }
+
+  if (!Available())
+    std::cerr << "Neither the RAPL power PMU nor " << powercapRoot
+              << "intel-rapl is available on " << GetHostInfo().modelName
+              << ". Energy is not reported." << std::endl;
+}
+
+KProfEnergyCounters::~KProfEnergyCounters() {
+  for (auto& counter : counters)
+    if (counter.fd >= 0) close(counter.fd);
+}
+
+bool KProfEnergyCounters::OpenPerf(size_t domain, const std::string& event) {
+  auto type = PmuType("power");
+  uint64_t config;
+  if (type == -1 || !PmuEventConfig("power", event, config)) return false;
+
+  Counter counter;
+  counter.domain = domain;
+  // the unit is always Joules, the scale 2^-32 on current parts
+  std::string unit;
+  if (!PmuEventScale("power", event, counter.scale, unit))
+    counter.scale = 2.3283064365386962890625e-10;
+
+  // one CPU per package, whose energy is summed
+  auto cpus = PmuCpumask("power");
+  if (cpus.empty()) cpus.push_back(0);
+  std::vector<Counter> opened;
+  for (auto cpu : cpus) {
+    counter.fd = OpenSystemWide(type, config, cpu);
+    if (counter.fd < 0) {
+      std::cerr << "Error " << errno << " opening " << event << " on CPU "
+                << cpu << ": " << strerror(errno)
+                << ". Trying powercap instead." << std::endl;
+      for (auto& partial : opened) close(partial.fd);
+      return false;
+    }
+    opened.push_back(counter);
+  }
+  counters.insert(counters.end(), opened.begin(), opened.end());
+  return true;
+}
+
+bool KProfEnergyCounters::OpenPowercap(size_t domain,
+                                       const std::string& event) {
+  std::string zone;
+  for (auto& [name, prefix] : kEnergyDomains)
+    if (event == name) zone = prefix;
+  if (zone.empty()) return false;
+
+  // intel-rapl:N are packages (and psys), intel-rapl:N:M their subzones
+  bool found = false;
+  std::error_code error;
+  for (auto& entry :
+       std::filesystem::directory_iterator(powercapRoot, error)) {
+    auto dir = entry.path().string() + "/";
+    if (entry.path().filename().string().rfind("intel-rapl:", 0) != 0)
+      continue;
+    if (ReadSysfs(dir + "name").rfind(zone, 0) != 0) continue;
+
+    Counter counter;
+    counter.domain = domain;
+    counter.path = dir + "energy_uj";
+    counter.scale = 1e-6;
+    try {
+      counter.range = std::stoull(ReadSysfs(dir + "max_energy_range_uj"));
+    } catch (std::exception&) {
+      counter.range = 0;
+    }
+    if (ReadSysfs(counter.path).empty()) {
+      std::cerr << "Cannot read " << counter.path
+                << ". Reading energy_uj usually requires root." << std::endl;
+      continue;
+    }
+    counters.push_back(counter);
+    found = true;
+  }
+  return found;
+}
+
+uint64_t KProfEnergyCounters::ReadCounter(const Counter& counter) const {
+  if (counter.fd >= 0) {
+    uint64_t value = 0;
+    if (read(counter.fd, &value, sizeof(value)) != sizeof(value)) return 0;
+    return value;
+  }
+  try {
+    return std::stoull(ReadSysfs(counter.path));
+  } catch (std::exception&) {
+    return 0;
+  }
+}
+
+void KProfEnergyCounters::Start() {
+  for (auto& counter : counters) counter.start = ReadCounter(counter);
+}
+
+void KProfEnergyCounters::Stop() {
+  for (auto& counter : counters) {
+    auto end = ReadCounter(counter);
+    // The kernel widens the 32-bit RAPL registers behind the power PMU to
+    // 64 bits, but energy_uj wraps at max_energy_range_uj. A region longer
+    // than one wrap (hours at typical package power) cannot be told apart.
+    if (end >= counter.start)
+      counter.delta = end - counter.start;
+    else
+      counter.delta = counter.range ? counter.range - counter.start + end : 0;
+  }
+}
+
+std::vector<EnergyReading> KProfEnergyCounters::GetEnergy() const {
+  auto energy = readings;
+  for (auto& reading : energy) reading.joules = 0.0;
+  for (auto& counter : counters)
+    energy[counter.domain].joules += counter.delta * counter.scale;
+  return energy;
+}
+
+};  // namespace KProf
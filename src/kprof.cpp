@@ -1,5 +1,7 @@
 #include "kprof.hpp"
 
+#include <sched.h>  // for sched_getcpu
+
 #include <algorithm>  // for std::find
 #include <cstdlib>
 #include <fstream>
@@ -40,7 +42,7 @@ void KProfEvent::RegisterCounter(const std::string& name, int& leader_FD,
   bool secondCallWasNeeded = false;
 
   event.fd = static_cast<int>(
-      syscall(SYS_perf_event_open, &event.pe, 0, -1, leader_FD, 0));
+      syscall(SYS_perf_event_open, &event.pe, target, -1, leader_FD, 0));
   if (event.fd < 0) {
     if ((errno == 22) || (errno == ENOSPC)) {
       std::cerr << "Could not open " << name
@@ -48,7 +50,7 @@ void KProfEvent::RegisterCounter(const std::string& name, int& leader_FD,
                    "Re-attempting as leader."
                 << std::endl;
       event.fd = static_cast<int>(
-          syscall(SYS_perf_event_open, &event.pe, 0, -1, -1, 0));
+          syscall(SYS_perf_event_open, &event.pe, target, -1, -1, 0));
       secondCallWasNeeded = true;
       event.isLeader = true;
     }
@@ -57,42 +59,44 @@ void KProfEvent::RegisterCounter(const std::string& name, int& leader_FD,
                 << DescribeError(errno)
                 << ". Ignoring this counter on the current system. "
                 << std::endl;
+      return;
     }
-  } else {
-    if (event.isLeader) {
-      event.leaderFD = event.fd;
-      leader_FD = event.fd;  // send this to the next call to RegisterCounter
-      // set the id of this thing to whatever we need, and set contained objects
-      // to 1
-      event.numCounters = 1;
-      leaderFDs.push_back(event.fd);
+  }
+  // a counter re-opened above starts a new group, which the following
+  // counters will then join
+  if (event.isLeader) {
+    event.leaderFD = event.fd;
+    leader_FD = event.fd;  // send this to the next call to RegisterCounter
+    // set the id of this thing to whatever we need, and set contained objects
+    // to 1
+    event.numCounters = 1;
+    leaderFDs.push_back(event.fd);
 
-    } else {
-      event.leaderFD = leader_FD;
-      // this is not the leader -> find it!
-      for (auto i = 0; i < events.size(); ++i) {
-        if (events[i].fd == leader_FD) {
-          events[i].numCounters++;
-          break;
-        }
+  } else {
+    event.leaderFD = leader_FD;
+    // this is not the leader -> find it!
+    for (auto i = 0; i < events.size(); ++i) {
+      if (events[i].fd == leader_FD) {
+        events[i].numCounters++;
+        break;
       }
     }
-    // we managed to get the event, so syscall for its id
-    auto ret = ioctl(event.fd, PERF_EVENT_IOC_ID, &event.id);
-    if (ret == -1) {
-      std::stringstream errmsg;
-      errmsg << "PERF_EVENT_IOC_ID failed for " << name << "! : " << errno
-             << " " << DescribeError_IOCTL(errno);
-      throw std::runtime_error(errmsg.str());
-    }
-
-    events.push_back(event);
-    names.push_back(name);
-    // event was successfully added
   }
+  // we managed to get the event, so syscall for its id
+  auto ret = ioctl(event.fd, PERF_EVENT_IOC_ID, &event.id);
+  if (ret == -1) {
+    std::stringstream errmsg;
+    errmsg << "PERF_EVENT_IOC_ID failed for " << name << "! : " << errno
+           << " " << DescribeError_IOCTL(errno);
+    throw std::runtime_error(errmsg.str());
+  }
+
+  events.push_back(event);
+  names.push_back(name);
+  // event was successfully added
 }
 
-void KProfEvent::StartCounters() {
+void KProfEvent::EnableCounters() {
   // could use a std::for_each but we need the index.
   // TODO: Define an enumerate()?
   // for (size_t i = 0; i < events.size(); i++) {
@@ -117,6 +121,10 @@ void KProfEvent::StartCounters() {
   //   }
   // }
 
+  ReadSentinels(sentinelStart);
+  if (memory) memory->Start();
+  if (energy) energy->Start();
+
   for (auto& fd : leaderFDs) {
     auto ret = ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
     if (ret == -1) {
@@ -223,6 +231,82 @@ void KProfEvent::StopCounters() {
       }
     }
   }
+
+  if (memory) memory->Stop();
+  if (energy) energy->Stop();
+
+  uint64_t sentinelStop[3];
+  ReadSentinels(sentinelStop);
+  disturbances.contextSwitches = sentinelStop[0] - sentinelStart[0];
+  disturbances.migrations = (sentinelMode == SENTINELS_RUSAGE)
+                                ? (sentinelStop[1] != sentinelStart[1])
+                                : sentinelStop[1] - sentinelStart[1];
+  disturbances.majorFaults = sentinelStop[2] - sentinelStart[2];
+}
+
+void KProfEvent::OpenSentinels() {
+  // KPROF_SENTINELS=0 switches contamination tracking off
+  const char* value = getenv("KPROF_SENTINELS");
+  if (value && std::string(value) == "0") return;
+
+  // these are kernel-side events, so they need exclude_kernel = 0
+  const uint64_t configs[3] = {PERF_COUNT_SW_CONTEXT_SWITCHES,
+                               PERF_COUNT_SW_CPU_MIGRATIONS,
+                               PERF_COUNT_SW_PAGE_FAULTS_MAJ};
+  for (int i = 0; i < 3; ++i) {
+    perf_event_attr pe;
+    memset(&pe, 0, sizeof(struct perf_event_attr));
+    pe.type = PERF_TYPE_SOFTWARE;
+    pe.size = sizeof(struct perf_event_attr);
+    pe.config = configs[i];
+    pe.exclude_hv = 1;
+    pe.read_format = PERF_FORMAT_ID | PERF_FORMAT_GROUP;
+    // free running, regions take the difference of two reads
+    sentinelFDs[i] = static_cast<int>(
+        syscall(SYS_perf_event_open, &pe, 0, -1, sentinelFDs[0], 0));
+    if (sentinelFDs[i] < 0 ||
+        ioctl(sentinelFDs[i], PERF_EVENT_IOC_ID, &sentinelIDs[i]) == -1) {
+      // typically perf_event_paranoid > 1: fall back to getrusage()
+      for (auto& fd : sentinelFDs) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+      }
+      sentinelMode = SENTINELS_RUSAGE;
+      return;
+    }
+  }
+  sentinelMode = SENTINELS_PERF;
+}
+
+void KProfEvent::ReadSentinels(uint64_t* values) {
+  switch (sentinelMode) {
+    case SENTINELS_PERF: {
+      ReadFormat tmp;
+      if (read(sentinelFDs[0], &tmp, sizeof(tmp)) < 0) {
+        std::stringstream errmsg;
+        errmsg << "Read() error: " << errno << ": " << strerror(errno)
+               << std::endl;
+        throw std::runtime_error(errmsg.str());
+      }
+      for (int i = 0; i < 3; ++i)
+        for (uint64_t k = 0; k < tmp.nr; k++)
+          if (tmp.values[k].id == sentinelIDs[i])
+            values[i] = tmp.values[k].value;
+      break;
+    }
+    case SENTINELS_RUSAGE: {
+      // a migration that returns to the same CPU goes unnoticed here
+      rusage usage;
+      getrusage(RUSAGE_THREAD, &usage);
+      values[0] = usage.ru_nvcsw + usage.ru_nivcsw;
+      values[1] = static_cast<uint64_t>(sched_getcpu());  // not a count
+      values[2] = usage.ru_majflt;
+      break;
+    }
+    case SENTINELS_OFF:
+      values[0] = values[1] = values[2] = 0;
+      break;
+  }
 }
 
 uint64_t KProfEvent::GetCounter(const std::string& name) {
@@ -231,10 +315,52 @@ uint64_t KProfEvent::GetCounter(const std::string& name) {
   return -1;
 }
 
+std::vector<KProfCounter> KProfEvent::ReadSystemWide() {
+  // memory controller traffic and energy, for the whole system
+  std::vector<KProfCounter> entries;
+  auto seconds = GetDuration() / 1e9;
+  auto addRate = [&](const std::string& label, double amount) {
+    entries.push_back(KProfCounter(label, 0));
+    entries.back().SetValue(seconds > 0.0 ? amount / seconds : 0.0);
+  };
+
+  if (memory) {
+    for (auto& socket : memory->GetTraffic()) {
+      auto suffix = "-S" + std::to_string(socket.package);
+      auto addTraffic = [&](const std::string& label, uint64_t bytes) {
+        entries.push_back(KProfCounter("IMC-" + label + "bytes" + suffix, bytes));
+        addRate("IMC-" + label + "GBps" + suffix, bytes / 1e9);
+      };
+      if (socket.split) {
+        addTraffic("read-", socket.bytesRead);
+        addTraffic("write-", socket.bytesWritten);
+      } else {
+        addTraffic("", socket.Bytes());
+      }
+    }
+  }
+
+  if (energy) {
+    for (auto& reading : energy->GetEnergy()) {
+      entries.push_back(KProfCounter(reading.label, 0));
+      entries.back().SetValue(reading.joules);
+      addRate(reading.label + "-W", reading.joules);
+    }
+  }
+  return entries;
+}
+
 std::vector<KProfCounter> KProfEvent::GetReport(
     bool overheadCorrection = false) {
-  std::vector<KProfCounter> report(names.size() + 1);
-  for (size_t i = 0; i < report.size() - 1; ++i) {
+  // raw counters, the wall time and the system-wide readings come first,
+  // derived metrics follow
+  auto numCounted = names.size() + 1;
+  // taken before the overhead run below replaces them
+  auto systemWide = ReadSystemWide();
+  auto numRaw = numCounted + systemWide.size();
+
+  std::vector<KProfCounter> report(numRaw + metrics.size());
+  for (size_t i = 0; i < numCounted - 1; ++i) {
     std::string name = names[i];
     auto count = GetCounter(names[i]);
     report[i].SetName(name);
@@ -242,35 +368,57 @@ std::vector<KProfCounter> KProfEvent::GetReport(
   }
   report[names.size()].SetName("Wall-time");
   report[names.size()].SetCount(GetDuration());
+  std::copy(systemWide.begin(), systemWide.end(), report.begin() + numCounted);
 
+  // system-wide readings include everybody else's activity, so only the
+  // counters of this thread are corrected
   if (overheadCorrection) {
     auto overhead = GetOverhead();
-    for (size_t i = 0; i < report.size(); ++i)
+    for (size_t i = 0; i < numCounted; ++i)
       report[i].SetCount(report[i].GetCount() - overhead[i].GetCount());
   }
+
+  // metrics are evaluated on the (possibly corrected) raw counts, in order,
+  // so that a metric can use the ones defined before it
+  if (!metrics.empty())
+    for (size_t i = 0; i < numRaw; ++i)
+      metricInputs[i] = report[i].IsDerived() ? report[i].GetValue()
+                                              : report[i].GetCount();
+  for (size_t i = 0; i < metrics.size(); ++i) {
+    auto value = metrics[i].Evaluate(metricInputs.data());
+    metricInputs[numRaw + i] = value;
+    report[numRaw + i].SetName(metrics[i].GetName());
+    report[numRaw + i].SetValue(value);
+  }
   return report;
 }
 
 void KProfEvent::PrintReport() {
-  for (size_t i = 0; i < names.size(); ++i) {
-    std::cout << std::format("{} : {}", names[i],
-                             (long long)GetCounter(names[i]))
-              << std::endl;
-  }
-  return;
+  // the metrics' inputs are laid out by GetReport(), system-wide entries
+  // included
+  PrintReport(GetReport(false));
 }
 
 void KProfEvent::PrintReport(std::vector<KProfCounter> report) {
   for (size_t i = 0; i < report.size(); ++i) {
-    std::cout << std::format("{} : {}", report[i].GetName(),
-                             (long long)report[i].GetCount())
-              << std::endl;
+    if (report[i].IsDerived())
+      std::cout << std::format("{} : {}", report[i].GetName(),
+                               report[i].GetValue())
+                << std::endl;
+    else
+      std::cout << std::format("{} : {}", report[i].GetName(),
+                               (long long)report[i].GetCount())
+                << std::endl;
   }
   return;
 }
 
 KProfEvent::KProfEvent() {
+  owner = static_cast<pid_t>(syscall(SYS_gettid));
+  OpenSentinels();
+
   // first, check the environment config
+  if (typeMap.empty()) ConstructTypeMap();
 
   std::string parsedEnvString;
   bool found;
@@ -288,6 +436,18 @@ KProfEvent::KProfEvent() {
   }
   if (found) return;  // we did things we were meant to, leave.
 
+  // KPROF_TOPDOWN=1 or 2 selects the built-in top-down analysis
+  const char* topdown = getenv("KPROF_TOPDOWN");
+  if (topdown && *topdown) {
+    std::string level(topdown);
+    if (level == "1" || level == "2") {
+      ConfigureTopdown(level == "2" ? TOPDOWN_L2 : TOPDOWN_L1);
+      return;
+    }
+    std::cerr << "Invalid KPROF_TOPDOWN=" << level
+              << ", expected 1 or 2. Ignoring it." << std::endl;
+  }
+
   // i can't find anything - default set should be initialized
 
   // prevent formatter from messing with this
@@ -348,19 +508,74 @@ KProfEvent::KProfEvent() {
 }
 
 KProfEvent::KProfEvent(const std::string& configFile) {
+  owner = static_cast<pid_t>(syscall(SYS_gettid));
+  OpenSentinels();
   if (typeMap.empty()) ConstructTypeMap();
   ReadCounterList(configFile);
 }
 
+KProfEvent::KProfEvent(TopdownLevel level) {
+  owner = static_cast<pid_t>(syscall(SYS_gettid));
+  OpenSentinels();
+  ConfigureTopdown(level);
+}
+
+KProfEvent::KProfEvent(const std::string& configFile, pid_t _target)
+    : target(_target), owner(_target) {
+  // no sentinels, the monitor adopting the set keeps its own
+  ConstructTypeMap();
+  // ReadCounterList() only warns, but publishing an empty set would drop
+  // every counter of the monitors, e.g. while an editor replaces the file
+  if (!std::ifstream(configFile).is_open())
+    throw std::runtime_error("Error opening file: " + configFile);
+  ReadCounterList(configFile);
+  if (events.empty() && !energy)
+    throw std::runtime_error("No counter could be opened");
+}
+
+void KProfEvent::PublishConfig(KProfEvent* next) {
+  // a set published before and never adopted is superseded
+  delete pendingConfig.exchange(next, std::memory_order_acq_rel);
+}
+
+void KProfEvent::AdoptConfig() {
+  auto next = pendingConfig.exchange(nullptr, std::memory_order_acq_rel);
+  if (!next) return;
+  std::swap(events, next->events);
+  std::swap(names, next->names);
+  std::swap(leaderFDs, next->leaderFDs);
+  std::swap(metrics, next->metrics);
+  std::swap(energy, next->energy);
+  std::swap(trackingFrequency, next->trackingFrequency);
+  // the system-wide entries of this monitor shift the metric inputs
+  BindMetrics();
+  generation++;
+  // the old counters are closed by the watcher, off this thread
+  delete retiredConfig.exchange(next, std::memory_order_acq_rel);
+}
+
+void KProfEvent::ReclaimConfig() {
+  delete retiredConfig.exchange(nullptr, std::memory_order_acq_rel);
+}
+
 KProfEvent::~KProfEvent() {
+  delete pendingConfig.load();
+  delete retiredConfig.load();
   for (auto& event : events) {
     close(event.fd);
   }
+  for (auto& fd : sentinelFDs)
+    if (fd >= 0) close(fd);
 }
 
 std::vector<KProfCounter> KProfEvent::GetOverhead() {
-  StartCounters();
+  // the measured region's disturbances must survive the empty one
+  auto measured = disturbances;
+  // not StartCounters(), adopting a reloaded set here would swap the events
+  // under the report being corrected
+  EnableCounters();
   StopCounters();
+  disturbances = measured;
   return GetReport(false);
 }
 
@@ -462,9 +677,164 @@ int KProfEvent::TypeLookup(const std::string& query) {
   return -1;
 }
 
+// Splits "SPEC:domain" into the spec and the domain, which is empty if
+// there is none
+inline std::pair<std::string, std::string> SplitDomain(
+    const std::string& spec) {
+  auto colonpos = spec.rfind(':');
+  if (colonpos == std::string::npos) return {spec, ""};
+  return {spec.substr(0, colonpos), spec.substr(colonpos + 1)};
+}
+
+void KProfEvent::AddCounterSpec(std::vector<CounterSpec>& specs,
+                                const std::string& name, int type,
+                                uint64_t config, const std::string& domain) {
+  if (domain == "u/k") {
+    // paired in one group by the metric, so the shares add up
+    specs.push_back({name + ":u", type, config, USER});
+    specs.push_back({name + ":k", type, config, KERNEL});
+    AddMetric(name + "-kernel-share",
+              name + ":k / (" + name + ":u + " + name + ":k)");
+    return;
+  }
+
+  uint8_t bits = domain.empty() ? USER : 0;
+  for (auto c : domain) {
+    if (c == 'u')
+      bits |= USER;
+    else if (c == 'k')
+      bits |= KERNEL;
+    else if (c == 'h')
+      bits |= HYPERVISOR;
+    else {
+      std::cerr << "Invalid domain " << domain << " specified for " << name
+                << ". Ignoring counter." << std::endl;
+      return;
+    }
+  }
+  specs.push_back({name, type, config, static_cast<EventDomain>(bits)});
+}
+
+void KProfEvent::AddMetric(const std::string& name,
+                           const std::string& expression) {
+  try {
+    metrics.emplace_back(name, expression);
+  } catch (std::runtime_error& e) {
+    std::cerr << e.what() << ". Ignoring metric." << std::endl;
+  }
+}
+
+inline std::string TrimSpaces(const std::string& str) {
+  auto first = str.find_first_not_of(" \t\r");
+  if (first == std::string::npos) return std::string("");
+  auto last = str.find_last_not_of(" \t\r");
+  return str.substr(first, last - first + 1);
+}
+
+void KProfEvent::RegisterCounterSet(std::vector<CounterSpec>& specs) {
+  // Group planner: counters that a metric combines are opened in a group of
+  // their own so the kernel schedules them together; the rest share one
+  // group, as before.
+  std::vector<std::string> available;
+  for (auto& spec : specs) available.push_back(spec.name);
+  auto sets = PlanCoScheduling(metrics, available);
+
+  std::vector<bool> registered(specs.size(), false);
+  for (auto& set : sets) {
+    int leader = -1;
+    for (auto& label : set) {
+      auto idx = std::find(available.begin(), available.end(), label) -
+                 available.begin();
+      registered[idx] = true;
+      RegisterCounter(specs[idx].name, leader, specs[idx].type,
+                      specs[idx].config, specs[idx].domain);
+    }
+
+    // check that the kernel did not split the set while opening it
+    int groupFD = -2;
+    for (auto& label : set)
+      for (size_t i = 0; i < names.size(); ++i)
+        if (names[i] == label) {
+          if (groupFD == -2) groupFD = events[i].leaderFD;
+          if (events[i].leaderFD != groupFD) {
+            std::cerr << "Counter " << label
+                      << " could not be co-scheduled with the other operands "
+                         "of its metrics. Their ratios may be inaccurate."
+                      << std::endl;
+          }
+        }
+  }
+
+  int leader = -1;
+  for (size_t i = 0; i < specs.size(); ++i) {
+    if (registered[i]) continue;
+    RegisterCounter(specs[i].name, leader, specs[i].type, specs[i].config,
+                    specs[i].domain);
+  }
+
+  BindMetrics();
+}
+
+void KProfEvent::TrackFrequency() {
+  // also if the counters failed to open, so the metric is not added again
+  if (trackingFrequency) return;
+  trackingFrequency = true;
+
+  std::vector<CounterSpec> specs = {
+      {"Freq-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, USER},
+      {"Freq-ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES,
+       USER}};
+  AddMetric("Frequency-ratio", "Freq-cycles / Freq-ref-cycles");
+  RegisterCounterSet(specs);
+}
+
+void KProfEvent::TrackMemoryTraffic() {
+  if (memory) return;
+  auto counters = std::make_unique<KProfMemoryCounters>();
+  if (!counters->Available()) return;
+  memory = std::move(counters);
+  BindMetrics();
+}
+
+void KProfEvent::TrackEnergy(
+    const std::vector<std::pair<std::string, std::string>>& domains) {
+  if (energy) return;
+  OpenEnergy(domains);
+  if (energy) BindMetrics();
+}
+
+void KProfEvent::OpenEnergy(
+    const std::vector<std::pair<std::string, std::string>>& domains) {
+  energy = std::make_unique<KProfEnergyCounters>(domains);
+  if (!energy->Available()) energy.reset();
+}
+
+void KProfEvent::BindMetrics() {
+  // operands resolve against the raw part of the report and the metrics
+  // defined before them
+  auto labels = names;
+  labels.push_back("Wall-time");
+  for (auto& entry : ReadSystemWide()) labels.push_back(entry.GetName());
+
+  for (size_t i = 0; i < metrics.size();) {
+    if (metrics[i].Bind(labels)) {
+      labels.push_back(metrics[i].GetName());
+      ++i;
+      continue;
+    }
+    std::cerr << "Metric " << metrics[i].GetName()
+              << " uses a counter that is not available. Ignoring metric."
+              << std::endl;
+    metrics.erase(metrics.begin() + i);
+  }
+  metricInputs.assign(labels.size(), 0);
+}
+
 void KProfEvent::ReadCounterList(const std::string& filename) {
   // Event file MUST be a csv file with the format
   // event_title,EVENT_TYPE,EVENT_NAME
+  // Derived metrics may be defined on lines of the form
+  // metric_title = expression
 
   std::ifstream configFile(filename);
   if (!configFile.is_open()) {
@@ -473,8 +843,16 @@ void KProfEvent::ReadCounterList(const std::string& filename) {
   }
 
   std::string line;
-  int leader = -1;
+  std::vector<CounterSpec> specs;
+  std::vector<std::pair<std::string, std::string>> energyDomains;
   while (std::getline(configFile, line)) {
+    auto eqpos = line.find('=');
+    if (eqpos != std::string::npos) {
+      AddMetric(TrimSpaces(line.substr(0, eqpos)),
+                TrimSpaces(line.substr(eqpos + 1)));
+      continue;
+    }
+
     std::stringstream ss(line);
     std::string name;
     std::string counterType;
@@ -482,8 +860,13 @@ void KProfEvent::ReadCounterList(const std::string& filename) {
 
     if (std::getline(ss, name, ',') && std::getline(ss, counterType, ',') &&
         std::getline(ss, counterSpec)) {
+      if (counterType == "POWER") {
+        energyDomains.push_back({name, TrimSpaces(counterSpec)});
+        continue;
+      }
+      auto [specName, domain] = SplitDomain(TrimSpaces(counterSpec));
       int type = TypeLookup(counterType);
-      int spec = TypeLookup(counterSpec);
+      int spec = TypeLookup(specName);
       if (type == -1) {
         std::cerr << "Invalid type specified in line " << line
                   << ". Ignoring counter." << std ::endl;
@@ -492,15 +875,19 @@ void KProfEvent::ReadCounterList(const std::string& filename) {
                   << ". Ignoring counter." << std ::endl;
 
       } else {
-        // Attempt to initialize counter
-        // Force to userland for now
-        RegisterCounter(name, leader, type, spec, USER);
+        AddCounterSpec(specs, name, type, (uint64_t)spec, domain);
       }
     }
   }
 
+  // energy readings are bound by the metrics like counters
+  if (!energyDomains.empty()) OpenEnergy(energyDomains);
+
+  // Attempt to initialize counters
+  RegisterCounterSet(specs);
+
   // After this loop, if no events remain, throw an error
-  if (events.size() == 0) {
+  if (events.size() == 0 && !energy) {
     names.resize(0);
     throw std::runtime_error(
         "No counter is available. Please check your code/system!");
@@ -553,10 +940,18 @@ void KProfEvent::ParseEnvConfig(std::string& parsedEnv) {
     if (!token.empty()) configList.push_back(token);
   }
 
-  // force only first counter to be leader
-  int leader = -1;
+  std::vector<CounterSpec> specs;
+  std::vector<std::pair<std::string, std::string>> energyDomains;
   // now we can parse each config
   for (auto& token : configList) {
+    // metric tokens have the form name=expression
+    auto eqpos = token.find('=');
+    if (eqpos != std::string::npos) {
+      AddMetric(TrimSpaces(token.substr(0, eqpos)),
+                TrimSpaces(token.substr(eqpos + 1)));
+      continue;
+    }
+
     // token structure is name,T:VAL;, name is a label str, T a type str and
     // VAL is a value str
     // find the comma
@@ -571,9 +966,15 @@ void KProfEvent::ParseEnvConfig(std::string& parsedEnv) {
         std::string valuestr =
             typeVal.substr(colonpos + 1);  // we have the value now
 
+        if (typestr == "POWER") {
+          energyDomains.push_back({name, valuestr});
+          continue;
+        }
+
         // now we can register the counter
+        auto [specName, domain] = SplitDomain(valuestr);
         int type = PerfTypeLookup(typestr);
-        int spec = TypeLookup(valuestr);
+        int spec = TypeLookup(specName);
 
         if (type == -1) {
           std::cerr << "Invalid type specified at " << token
@@ -583,8 +984,7 @@ void KProfEvent::ParseEnvConfig(std::string& parsedEnv) {
                     << ". Ignoring counter." << std ::endl;
 
         } else {
-          // Attempt to initialize counter
-          RegisterCounter(name, leader, type, spec, USER);
+          AddCounterSpec(specs, name, type, (uint64_t)spec, domain);
         }
       } else {
         ShowErrForToken(token);
@@ -595,6 +995,9 @@ void KProfEvent::ParseEnvConfig(std::string& parsedEnv) {
   }
 
   // loop for counter checking has ended here
+  if (!energyDomains.empty()) OpenEnergy(energyDomains);
+  RegisterCounterSet(specs);
+
   // After this loop, if no events remain, throw an error
   if (events.size() == 0) {
     names.resize(0);
@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <csignal>
+#include <thread>
+
+#include "Collector.hpp"
+#include "Columnar.hpp"
+#include "Compare.hpp"
+#include "ResultStore.hpp"
+
+using namespace KProf;
+namespace fs = std::filesystem;
+
+// kprof <command> [args]: offline tools around the data written by KProf.
+
+void Usage(const char* argv0) {
+  std::cerr
+      << "Usage: " << argv0 << " <command> [options]\n\n"
+      << "Commands:\n"
+      << "  compare BASELINE CURRENT [--alpha A] [--threshold T]\n"
+      << "          [--higher-is-better COL1,COL2,...]\n"
+      << "          [--lower-is-better COL1,COL2,...]\n"
+      << "      Compares the runs in CURRENT against BASELINE, which are CSV\n"
+      << "      or columnar (.kpc) files, or directories of them matched by\n"
+      << "      name. Exits with status 1 if any counter regressed\n"
+      << "      significantly. Counts are lower-is-better, derived metrics\n"
+      << "      go by their name (IPC higher, CPI lower), and columns of an\n"
+      << "      unknown direction are only reported as changed.\n"
+      << "  aggregate [--segment NAME] [--capacity N] [--interval MS]\n"
+      << "      Creates the shared-memory segment worker processes publish\n"
+      << "      their reports into (see KProfPublisher), and prints the\n"
+      << "      job-level report with per-rank imbalance on SIGINT/SIGTERM.\n"
+      << "  convert FILE.kpc [OUT.csv] [--info]\n"
+      << "      Writes a columnar file as CSV, to stdout without OUT.csv.\n"
+      << "      --info prints its metadata, columns and chunks instead.\n"
+      << "  query [--store DIR] [--label L] [--host H] [--revision R]\n"
+      << "        [--config HASH] [--since T] [--until T] [--series]\n"
+      << "        [--column C [--stats] [--by revision|day|week|month]]\n"
+      << "      Prints the records of the results store matching the filters\n"
+      << "      as CSV, only column C with --column. --stats summarizes C per\n"
+      << "      series and group instead, --series lists the series. Times\n"
+      << "      are e.g. 90d before now or a date 2024-05-01.\n"
+      << "  ingest FILE... --label L [--store DIR] [--revision R] [--host H]\n"
+      << "         [--time T]\n"
+      << "      Appends each run of CSV or columnar (.kpc) files to the\n"
+      << "      results store, by default stamped with the current time.\n"
+      << std::endl;
+}
+
+int Compare(int argc, char* argv[]) {
+  std::vector<std::string> paths;
+  CompareOptions options;
+
+  for (int i = 0; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--alpha" && i + 1 < argc) {
+      options.alpha = std::stod(argv[++i]);
+    } else if (arg == "--threshold" && i + 1 < argc) {
+      options.threshold = std::stod(argv[++i]);
+    } else if (arg == "--higher-is-better" && i + 1 < argc) {
+      std::stringstream ss(argv[++i]);
+      std::string column;
+      while (std::getline(ss, column, ','))
+        options.higherIsBetter.insert(column);
+    } else if (arg == "--lower-is-better" && i + 1 < argc) {
+      std::stringstream ss(argv[++i]);
+      std::string column;
+      while (std::getline(ss, column, ','))
+        options.lowerIsBetter.insert(column);
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 2;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.size() != 2) return -1;
+
+  // pairs of (baseline, current) files
+  std::vector<std::pair<fs::path, fs::path>> pairs;
+  if (fs::is_directory(paths[0]) && fs::is_directory(paths[1])) {
+    for (auto& entry : fs::directory_iterator(paths[0])) {
+      auto extension = entry.path().extension();
+      if (extension != ".csv" && extension != ".kpc") continue;
+      auto current = fs::path(paths[1]) / entry.path().filename();
+      if (fs::exists(current))
+        pairs.push_back({entry.path(), current});
+      else
+        std::cerr << "No current data for " << entry.path().filename()
+                  << ". Skipping." << std::endl;
+    }
+    std::sort(pairs.begin(), pairs.end());
+  } else {
+    pairs.push_back({paths[0], paths[1]});
+  }
+
+  size_t regressions = 0;
+  for (auto& [baselineFile, currentFile] : pairs) {
+    auto results = CompareSamples(LoadSamples(baselineFile),
+                                  LoadSamples(currentFile), options);
+    PrintComparison(currentFile.filename().string(), results);
+    for (auto& res : results)
+      if (res.regression) regressions++;
+  }
+
+  std::cout << regressions << " significant regression(s)." << std::endl;
+  return regressions ? 1 : 0;
+}
+
+volatile std::sig_atomic_t stopAggregating = 0;
+
+int Aggregate(int argc, char* argv[]) {
+  std::string segment = "/kprof";
+  size_t capacity = 1024;
+  int interval = 10;
+
+  for (int i = 0; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--segment" && i + 1 < argc) {
+      segment = argv[++i];
+    } else if (arg == "--capacity" && i + 1 < argc) {
+      capacity = std::stoul(argv[++i]);
+    } else if (arg == "--interval" && i + 1 < argc) {
+      interval = std::stoi(argv[++i]);
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 2;
+    }
+  }
+
+  KProfAggregator aggregator(segment, capacity);
+  std::signal(SIGINT, [](int) { stopAggregating = 1; });
+  std::signal(SIGTERM, [](int) { stopAggregating = 1; });
+  std::cerr << "Collecting into " << segment << ", stop with Ctrl-C."
+            << std::endl;
+
+  while (!stopAggregating) {
+    if (aggregator.Drain() == 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+  }
+  aggregator.Drain();
+  aggregator.PrintReport();
+  return 0;
+}
+
+int Convert(int argc, char* argv[]) {
+  std::vector<std::string> paths;
+  bool info = false;
+  for (int i = 0; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--info") {
+      info = true;
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 2;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty() || paths.size() > 2) return -1;
+
+  KProfColumnReader reader(paths[0]);
+  if (info) {
+    for (auto& [key, value] : reader.GetMetadata())
+      std::cout << key << ": " << value << "\n";
+    std::cout << reader.GetRows() << " rows in " << reader.GetNumChunks()
+              << " chunk(s)\n";
+    for (size_t i = 0; i < reader.GetColumns().size(); ++i)
+      std::cout << "  " << reader.GetColumns()[i]
+                << (reader.IsDerived(i) ? " (derived)" : "") << "\n";
+    return 0;
+  }
+
+  if (paths.size() == 1) {
+    reader.WriteCSV(std::cout);
+    return 0;
+  }
+  std::ofstream out(paths[1]);
+  if (!out.is_open()) {
+    std::cerr << "Error opening file: " << paths[1] << std::endl;
+    return 2;
+  }
+  reader.WriteCSV(out);
+  return 0;
+}
+
+std::string HexHash(uint64_t hash) {
+  std::ostringstream text;
+  text << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return text.str();
+}
+
+int Query(int argc, char* argv[]) {
+  StoreOptions options;
+  StoreQuery query;
+  std::string column;
+  bool stats = false, listSeries = false;
+  auto grouping = StoreGrouping::NONE;
+
+  for (int i = 0; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--store" && i + 1 < argc) {
+      options.directory = argv[++i];
+    } else if (arg == "--label" && i + 1 < argc) {
+      query.label = argv[++i];
+    } else if (arg == "--host" && i + 1 < argc) {
+      query.host = argv[++i];
+    } else if (arg == "--revision" && i + 1 < argc) {
+      query.revision = argv[++i];
+    } else if (arg == "--config" && i + 1 < argc) {
+      query.configHash = std::stoull(argv[++i], nullptr, 16);
+    } else if (arg == "--since" && i + 1 < argc) {
+      query.from = ParseStoreTime(argv[++i]);
+    } else if (arg == "--until" && i + 1 < argc) {
+      query.to = ParseStoreTime(argv[++i]);
+    } else if (arg == "--column" && i + 1 < argc) {
+      column = argv[++i];
+    } else if (arg == "--stats") {
+      stats = true;
+    } else if (arg == "--series") {
+      listSeries = true;
+    } else if (arg == "--by" && i + 1 < argc) {
+      std::string by(argv[++i]);
+      if (by == "revision") grouping = StoreGrouping::REVISION;
+      else if (by == "day") grouping = StoreGrouping::DAY;
+      else if (by == "week") grouping = StoreGrouping::WEEK;
+      else if (by == "month") grouping = StoreGrouping::MONTH;
+      else {
+        std::cerr << "Unknown grouping " << by << std::endl;
+        return 2;
+      }
+      stats = true;
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 2;
+    }
+  }
+  if (stats && column.empty()) return -1;
+
+  KProfResultStore store(options);
+  if (listSeries) {
+    std::cout << "label,host,config,records,revisions,first,last\n";
+    for (auto& series : store.GetSeries())
+      std::cout << series.label << "," << series.host << ","
+                << HexHash(series.configHash) << "," << series.records << ","
+                << series.revisions << "," << FormatStoreTime(series.first)
+                << "," << FormatStoreTime(series.last) << "\n";
+    return 0;
+  }
+  if (stats) {
+    KProfResultStore::PrintSummary(store.Summarize(query, column, grouping),
+                                   column);
+    return 0;
+  }
+
+  auto records = store.Query(query);
+  // the union of the columns, in the order first seen
+  std::vector<std::string> columns;
+  if (!column.empty())
+    columns.push_back(column);
+  else
+    for (auto& record : records)
+      for (auto& [name, value] : record.values)
+        if (std::find(columns.begin(), columns.end(), name) == columns.end())
+          columns.push_back(name);
+
+  std::cout << "time,label,host,revision,config";
+  for (auto& name : columns) std::cout << "," << name;
+  std::cout << "\n";
+  for (auto& record : records) {
+    std::cout << FormatStoreTime(record.timestamp) << "," << record.label
+              << "," << record.host << "," << record.revision << ","
+              << HexHash(record.configHash);
+    for (auto& name : columns) {
+      auto value = record.Get(name);
+      std::cout << ",";
+      if (!std::isnan(value)) std::cout << value;
+    }
+    std::cout << "\n";
+  }
+  return 0;
+}
+
+int Ingest(int argc, char* argv[]) {
+  StoreOptions options;
+  std::vector<std::string> paths;
+  std::string label;
+  int64_t timestamp = 0;
+
+  for (int i = 0; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--store" && i + 1 < argc) {
+      options.directory = argv[++i];
+    } else if (arg == "--label" && i + 1 < argc) {
+      label = argv[++i];
+    } else if (arg == "--revision" && i + 1 < argc) {
+      options.revision = argv[++i];
+    } else if (arg == "--host" && i + 1 < argc) {
+      options.host = argv[++i];
+    } else if (arg == "--time" && i + 1 < argc) {
+      timestamp = ParseStoreTime(argv[++i]);
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 2;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty() || label.empty()) return -1;
+
+  KProfResultStore store(options);
+  size_t records = 0;
+  for (auto& path : paths) {
+    auto table = LoadSamples(path);
+    auto runs = table.values.empty() ? 0 : table.values[0].size();
+    for (size_t run = 0; run < runs; ++run) {
+      std::vector<std::pair<std::string, double>> values;
+      for (size_t c = 0; c < table.columns.size(); ++c)
+        values.push_back({table.columns[c], table.values[c][run]});
+      store.Append(label, values, timestamp);
+      records++;
+    }
+  }
+  std::cout << records << " record(s) added to " << store.GetDirectory()
+            << std::endl;
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  std::string command(argv[1]);
+  int status = -1;
+  try {
+    if (command == "compare") status = Compare(argc - 2, argv + 2);
+    if (command == "aggregate") status = Aggregate(argc - 2, argv + 2);
+    if (command == "convert") status = Convert(argc - 2, argv + 2);
+    if (command == "query") status = Query(argc - 2, argv + 2);
+    if (command == "ingest") status = Ingest(argc - 2, argv + 2);
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+
+  if (status == -1) {
+    Usage(argv[0]);
+    return 2;
+  }
+  return status;
+}